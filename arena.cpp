@@ -0,0 +1,177 @@
+#include "arena.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <sys/mman.h>
+
+//slab的大小，slab在大页块中按它对齐，释放时由地址找到slab的头部
+static const size_t SLAB_SIZE = 256 * 1024;
+//对象的大小分级：64B到32KB，每级翻倍
+static const int MIN_SHIFT = 6;
+static const int MAX_SHIFT = 15;
+static const int CLASS_COUNT = MAX_SHIFT - MIN_SHIFT + 1;
+//slab头部占用的空间，之后的对象按64字节对齐
+static const size_t SLAB_HEADER_SIZE = 64;
+
+static size_t huge_round(size_t size)
+{
+    return (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+}
+
+void* huge_alloc(size_t size, bool* hugetlb)
+{
+    size_t len = huge_round(size);
+    void* p = mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if(p != MAP_FAILED){
+        if(hugetlb){
+            *hugetlb = true;
+        }
+        return p;
+    }
+    if(hugetlb){
+        *hugetlb = false;
+    }
+    //多映射一个大页再裁掉首尾，使起始地址按2MB对齐，透明大页才能覆盖整个区域
+    char* raw = (char*)mmap(0, len + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(raw == MAP_FAILED){
+        return NULL;
+    }
+    char* base = (char*)(((uintptr_t)raw + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+    if(base > raw){
+        munmap(raw, base - raw);
+    }
+    size_t tail = (raw + len + HUGE_PAGE_SIZE) - (base + len);
+    if(tail > 0){
+        munmap(base + len, tail);
+    }
+    madvise(base, len, MADV_HUGEPAGE);
+    return base;
+}
+
+void huge_free(void* p, size_t size)
+{
+    if(p){
+        munmap(p, huge_round(size));
+    }
+}
+
+struct free_node
+{
+    free_node* next;
+};
+
+//每个线程一个，只有所属线程访问local、cursor与chunk；remote由其他线程压入，所属线程整体取走
+struct arena
+{
+    free_node* local[CLASS_COUNT];
+    std::atomic<free_node*> remote[CLASS_COUNT];
+    char* cursor[CLASS_COUNT];      //当前slab中尚未分配的位置
+    char* limit[CLASS_COUNT];
+    char* chunk;                    //正在切分成slab的大页块
+    char* chunk_end;
+};
+
+struct slab_header
+{
+    arena* owner;
+    int cls;
+};
+
+//线程退出时不回收它的arena：工作线程与reactor和进程一样长，其他线程释放到这里的内存只是不再被使用
+static thread_local arena* t_arena = NULL;
+
+static int size_class(size_t size)
+{
+    int shift = MIN_SHIFT;
+    while(((size_t)1 << shift) < size){
+        shift++;
+    }
+    return shift > MAX_SHIFT ? -1 : shift - MIN_SHIFT;
+}
+
+static arena* current_arena()
+{
+    if(!t_arena){
+        arena* a = new arena;
+        for(int i = 0; i < CLASS_COUNT; i++){
+            a->local[i] = NULL;
+            a->remote[i] = NULL;
+            a->cursor[i] = NULL;
+            a->limit[i] = NULL;
+        }
+        a->chunk = a->chunk_end = NULL;
+        t_arena = a;
+    }
+    return t_arena;
+}
+
+static bool new_slab(arena* a, int cls)
+{
+    if(a->chunk == a->chunk_end){
+        a->chunk = (char*)huge_alloc(HUGE_PAGE_SIZE);
+        if(!a->chunk){
+            a->chunk_end = NULL;
+            return false;
+        }
+        a->chunk_end = a->chunk + HUGE_PAGE_SIZE;
+    }
+    char* slab = a->chunk;
+    a->chunk += SLAB_SIZE;
+    slab_header* h = (slab_header*)slab;
+    h->owner = a;
+    h->cls = cls;
+    a->cursor[cls] = slab + SLAB_HEADER_SIZE;
+    a->limit[cls] = slab + SLAB_SIZE;
+    return true;
+}
+
+void* arena_alloc(size_t size)
+{
+    int cls = size_class(size);
+    if(cls < 0){
+        return malloc(size);
+    }
+    arena* a = current_arena();
+    free_node* n = a->local[cls];
+    if(!n){
+        n = a->remote[cls].exchange(NULL, std::memory_order_acquire);
+    }
+    if(n){
+        a->local[cls] = n->next;
+        return n;
+    }
+    size_t obj = (size_t)1 << (cls + MIN_SHIFT);
+    if(a->cursor[cls] + obj > a->limit[cls] && !new_slab(a, cls)){
+        return NULL;
+    }
+    void* p = a->cursor[cls];
+    a->cursor[cls] += obj;
+    return p;
+}
+
+void arena_free(void* p, size_t size)
+{
+    if(!p){
+        return;
+    }
+    int cls = size_class(size);
+    if(cls < 0){
+        free(p);
+        return;
+    }
+    slab_header* h = (slab_header*)((uintptr_t)p & ~(uintptr_t)(SLAB_SIZE - 1));
+    free_node* n = (free_node*)p;
+    arena* a = h->owner;
+    if(a == t_arena){
+        n->next = a->local[cls];
+        a->local[cls] = n;
+        return;
+    }
+    //所属线程只会一次取走整条链表，不存在ABA问题
+    free_node* head = a->remote[cls].load(std::memory_order_relaxed);
+    do{
+        n->next = head;
+    }while(!a->remote[cls].compare_exchange_weak(head, n, std::memory_order_release, std::memory_order_relaxed));
+}
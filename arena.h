@@ -0,0 +1,24 @@
+#ifndef ARENA_H_INCLUDED
+#define ARENA_H_INCLUDED
+
+#include <stddef.h>
+
+//大页内存与每线程的小块内存分配
+//huge_alloc：长期存在的大块内存(连接表、内容包)放在2MB的大页上，按fd随机访问时减少TLB缺失；
+//优先使用预留的大页(MAP_HUGETLB)，没有时退回到按2MB对齐的普通映射并建议内核使用透明大页
+//arena_alloc：请求路径上的小块内存(广播消息、微缓存条目)从当前线程自己的slab中分配，不经过malloc的锁；
+//slab从大页块中切出，其他线程释放的内存挂到所属线程的远程释放链表上，所属线程下次分配时一次取回
+
+static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+//分配至少size字节、按大页对齐的内存，失败时返回NULL；hugetlb不为NULL时返回是否得到了预留的大页
+void* huge_alloc(size_t size, bool* hugetlb = NULL);
+//释放huge_alloc分配的内存，size与分配时相同
+void huge_free(void* p, size_t size);
+
+//分配size字节，超过32KB的直接使用malloc；内存至少按16字节对齐
+void* arena_alloc(size_t size);
+//释放arena_alloc分配的内存，size与分配时相同，可以由任意线程调用
+void arena_free(void* p, size_t size);
+
+#endif // ARENA_H_INCLUDED
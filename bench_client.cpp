@@ -0,0 +1,644 @@
+//端到端的性能回归测试：在回环地址上启动服务器，用生成的doc_root跑固定的几种负载，
+//记录每秒请求数、延迟分位数以及服务器进程的硬件计数器(每个请求的周期、指令、缓存缺失与上下文切换)，
+//可以保存为基线，之后的运行与基线比较，超出容差时返回非0
+//用法：bench_client [-s server] [-p port] [-t server_threads] [-c connections] [-d seconds]
+//                    [-w save_baseline] [-b baseline] [-T tolerance_percent] [-a "server args"]
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <linux/perf_event.h>
+#include <atomic>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+//fixture中小文件的数量与大小、大文件的大小
+static const int SMALL_FILES = 64;
+static const int SMALL_SIZE = 1024;
+static const int LARGE_SIZE = 1024 * 1024;
+//流水线负载一次发送的请求数
+static const int PIPELINE_DEPTH = 8;
+//等待一个响应的最长时间，超时计为错误并重新连接
+static const int RECV_TIMEOUT_MS = 1000;
+
+enum WORKLOAD
+{
+    SMALL,          //keep-alive，轮流请求64个小文件
+    LARGE,          //keep-alive，请求1MB的文件
+    KEEPALIVE,      //keep-alive，反复请求同一个小文件，即缓存命中的最短路径
+    CHURN,          //每个请求新建连接，Connection: close
+    PIPELINED,      //keep-alive，一次发送8个请求再依次读取响应
+    WORKLOAD_COUNT
+};
+
+static const char* workload_names[WORKLOAD_COUNT] = {"small", "large", "keepalive", "churn", "pipelined"};
+
+//记录的计数器，硬件计数器不可用(虚拟机或perf_event_paranoid)时为-1
+enum COUNTER
+{
+    CYCLES, INSTRUCTIONS, CACHE_MISSES, CONTEXT_SWITCHES, COUNTER_COUNT
+};
+
+static const char* counter_names[COUNTER_COUNT] = {"cycles", "instructions", "cache_misses", "context_switches"};
+
+static struct sockaddr_in server_adr;
+static std::atomic<bool> stop_flag(false);
+static char fixture_dir[64];
+
+static long long now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static bool write_file(const char* path, size_t size, unsigned seed)
+{
+    FILE* fp = fopen(path, "wb");
+    if(!fp){
+        return false;
+    }
+    std::vector<char> buf(size);
+    for(size_t i = 0; i < size; i++){
+        buf[i] = 'a' + (i * 7 + seed) % 26;
+    }
+    bool ok = fwrite(buf.data(), 1, size, fp) == size;
+    fclose(fp);
+    return ok;
+}
+
+//生成doc_root：s0.html..s63.html与large.bin，内容固定，每次运行结果可比
+static bool make_fixture()
+{
+    strcpy(fixture_dir, "/tmp/bench_root.XXXXXX");
+    if(!mkdtemp(fixture_dir)){
+        return false;
+    }
+    //服务器只应答其他组可读的文件
+    chmod(fixture_dir, 0755);
+    char path[128];
+    for(int i = 0; i < SMALL_FILES; i++){
+        snprintf(path, sizeof(path), "%s/s%d.html", fixture_dir, i);
+        if(!write_file(path, SMALL_SIZE, i)){
+            return false;
+        }
+    }
+    snprintf(path, sizeof(path), "%s/large.bin", fixture_dir);
+    return write_file(path, LARGE_SIZE, 0);
+}
+
+static void remove_fixture()
+{
+    char path[128];
+    for(int i = 0; i < SMALL_FILES; i++){
+        snprintf(path, sizeof(path), "%s/s%d.html", fixture_dir, i);
+        unlink(path);
+    }
+    snprintf(path, sizeof(path), "%s/large.bin", fixture_dir);
+    unlink(path);
+    rmdir(fixture_dir);
+}
+
+static int open_counter(pid_t pid, uint32_t type, uint64_t config)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    //服务器exec时开始计数，之后创建的工作线程继承计数器，读取时包含所有线程
+    attr.enable_on_exec = 1;
+    attr.inherit = 1;
+    attr.exclude_hv = 1;
+    int fd = syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0);
+    if(fd < 0 && (errno == EACCES || errno == EPERM)){
+        //perf_event_paranoid不允许统计内核态时只统计用户态
+        attr.exclude_kernel = 1;
+        fd = syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0);
+    }
+    return fd;
+}
+
+static void read_counters(const int* fds, long long* values)
+{
+    for(int i = 0; i < COUNTER_COUNT; i++){
+        uint64_t v = 0;
+        values[i] = fds[i] >= 0 && read(fds[i], &v, sizeof(v)) == sizeof(v) ? (long long)v : -1;
+    }
+}
+
+//启动服务器，stdout与stderr丢弃；子进程在计数器打开之后才exec
+static pid_t start_server(const char* server, int port, int threads, const char* extra, int* fds)
+{
+    std::vector<std::string> args;
+    args.push_back(server);
+    args.push_back("-t");
+    args.push_back(std::to_string(threads));
+    args.push_back("-d");
+    args.push_back(fixture_dir);
+    if(extra){
+        char* copy = strdup(extra);
+        for(char* tok = strtok(copy, " "); tok; tok = strtok(NULL, " ")){
+            args.push_back(tok);
+        }
+        free(copy);
+    }
+    args.push_back("127.0.0.1");
+    args.push_back(std::to_string(port));
+
+    int ready[2];
+    if(pipe(ready) < 0){
+        return -1;
+    }
+    pid_t pid = fork();
+    if(pid < 0){
+        return -1;
+    }
+    if(pid == 0){
+        close(ready[1]);
+        char c;
+        if(::read(ready[0], &c, 1) != 1){
+            _exit(1);
+        }
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, 1);
+        dup2(null_fd, 2);
+        std::vector<char*> argv;
+        for(size_t i = 0; i < args.size(); i++){
+            argv.push_back((char*)args[i].c_str());
+        }
+        argv.push_back(NULL);
+        execv(server, argv.data());
+        _exit(127);
+    }
+    close(ready[0]);
+    fds[CYCLES] = open_counter(pid, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    fds[INSTRUCTIONS] = open_counter(pid, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    fds[CACHE_MISSES] = open_counter(pid, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    fds[CONTEXT_SWITCHES] = open_counter(pid, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES);
+    if(::write(ready[1], "x", 1) != 1){
+        kill(pid, SIGKILL);
+    }
+    close(ready[1]);
+
+    //等待服务器开始监听
+    for(int i = 0; i < 100; i++){
+        int fd = socket(PF_INET, SOCK_STREAM, 0);
+        int ret = connect(fd, (struct sockaddr*)&server_adr, sizeof(server_adr));
+        close(fd);
+        if(ret == 0){
+            return pid;
+        }
+        if(waitpid(pid, NULL, WNOHANG) == pid){
+            return -1;
+        }
+        usleep(50 * 1000);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+static void stop_server(pid_t pid)
+{
+    kill(pid, SIGTERM);
+    for(int i = 0; i < 40; i++){
+        if(waitpid(pid, NULL, WNOHANG) == pid){
+            return;
+        }
+        usleep(50 * 1000);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+}
+
+//一个客户端连接，带读缓冲，按Content-Length读取响应
+struct bench_conn
+{
+    int fd;
+    char buf[64 * 1024];
+    size_t len;
+};
+
+static bool conn_open(bench_conn& c)
+{
+    c.len = 0;
+    c.fd = socket(PF_INET, SOCK_STREAM, 0);
+    if(c.fd < 0){
+        return false;
+    }
+    struct timeval tv;
+    tv.tv_sec = RECV_TIMEOUT_MS / 1000;
+    tv.tv_usec = RECV_TIMEOUT_MS % 1000 * 1000;
+    setsockopt(c.fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    int on = 1;
+    setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if(connect(c.fd, (struct sockaddr*)&server_adr, sizeof(server_adr)) < 0){
+        close(c.fd);
+        c.fd = -1;
+        return false;
+    }
+    return true;
+}
+
+static void conn_close(bench_conn& c)
+{
+    if(c.fd >= 0){
+        close(c.fd);
+        c.fd = -1;
+    }
+}
+
+static bool send_all(int fd, const char* data, size_t len)
+{
+    while(len > 0){
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if(n <= 0){
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+//读取一个响应，只接受200；响应体直接丢弃
+static bool read_response(bench_conn& c)
+{
+    char* end = NULL;
+    while(!(end = (char*)memmem(c.buf, c.len, "\r\n\r\n", 4))){
+        if(c.len == sizeof(c.buf)){
+            return false;
+        }
+        ssize_t n = recv(c.fd, c.buf + c.len, sizeof(c.buf) - c.len, 0);
+        if(n <= 0){
+            return false;
+        }
+        c.len += n;
+    }
+    size_t head_len = end + 4 - c.buf;
+    bool ok = c.len > 12 && memcmp(c.buf + 9, "200", 3) == 0;
+    long long body = -1;
+    for(char* line = strstr(c.buf, "\r\n"); line && line < end; line = strstr(line + 2, "\r\n")){
+        if(strncasecmp(line + 2, "Content-Length:", 15) == 0){
+            body = atoll(line + 17);
+        }
+    }
+    if(body < 0){
+        return false;
+    }
+    //缓冲中已有的部分
+    size_t have = c.len - head_len;
+    if((long long)have >= body){
+        memmove(c.buf, c.buf + head_len + body, have - body);
+        c.len = have - body;
+        return ok;
+    }
+    body -= have;
+    c.len = 0;
+    while(body > 0){
+        ssize_t n = recv(c.fd, c.buf, std::min<long long>(body, sizeof(c.buf)), 0);
+        if(n <= 0){
+            return false;
+        }
+        body -= n;
+    }
+    return ok;
+}
+
+struct worker_result
+{
+    WORKLOAD workload;
+    int id;
+    long long requests;
+    long long errors;
+    std::vector<uint32_t> latency_us;
+};
+
+static void build_request(std::string& out, WORKLOAD w, unsigned n)
+{
+    char req[256];
+    const char* connection = w == CHURN ? "close" : "keep-alive";
+    if(w == LARGE){
+        snprintf(req, sizeof(req), "GET /large.bin HTTP/1.1\r\nHost: bench\r\nConnection: %s\r\n\r\n", connection);
+    }
+    else if(w == KEEPALIVE){
+        snprintf(req, sizeof(req), "GET /s0.html HTTP/1.1\r\nHost: bench\r\nConnection: %s\r\n\r\n", connection);
+    }
+    else{
+        snprintf(req, sizeof(req), "GET /s%u.html HTTP/1.1\r\nHost: bench\r\nConnection: %s\r\n\r\n",
+                 n % SMALL_FILES, connection);
+    }
+    out.append(req);
+}
+
+static void* worker(void* arg)
+{
+    worker_result* r = (worker_result*)arg;
+    bench_conn* c = new bench_conn;
+    c->fd = -1;
+    unsigned n = r->id * 7;
+    int depth = r->workload == PIPELINED ? PIPELINE_DEPTH : 1;
+    std::string batch;
+    while(!stop_flag.load(std::memory_order_relaxed)){
+        if(c->fd < 0 && !conn_open(*c)){
+            r->errors++;
+            usleep(1000);
+            continue;
+        }
+        batch.clear();
+        for(int i = 0; i < depth; i++){
+            build_request(batch, r->workload, n++);
+        }
+        long long start = now_us();
+        if(!send_all(c->fd, batch.data(), batch.size())){
+            r->errors += depth;
+            conn_close(*c);
+            continue;
+        }
+        for(int i = 0; i < depth; i++){
+            if(!read_response(*c)){
+                //没有应答的请求全部计为错误
+                r->errors += depth - i;
+                conn_close(*c);
+                break;
+            }
+            r->requests++;
+            r->latency_us.push_back(now_us() - start);
+        }
+        if(r->workload == CHURN){
+            conn_close(*c);
+        }
+    }
+    conn_close(*c);
+    delete c;
+    return NULL;
+}
+
+//一个负载的结果，键为指标名
+typedef std::map<std::string, double> metrics;
+
+static double percentile(const std::vector<uint32_t>& sorted, double p)
+{
+    if(sorted.empty()){
+        return 0;
+    }
+    size_t i = (size_t)(p * (sorted.size() - 1));
+    return sorted[i];
+}
+
+static metrics run_workload(WORKLOAD w, int connections, int seconds, const int* fds)
+{
+    std::vector<worker_result> results(connections);
+    std::vector<pthread_t> threads(connections);
+    long long before[COUNTER_COUNT], after[COUNTER_COUNT];
+    stop_flag = false;
+    read_counters(fds, before);
+    long long start = now_us();
+    for(int i = 0; i < connections; i++){
+        results[i].workload = w;
+        results[i].id = i;
+        results[i].requests = 0;
+        results[i].errors = 0;
+        pthread_create(&threads[i], NULL, worker, &results[i]);
+    }
+    sleep(seconds);
+    stop_flag = true;
+    for(int i = 0; i < connections; i++){
+        pthread_join(threads[i], NULL);
+    }
+    long long elapsed = now_us() - start;
+    read_counters(fds, after);
+
+    long long requests = 0, errors = 0;
+    std::vector<uint32_t> latency;
+    for(int i = 0; i < connections; i++){
+        requests += results[i].requests;
+        errors += results[i].errors;
+        latency.insert(latency.end(), results[i].latency_us.begin(), results[i].latency_us.end());
+    }
+    std::sort(latency.begin(), latency.end());
+    metrics m;
+    m["rps"] = requests * 1e6 / elapsed;
+    m["p50_us"] = percentile(latency, 0.50);
+    m["p90_us"] = percentile(latency, 0.90);
+    m["p99_us"] = percentile(latency, 0.99);
+    m["p999_us"] = percentile(latency, 0.999);
+    m["errors"] = errors;
+    for(int i = 0; i < COUNTER_COUNT; i++){
+        if(before[i] >= 0 && after[i] >= 0 && requests > 0){
+            m[std::string(counter_names[i]) + "_per_req"] = (double)(after[i] - before[i]) / requests;
+        }
+    }
+    return m;
+}
+
+//基线文件每行为"负载 指标 值"
+static bool load_baseline(const char* path, std::map<std::string, metrics>& baseline)
+{
+    FILE* fp = fopen(path, "r");
+    if(!fp){
+        return false;
+    }
+    char workload[64], metric[64];
+    double value;
+    while(fscanf(fp, "%63s %63s %lf", workload, metric, &value) == 3){
+        baseline[workload][metric] = value;
+    }
+    fclose(fp);
+    return true;
+}
+
+static bool save_baseline(const char* path, const std::map<std::string, metrics>& results)
+{
+    FILE* fp = fopen(path, "w");
+    if(!fp){
+        return false;
+    }
+    for(std::map<std::string, metrics>::const_iterator w = results.begin(); w != results.end(); ++w){
+        for(metrics::const_iterator m = w->second.begin(); m != w->second.end(); ++m){
+            fprintf(fp, "%s %s %.3f\n", w->first.c_str(), m->first.c_str(), m->second);
+        }
+    }
+    fclose(fp);
+    return true;
+}
+
+//与基线比较，rps越高越好，其余指标越低越好；返回变差超过容差的指标数
+static int compare(const std::map<std::string, metrics>& baseline, const std::map<std::string, metrics>& results,
+                   double tolerance)
+{
+    int regressions = 0;
+    printf("\n%-10s %-26s %14s %14s %9s\n", "workload", "metric", "baseline", "current", "change");
+    for(std::map<std::string, metrics>::const_iterator w = results.begin(); w != results.end(); ++w){
+        std::map<std::string, metrics>::const_iterator bw = baseline.find(w->first);
+        if(bw == baseline.end()){
+            continue;
+        }
+        for(metrics::const_iterator m = w->second.begin(); m != w->second.end(); ++m){
+            metrics::const_iterator bm = bw->second.find(m->first);
+            if(bm == bw->second.end()){
+                continue;
+            }
+            double base = bm->second, cur = m->second;
+            bool higher_better = m->first == "rps";
+            double change = base != 0 ? (cur - base) / base : (cur == 0 ? 0 : 1);
+            bool worse = higher_better ? change < -tolerance : change > tolerance;
+            regressions += worse;
+            printf("%-10s %-26s %14.1f %14.1f %+8.1f%% %s\n", w->first.c_str(), m->first.c_str(),
+                   base, cur, change * 100, worse ? "REGRESSION" : "");
+        }
+    }
+    return regressions;
+}
+
+static void usage(const char* prog)
+{
+    printf("Usage: %s [-s server] [-p port] [-t server_threads] [-c connections] [-d seconds]\n"
+           "          [-w save_baseline] [-b baseline] [-T tolerance_percent] [-a \"server args\"] [workload...]\n", prog);
+    printf("  -s  server binary (default ./http_server), started on 127.0.0.1 with a generated doc_root\n");
+    printf("  -c  concurrent client connections, one thread each (default 8)\n");
+    printf("  -d  seconds per workload (default 5)\n");
+    printf("  -w  save the results as a baseline\n");
+    printf("  -b  compare with a baseline and exit 1 if any metric is worse than the tolerance (default 5%%)\n");
+    printf("  workloads: small large keepalive churn pipelined (default all)\n");
+}
+
+int main(int argc, char* argv[])
+{
+    const char* server = "./http_server";
+    int port = 18080;
+    int server_threads = 8;
+    int connections = 8;
+    int seconds = 5;
+    const char* save_path = NULL;
+    const char* baseline_path = NULL;
+    double tolerance = 0.05;
+    const char* extra = NULL;
+    int opt;
+    while((opt = getopt(argc, argv, "s:p:t:c:d:w:b:T:a:")) != -1){
+        switch(opt)
+        {
+        case 's': server = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 't': server_threads = atoi(optarg); break;
+        case 'c': connections = atoi(optarg); break;
+        case 'd': seconds = atoi(optarg); break;
+        case 'w': save_path = optarg; break;
+        case 'b': baseline_path = optarg; break;
+        case 'T': tolerance = atof(optarg) / 100; break;
+        case 'a': extra = optarg; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if(connections <= 0 || seconds <= 0 || server_threads <= 0){
+        usage(argv[0]);
+        return 1;
+    }
+    bool selected[WORKLOAD_COUNT];
+    for(int i = 0; i < WORKLOAD_COUNT; i++){
+        selected[i] = optind == argc;
+    }
+    for(int i = optind; i < argc; i++){
+        int w = 0;
+        while(w < WORKLOAD_COUNT && strcmp(argv[i], workload_names[w]) != 0){
+            w++;
+        }
+        if(w == WORKLOAD_COUNT){
+            usage(argv[0]);
+            return 1;
+        }
+        selected[w] = true;
+    }
+    std::map<std::string, metrics> baseline;
+    if(baseline_path && !load_baseline(baseline_path, baseline)){
+        printf("cannot read baseline %s\n", baseline_path);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    memset(&server_adr, 0, sizeof(server_adr));
+    server_adr.sin_family = AF_INET;
+    inet_pton(AF_INET, "127.0.0.1", &server_adr.sin_addr);
+    server_adr.sin_port = htons(port);
+
+    if(!make_fixture()){
+        printf("cannot create the doc_root fixture\n");
+        return 1;
+    }
+    int fds[COUNTER_COUNT];
+    pid_t pid = start_server(server, port, server_threads, extra, fds);
+    if(pid < 0){
+        printf("cannot start %s on port %d\n", server, port);
+        remove_fixture();
+        return 1;
+    }
+    for(int i = 0; i < COUNTER_COUNT; i++){
+        if(fds[i] < 0){
+            printf("counter %s is not available\n", counter_names[i]);
+        }
+    }
+
+    std::map<std::string, metrics> results;
+    printf("%-10s %10s %8s %8s %8s %8s %7s %12s %12s %12s %8s\n", "workload", "req/s", "p50us", "p90us", "p99us",
+           "p999us", "errors", "cycles/req", "instr/req", "llcmiss/req", "cs/req");
+    for(int w = 0; w < WORKLOAD_COUNT; w++){
+        if(!selected[w]){
+            continue;
+        }
+        metrics m = run_workload((WORKLOAD)w, connections, seconds, fds);
+        results[workload_names[w]] = m;
+        printf("%-10s %10.0f %8.0f %8.0f %8.0f %8.0f %7.0f", workload_names[w], m["rps"], m["p50_us"], m["p90_us"],
+               m["p99_us"], m["p999_us"], m["errors"]);
+        for(int i = 0; i < COUNTER_COUNT; i++){
+            std::string key = std::string(counter_names[i]) + "_per_req";
+            if(m.count(key)){
+                printf(i == CONTEXT_SWITCHES ? " %8.2f" : " %12.0f", m[key]);
+            }
+            else{
+                printf(i == CONTEXT_SWITCHES ? " %8s" : " %12s", "n/a");
+            }
+        }
+        printf("\n");
+        fflush(stdout);
+    }
+
+    stop_server(pid);
+    for(int i = 0; i < COUNTER_COUNT; i++){
+        if(fds[i] >= 0){
+            close(fds[i]);
+        }
+    }
+    remove_fixture();
+
+    if(save_path && !save_baseline(save_path, results)){
+        printf("cannot write baseline %s\n", save_path);
+        return 1;
+    }
+    if(baseline_path){
+        int regressions = compare(baseline, results, tolerance);
+        printf("%d regression(s) beyond %.1f%%\n", regressions, tolerance * 100);
+        return regressions > 0 ? 1 : 0;
+    }
+    return 0;
+}
@@ -0,0 +1,211 @@
+//离线打包工具：把网站根目录下的所有文件打包成一个内容包，供服务器的-b模式使用
+//用法：bundle_pack <doc_root> <bundle_file>
+//文件x旁边存在x.gz时，x.gz作为x的预压缩版本打包，客户端接受gzip时直接发送
+//先写入临时文件再rename，替换正在使用的包是原子的，之后向服务器发送SIGHUP即可切换
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <map>
+
+#include "content_bundle.h"
+
+struct source_file
+{
+    std::string path;       //url路径，如/index.html
+    std::string body;
+    std::string gz_body;
+    bool has_gz;
+};
+
+static std::string root;
+static std::map<std::string, std::string> files;    //url路径 -> 磁盘路径
+
+static int collect(const char* fpath, const struct stat* sb, int typeflag, struct FTW*)
+{
+    //与服务器的do_request保持一致：只打包其他用户可读的普通文件
+    if(typeflag == FTW_F && S_ISREG(sb->st_mode) && (sb->st_mode & S_IROTH)){
+        std::string url = fpath + root.size();
+        if(url.empty() || url[0] != '/'){
+            url = "/" + url;
+        }
+        files[url] = fpath;
+    }
+    return 0;
+}
+
+static bool read_file(const std::string& path, std::string& out)
+{
+    FILE* fp = fopen(path.c_str(), "rb");
+    if(!fp){
+        return false;
+    }
+    char buf[65536];
+    size_t n;
+    out.clear();
+    while((n = fread(buf, 1, sizeof(buf), fp)) > 0){
+        out.append(buf, n);
+    }
+    bool ok = !ferror(fp);
+    fclose(fp);
+    return ok;
+}
+
+static bool ends_with(const std::string& s, const char* suffix)
+{
+    size_t n = strlen(suffix);
+    return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+static const char* content_type(const std::string& path)
+{
+    static const char* types[][2] = {
+        {".html", "text/html"}, {".htm", "text/html"}, {".css", "text/css"},
+        {".js", "application/javascript"}, {".json", "application/json"},
+        {".txt", "text/plain"}, {".xml", "application/xml"}, {".svg", "image/svg+xml"},
+        {".png", "image/png"}, {".jpg", "image/jpeg"}, {".jpeg", "image/jpeg"},
+        {".gif", "image/gif"}, {".ico", "image/x-icon"}, {".webp", "image/webp"},
+        {".woff", "font/woff"}, {".woff2", "font/woff2"}, {".wasm", "application/wasm"},
+    };
+    for(size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++){
+        if(ends_with(path, types[i][0])){
+            return types[i][1];
+        }
+    }
+    return "application/octet-stream";
+}
+
+//FNV-1a 64位，作为内容的强ETag
+static std::string make_etag(const std::string& body)
+{
+    unsigned long long h = 1469598103934665603ULL;
+    for(size_t i = 0; i < body.size(); i++){
+        h ^= (unsigned char)body[i];
+        h *= 1099511628211ULL;
+    }
+    char buf[32];
+    snprintf(buf, sizeof(buf), "\"%016llx\"", h);
+    return buf;
+}
+
+//有.gz版本的文件两个版本都带Vary，否则下游缓存会把未压缩的响应当作所有客户端的响应
+static std::string make_header(const std::string& path, size_t length, const std::string& etag, bool gzip, bool vary)
+{
+    char buf[512];
+    snprintf(buf, sizeof(buf), "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\nContent-Type: %s\r\nETag: %s\r\n%s%s",
+             length, content_type(path), etag.c_str(),
+             gzip ? "Content-Encoding: gzip\r\n" : "", vary ? "Vary: Accept-Encoding\r\n" : "");
+    return buf;
+}
+
+int main(int argc, char* argv[])
+{
+    if(argc != 3){
+        printf("Usage: %s <doc_root> <bundle_file>\n", argv[0]);
+        return 1;
+    }
+    root = argv[1];
+    while(root.size() > 1 && root[root.size() - 1] == '/'){
+        root.erase(root.size() - 1);
+    }
+    if(nftw(root.c_str(), collect, 64, FTW_PHYS) != 0){
+        perror("nftw");
+        return 1;
+    }
+
+    std::vector<source_file> sources;
+    for(std::map<std::string, std::string>::iterator it = files.begin(); it != files.end(); ++it){
+        //x.gz已经作为x的压缩版本打包
+        if(ends_with(it->first, ".gz") && files.count(it->first.substr(0, it->first.size() - 3))){
+            continue;
+        }
+        source_file f;
+        f.path = it->first;
+        f.has_gz = false;
+        if(!read_file(it->second, f.body)){
+            printf("cannot read %s\n", it->second.c_str());
+            return 1;
+        }
+        std::map<std::string, std::string>::iterator gz = files.find(it->first + ".gz");
+        if(gz != files.end() && read_file(gz->second, f.gz_body)){
+            f.has_gz = true;
+        }
+        sources.push_back(f);
+    }
+    //std::map已经按路径排序，顺序与服务器二分查找时的比较方式一致
+
+    //先计算索引之后的数据区：路径、ETag、响应头、内容
+    std::string data;
+    std::vector<bundle_entry> entries(sources.size());
+    uint64_t data_offset = sizeof(bundle_header) + sizeof(bundle_entry) * sources.size();
+    for(size_t i = 0; i < sources.size(); i++){
+        source_file& f = sources[i];
+        bundle_entry& e = entries[i];
+        memset(&e, 0, sizeof(e));
+        std::string etag = make_etag(f.body);
+        std::string header = make_header(f.path, f.body.size(), etag, false, f.has_gz);
+
+        e.path_offset = data_offset + data.size();
+        e.path_len = f.path.size();
+        data += f.path;
+        e.etag_offset = data_offset + data.size();
+        e.etag_len = etag.size();
+        data += etag;
+        e.header_offset = data_offset + data.size();
+        e.header_len = header.size();
+        data += header;
+        //内容按64字节对齐，便于直接发送
+        data.append((64 - (data_offset + data.size()) % 64) % 64, '\0');
+        e.body_offset = data_offset + data.size();
+        e.body_len = f.body.size();
+        data += f.body;
+        if(f.has_gz){
+            std::string gz_etag = make_etag(f.gz_body);
+            std::string gz_header = make_header(f.path, f.gz_body.size(), gz_etag, true, true);
+            e.gz_etag_offset = data_offset + data.size();
+            e.gz_etag_len = gz_etag.size();
+            data += gz_etag;
+            e.gz_header_offset = data_offset + data.size();
+            e.gz_header_len = gz_header.size();
+            data += gz_header;
+            data.append((64 - (data_offset + data.size()) % 64) % 64, '\0');
+            e.gz_body_offset = data_offset + data.size();
+            e.gz_body_len = f.gz_body.size();
+            data += f.gz_body;
+        }
+    }
+
+    bundle_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BUNDLE_MAGIC, 8);
+    header.version = BUNDLE_VERSION;
+    header.count = entries.size();
+    header.index_offset = sizeof(bundle_header);
+    header.file_size = data_offset + data.size();
+
+    std::string tmp = std::string(argv[2]) + ".tmp";
+    FILE* fp = fopen(tmp.c_str(), "wb");
+    if(!fp){
+        perror("fopen");
+        return 1;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    if(!entries.empty()){
+        ok = ok && fwrite(&entries[0], sizeof(bundle_entry), entries.size(), fp) == entries.size();
+    }
+    ok = ok && fwrite(data.data(), 1, data.size(), fp) == data.size();
+    ok = (fflush(fp) == 0) && ok;
+    fclose(fp);
+    if(!ok || rename(tmp.c_str(), argv[2]) != 0){
+        perror("write bundle");
+        unlink(tmp.c_str());
+        return 1;
+    }
+    printf("packed %zu files, %llu bytes\n", entries.size(), (unsigned long long)header.file_size);
+    return 0;
+}
@@ -0,0 +1,166 @@
+#include "content_bundle.h"
+#include "arena.h"
+
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+std::atomic<content_bundle*> content_bundle::m_current(NULL);
+std::atomic<int> content_bundle::m_readers(0);
+
+content_bundle::content_bundle():
+    m_base(NULL), m_size(0), m_anonymous(false), m_entries(NULL), m_count(0), m_refcnt(1)
+{
+}
+
+content_bundle::~content_bundle()
+{
+    if(m_base && m_anonymous){
+        huge_free(m_base, m_size);
+    }
+    else if(m_base){
+        munmap(m_base, m_size);
+    }
+}
+
+//把包读入匿名内存，优先使用MAP_HUGETLB，没有预留大页时退回到透明大页
+static char* load_hugepage(int fd, size_t size)
+{
+    char* base = (char*)huge_alloc(size);
+    if(!base){
+        return NULL;
+    }
+    size_t done = 0;
+    while(done < size){
+        ssize_t n = pread(fd, base + done, size - done, done);
+        if(n <= 0){
+            huge_free(base, size);
+            return NULL;
+        }
+        done += n;
+    }
+    mprotect(base, size, PROT_READ);
+    return base;
+}
+
+content_bundle* content_bundle::open(const char* path, bool populate, bool hugepage)
+{
+    int fd = ::open(path, O_RDONLY);
+    if(fd < 0){
+        return NULL;
+    }
+    struct stat st;
+    if(fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(bundle_header)){
+        close(fd);
+        return NULL;
+    }
+    size_t size = st.st_size;
+    char* base = NULL;
+    if(hugepage){
+        base = load_hugepage(fd, size);
+    }
+    else{
+        int flags = MAP_PRIVATE | (populate ? MAP_POPULATE : 0);
+        base = (char*)mmap(0, size, PROT_READ, flags, fd, 0);
+        if(base == MAP_FAILED){
+            base = NULL;
+        }
+    }
+    close(fd);
+    if(!base){
+        return NULL;
+    }
+
+    content_bundle* bundle = new content_bundle;
+    bundle->m_base = base;
+    bundle->m_size = size;
+    bundle->m_anonymous = hugepage;
+
+    //检查文件头与索引的范围，防止截断或损坏的包导致越界访问
+    const bundle_header* header = (const bundle_header*)base;
+    if(memcmp(header->magic, BUNDLE_MAGIC, 8) != 0 || header->version != BUNDLE_VERSION ||
+       header->file_size != size || header->index_offset > size ||
+       (size - header->index_offset) / sizeof(bundle_entry) < header->count){
+        delete bundle;
+        return NULL;
+    }
+    bundle->m_entries = (const bundle_entry*)(base + header->index_offset);
+    bundle->m_count = header->count;
+    for(size_t i = 0; i < bundle->m_count; i++){
+        const bundle_entry& e = bundle->m_entries[i];
+        if(e.path_offset + e.path_len > size || e.etag_offset + e.etag_len > size ||
+           e.header_offset + e.header_len > size || e.body_offset + e.body_len > size ||
+           e.gz_header_offset + e.gz_header_len > size || e.gz_body_offset + e.gz_body_len > size ||
+           e.gz_etag_offset + e.gz_etag_len > size){
+            delete bundle;
+            return NULL;
+        }
+    }
+    return bundle;
+}
+
+const bundle_entry* content_bundle::find(const char* path) const
+{
+    size_t len = strlen(path);
+    size_t lo = 0, hi = m_count;
+    while(lo < hi){
+        size_t mid = lo + (hi - lo) / 2;
+        const bundle_entry& e = m_entries[mid];
+        size_t n = e.path_len < len ? e.path_len : len;
+        int cmp = memcmp(m_base + e.path_offset, path, n);
+        if(cmp == 0){
+            cmp = e.path_len < len ? -1 : (e.path_len > len ? 1 : 0);
+        }
+        if(cmp == 0){
+            return &e;
+        }
+        if(cmp < 0){
+            lo = mid + 1;
+        }
+        else{
+            hi = mid;
+        }
+    }
+    return NULL;
+}
+
+void content_bundle::acquire()
+{
+    m_refcnt.fetch_add(1, std::memory_order_relaxed);
+}
+
+void content_bundle::release()
+{
+    //之前对包内容的读取必须在析构之前完成
+    if(m_refcnt.fetch_sub(1, std::memory_order_acq_rel) == 1){
+        delete this;
+    }
+}
+
+content_bundle* content_bundle::current()
+{
+    //m_readers不为0时install不会释放刚读到的包，因此读到指针之后再增加引用是安全的
+    m_readers.fetch_add(1, std::memory_order_seq_cst);
+    content_bundle* bundle = m_current.load(std::memory_order_seq_cst);
+    if(bundle){
+        bundle->m_refcnt.fetch_add(1, std::memory_order_relaxed);
+    }
+    m_readers.fetch_sub(1, std::memory_order_release);
+    return bundle;
+}
+
+void content_bundle::install(content_bundle* bundle)
+{
+    content_bundle* old = m_current.exchange(bundle, std::memory_order_seq_cst);
+    //之后开始的current()只会读到新包，只需等待已经读到旧指针、还没有增加引用的线程
+    while(m_readers.load(std::memory_order_acquire) != 0){
+        sched_yield();
+    }
+    if(old){
+        old->release();
+    }
+}
@@ -0,0 +1,82 @@
+#ifndef CONTENT_BUNDLE_H_INCLUDED
+#define CONTENT_BUNDLE_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+//只读内容包：由bundle_pack离线打包整个站点得到的单个文件，服务器启动时整体映射到内存，直接从中应答
+//文件布局：bundle_header | 按路径排序的bundle_entry数组 | 路径、预先生成的响应头、文件内容
+//所有偏移都是相对文件起始位置的字节数，整数按本机字节序存储
+
+#define BUNDLE_MAGIC "HTTPBNDL"
+#define BUNDLE_VERSION 1
+
+struct bundle_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t count;             //条目数量
+    uint64_t index_offset;      //bundle_entry数组的位置
+    uint64_t file_size;         //整个包的大小，用于检查文件是否完整
+};
+
+//包中的一个文件，gz_*描述可选的gzip预压缩版本，gz_body_len为0表示没有压缩版本
+struct bundle_entry
+{
+    uint64_t path_offset;
+    uint32_t path_len;
+    uint32_t etag_len;
+    uint64_t etag_offset;       //带引号的ETag，用于与If-None-Match比较
+    uint64_t header_offset;     //预先生成的状态行与响应头，不含Connection头部与结尾的空行
+    uint64_t header_len;
+    uint64_t body_offset;
+    uint64_t body_len;
+    uint64_t gz_header_offset;
+    uint64_t gz_header_len;
+    uint64_t gz_body_offset;
+    uint64_t gz_body_len;
+    uint64_t gz_etag_offset;    //压缩版本有自己的ETag
+    uint64_t gz_etag_len;
+};
+
+//一个已经映射到内存中的内容包，带引用计数，重新加载后旧的包在最后一个请求完成时才被释放
+//每个请求都要取得当前的包，取得与释放都只用原子操作；替换时等待正在读取旧指针的current()结束后再释放旧包的引用
+class content_bundle
+{
+public:
+    //打开并映射内容包，populate为true时预先读入所有页面，hugepage为true时复制到大页内存中
+    //文件不存在或格式错误时返回NULL
+    static content_bundle* open(const char* path, bool populate, bool hugepage);
+
+    //二分查找路径，找不到返回NULL，不做任何系统调用
+    const bundle_entry* find(const char* path) const;
+    const char* at(uint64_t offset) const { return m_base + offset; }
+    size_t count() const { return m_count; }
+
+    void acquire();
+    void release();
+
+    //当前提供服务的内容包，未启用时为NULL；返回的包已经增加了引用
+    static content_bundle* current();
+    //原子地替换当前内容包，旧的包在所有引用释放后销毁
+    static void install(content_bundle* bundle);
+
+private:
+    content_bundle();
+    ~content_bundle();
+
+private:
+    char* m_base;
+    size_t m_size;
+    bool m_anonymous;           //内容被复制到匿名内存(大页)中，而不是直接映射文件
+    const bundle_entry* m_entries;
+    size_t m_count;
+    std::atomic<int> m_refcnt;
+
+    static std::atomic<content_bundle*> m_current;
+    //正在current()中读取m_current并增加引用的线程数
+    static std::atomic<int> m_readers;
+};
+
+#endif // CONTENT_BUNDLE_H_INCLUDED
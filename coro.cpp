@@ -0,0 +1,256 @@
+#include "coro.h"
+#include "arena.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <new>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+
+extern void modfd(int epollfd, int fd, int ev);
+
+//帧头，位于每个帧之前，释放时据此找到帧池
+struct alignas(16) frame_header
+{
+    conn_io* owner;             //NULL表示在堆上
+    int block;
+};
+
+const char* coro_request::header(const char* name) const
+{
+    size_t n = strlen(name);
+    const char* p = headers;
+    while(p < headers_end){
+        size_t len = strlen(p);
+        if(len > n && p[n] == ':' && strncasecmp(p, name, n) == 0){
+            return p + n + 1 + strspn(p + n + 1, " \t");
+        }
+        p += len + 1;
+    }
+    return NULL;
+}
+
+void* coro_frame_alloc(conn_io* io, size_t size)
+{
+    size_t total = sizeof(frame_header) + size;
+    frame_header* h = NULL;
+    if(io && total <= conn_io::FRAME_BLOCK_SIZE && io->m_free_blocks){
+        int block = __builtin_ctz(io->m_free_blocks);
+        io->m_free_blocks &= ~(1u << block);
+        h = (frame_header*)io->m_frames[block];
+        h->owner = io;
+        h->block = block;
+    }
+    else{
+        //帧池用完(递归过深)或帧太大，退回堆
+        h = (frame_header*)malloc(total);
+        if(!h){
+            std::terminate();
+        }
+        h->owner = NULL;
+    }
+    return h + 1;
+}
+
+void coro_frame_free(void* frame)
+{
+    frame_header* h = (frame_header*)frame - 1;
+    if(h->owner){
+        h->owner->m_free_blocks |= 1u << h->block;
+    }
+    else{
+        free(h);
+    }
+}
+
+void io_op::await_suspend(std::coroutine_handle<> h)
+{
+    m_io->suspend(this, h);
+}
+
+read_op::read_op(conn_io* io, char* buf, size_t len):
+    io_op(io, EPOLLIN), m_buf(buf), m_len(len), m_result(0)
+{
+}
+
+bool read_op::step()
+{
+    //先返回请求之后已经读入连接缓冲的数据
+    if(m_io->m_pending_len > 0){
+        size_t n = m_len < m_io->m_pending_len ? m_len : m_io->m_pending_len;
+        memcpy(m_buf, m_io->m_pending, n);
+        m_io->m_pending += n;
+        m_io->m_pending_len -= n;
+        m_result = n;
+        return true;
+    }
+    m_result = recv(m_io->fd(), m_buf, m_len, 0);
+    return !(m_result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+}
+
+write_op::write_op(conn_io* io, const char* data, size_t len):
+    io_op(io, EPOLLOUT), m_data(data), m_len(len), m_ok(true)
+{
+}
+
+bool write_op::step()
+{
+    while(m_len > 0){
+        ssize_t n = send(m_io->fd(), m_data, m_len, MSG_NOSIGNAL);
+        if(n < 0){
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                return false;
+            }
+            m_ok = false;
+            return true;
+        }
+        m_data += n;
+        m_len -= n;
+    }
+    return true;
+}
+
+sendfile_op::sendfile_op(conn_io* io, int file_fd, off_t offset, size_t count):
+    io_op(io, EPOLLOUT), m_file_fd(file_fd), m_offset(offset), m_count(count), m_ok(true)
+{
+}
+
+bool sendfile_op::step()
+{
+    while(m_count > 0){
+        ssize_t n = ::sendfile(m_io->fd(), m_file_fd, &m_offset, m_count);
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+            return false;
+        }
+        //文件比预期的短也是错误，响应的长度已经发出
+        if(n <= 0){
+            m_ok = false;
+            return true;
+        }
+        m_count -= n;
+    }
+    return true;
+}
+
+sleep_op::sleep_op(conn_io* io, int ms):
+    io_op(io, 0), m_ms(ms), m_armed(false), m_ok(true)
+{
+}
+
+bool sleep_op::step()
+{
+    if(m_ms <= 0){
+        return true;
+    }
+    if(!m_armed){
+        if(m_io->m_timer_fd < 0){
+            m_io->m_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        }
+        struct itimerspec its;
+        memset(&its, 0, sizeof(its));
+        its.it_value.tv_sec = m_ms / 1000;
+        its.it_value.tv_nsec = (long)(m_ms % 1000) * 1000000;
+        if(m_io->m_timer_fd < 0 || timerfd_settime(m_io->m_timer_fd, 0, &its, NULL) < 0){
+            m_ok = false;
+            return true;
+        }
+        m_armed = true;
+        return false;
+    }
+    uint64_t expirations;
+    return read(m_io->m_timer_fd, &expirations, sizeof(expirations)) == sizeof(expirations);
+}
+
+conn_io::conn_io(int epollfd, int sockfd):
+    m_epollfd(epollfd), m_sockfd(sockfd), m_timer_fd(-1), m_timer_added(false),
+    m_pending(NULL), m_pending_len(0), m_done(NULL), m_done_arg(NULL), m_op(NULL),
+    m_free_blocks((1u << FRAME_BLOCKS) - 1)
+{
+    memset(&m_request, 0, sizeof(m_request));
+}
+
+conn_io::~conn_io()
+{
+    release();
+    //关闭时自动从epoll中移除
+    if(m_timer_fd >= 0){
+        close(m_timer_fd);
+    }
+}
+
+conn_io* conn_io::create(int epollfd, int sockfd)
+{
+    void* p = arena_alloc(sizeof(conn_io));
+    return p ? new(p) conn_io(epollfd, sockfd) : NULL;
+}
+
+void conn_io::destroy(conn_io* io)
+{
+    io->~conn_io();
+    arena_free(io, sizeof(conn_io));
+}
+
+void conn_io::start(coro_handler handler, const coro_request& req, const char* pending, size_t pending_len,
+                    void (*done)(void* arg, bool keep_alive), void* arg)
+{
+    m_request = req;
+    m_pending = pending;
+    m_pending_len = pending_len;
+    m_done = done;
+    m_done_arg = arg;
+    m_op = NULL;
+    m_top = handler(*this).release();
+    m_top.promise().m_top_io = this;
+    m_top.resume();
+}
+
+void conn_io::suspend(io_op* op, std::coroutine_handle<> h)
+{
+    m_op = op;
+    m_waiting = h;
+    arm(op->m_events);
+}
+
+void conn_io::arm(uint32_t events)
+{
+    if(events){
+        modfd(m_epollfd, m_sockfd, events);
+        return;
+    }
+    //定时器与socket共用data.fd，挂起期间socket没有注册事件，reactor收到的事件一定来自定时器
+    epoll_event event;
+    event.data.fd = m_sockfd;
+    event.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
+    int op = m_timer_added ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    m_timer_added = true;
+    epoll_ctl(m_epollfd, op, m_timer_fd, &event);
+}
+
+void conn_io::on_event()
+{
+    if(!m_op->step()){
+        arm(m_op->m_events);
+        return;
+    }
+    m_op = NULL;
+    m_waiting.resume();
+}
+
+void conn_io::release()
+{
+    if(m_top){
+        m_top.destroy();
+        m_top = conn_task<bool>::handle();
+    }
+    m_op = NULL;
+}
+
+void conn_io::finished()
+{
+    m_done(m_done_arg, m_top.promise().m_value);
+}
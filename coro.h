@@ -0,0 +1,265 @@
+#ifndef CORO_H_INCLUDED
+#define CORO_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <exception>
+#include <coroutine>
+#include <sys/types.h>
+
+//协程形式的连接处理(C++20)：handler按顺序调用co_await read_some/write_all/sendfile/sleep_for，
+//操作遇到EAGAIN时协程挂起并注册EPOLLONESHOT事件，reactor收到事件后在自己的线程中推进操作并直接恢复协程，不经过线程池
+//与连接的其他状态一样，注册事件是挂起前的最后一步，之后协程可能已经在另一个线程中恢复，挂起时不能持有锁
+//协程帧从连接自己的帧池中分配，handler及其co_await的子协程通常不需要堆分配
+
+class conn_io;
+
+//请求的解析结果，指向连接的读缓冲，在handler结束之前有效
+struct coro_request
+{
+    const char* method;
+    const char* url;
+    const char* headers;        //头部区域，每一行以'\0'结尾，行之间可能有多个'\0'
+    const char* headers_end;
+    const char* body;
+    int body_len;
+    bool keep_alive;            //客户端是否要求保持连接
+
+    //不区分大小写查找头部，返回它的值，没有时返回NULL
+    const char* header(const char* name) const;
+};
+
+//协程帧的分配：io不为NULL时优先使用它的帧池，否则或帧池不够时使用堆
+void* coro_frame_alloc(conn_io* io, size_t size);
+void coro_frame_free(void* frame);
+
+struct conn_promise_base
+{
+    //co_await这个协程的调用者，结束时回到它
+    std::coroutine_handle<> m_continuation;
+    //顶层协程所属的连接，结束时由它通知http_conn
+    conn_io* m_top_io = NULL;
+
+    //第一个参数为conn_io&的协程从连接的帧池分配帧
+    template<typename... Args>
+    static void* operator new(size_t size, conn_io& io, Args&...) { return coro_frame_alloc(&io, size); }
+    static void* operator new(size_t size) { return coro_frame_alloc(NULL, size); }
+    static void operator delete(void* frame) { coro_frame_free(frame); }
+
+    struct final_awaiter
+    {
+        bool await_ready() noexcept { return false; }
+        template<typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept;
+        void await_resume() noexcept {}
+    };
+
+    //创建后不立即运行，由co_await或conn_io::start启动
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    final_awaiter final_suspend() noexcept { return {}; }
+    //与代码中其他地方一样，连接处理不使用异常
+    void unhandled_exception() { std::terminate(); }
+};
+
+//handler与子协程的返回类型，T必须可以默认构造；co_await它会运行子协程并得到co_return的值
+template<typename T>
+class conn_task
+{
+public:
+    struct promise_type : conn_promise_base
+    {
+        T m_value = T();
+
+        conn_task get_return_object() { return conn_task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        void return_value(T value) { m_value = value; }
+    };
+    typedef std::coroutine_handle<promise_type> handle;
+
+    conn_task(conn_task&& other): m_handle(other.m_handle) { other.m_handle = handle(); }
+    ~conn_task()
+    {
+        if(m_handle){
+            m_handle.destroy();
+        }
+    }
+
+    bool await_ready() { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller)
+    {
+        m_handle.promise().m_continuation = caller;
+        return m_handle;
+    }
+    T await_resume() { return m_handle.promise().m_value; }
+
+    //交出帧的所有权
+    handle release()
+    {
+        handle h = m_handle;
+        m_handle = handle();
+        return h;
+    }
+
+private:
+    explicit conn_task(handle h): m_handle(h) {}
+    conn_task(const conn_task&);
+    conn_task& operator=(const conn_task&);
+
+private:
+    handle m_handle;
+};
+
+//handler：处理一个请求，返回是否可以在这个连接上继续处理下一个请求
+typedef conn_task<bool> (*coro_handler)(conn_io& io);
+
+//等待中的I/O操作，co_await期间位于协程帧中
+class io_op
+{
+public:
+    //先直接尝试，不需要等待时不挂起
+    bool await_ready() { return step(); }
+    void await_suspend(std::coroutine_handle<> h);
+    //推进操作，完成时返回true；返回false时等待m_events，为0时等待定时器
+    virtual bool step() = 0;
+
+    uint32_t m_events;
+
+protected:
+    io_op(conn_io* io, uint32_t events): m_events(events), m_io(io) {}
+    conn_io* m_io;
+};
+
+//读到一些数据、对方关闭(0)或出错(-1)时返回
+class read_op : public io_op
+{
+public:
+    read_op(conn_io* io, char* buf, size_t len);
+    bool step();
+    ssize_t await_resume() { return m_result; }
+
+private:
+    char* m_buf;
+    size_t m_len;
+    ssize_t m_result;
+};
+
+//写完全部数据时返回true，出错时返回false
+class write_op : public io_op
+{
+public:
+    write_op(conn_io* io, const char* data, size_t len);
+    bool step();
+    bool await_resume() { return m_ok; }
+
+private:
+    const char* m_data;
+    size_t m_len;
+    bool m_ok;
+};
+
+//用sendfile发送文件的[offset, offset + count)，全部发送时返回true
+class sendfile_op : public io_op
+{
+public:
+    sendfile_op(conn_io* io, int file_fd, off_t offset, size_t count);
+    bool step();
+    bool await_resume() { return m_ok; }
+
+private:
+    int m_file_fd;
+    off_t m_offset;
+    size_t m_count;
+    bool m_ok;
+};
+
+//等待ms毫秒，定时器设置失败时立即返回false
+class sleep_op : public io_op
+{
+public:
+    sleep_op(conn_io* io, int ms);
+    bool step();
+    bool await_resume() { return m_ok; }
+
+private:
+    int m_ms;
+    bool m_armed;
+    bool m_ok;
+};
+
+//一个连接上的协程运行环境，在连接第一次使用协程handler时创建，连接关闭时销毁
+class conn_io
+{
+public:
+    //帧池的块数与块大小，块中包含帧头
+    static const int FRAME_BLOCKS = 4;
+    static const size_t FRAME_BLOCK_SIZE = 2048;
+
+    conn_io(int epollfd, int sockfd);
+    ~conn_io();
+    //分配在当前线程的arena中
+    static conn_io* create(int epollfd, int sockfd);
+    static void destroy(conn_io* io);
+
+    const coro_request& request() const { return m_request; }
+    int fd() const { return m_sockfd; }
+
+    read_op read_some(char* buf, size_t len) { return read_op(this, buf, len); }
+    write_op write_all(const char* data, size_t len) { return write_op(this, data, len); }
+    sendfile_op sendfile(int file_fd, off_t offset, size_t count) { return sendfile_op(this, file_fd, offset, count); }
+    sleep_op sleep_for(int ms) { return sleep_op(this, ms); }
+
+    //运行handler处理请求，pending为读缓冲中请求之后已经读到的数据，由read_some先返回
+    //handler结束时(帧仍然存在)调用done(arg, 返回值)；start与on_event返回后调用者不能再访问连接
+    void start(coro_handler handler, const coro_request& req, const char* pending, size_t pending_len,
+               void (*done)(void* arg, bool keep_alive), void* arg);
+    //reactor收到事件后调用：推进等待中的操作，完成时恢复协程，否则重新注册事件
+    void on_event();
+    //销毁已经结束或挂起中的handler的帧
+    void release();
+    //由final_awaiter调用
+    void finished();
+
+private:
+    friend class io_op;
+    friend class read_op;
+    friend class sleep_op;
+    friend void* coro_frame_alloc(conn_io* io, size_t size);
+    friend void coro_frame_free(void* frame);
+
+    void suspend(io_op* op, std::coroutine_handle<> h);
+    //注册等待的事件，必须是挂起前的最后一步
+    void arm(uint32_t events);
+
+private:
+    int m_epollfd;
+    int m_sockfd;
+    int m_timer_fd;             //sleep_for第一次使用时创建，注册到epoll时data.fd为m_sockfd
+    bool m_timer_added;
+    coro_request m_request;
+    const char* m_pending;
+    size_t m_pending_len;
+
+    conn_task<bool>::handle m_top;
+    void (*m_done)(void* arg, bool keep_alive);
+    void* m_done_arg;
+    io_op* m_op;
+    std::coroutine_handle<> m_waiting;
+
+    unsigned m_free_blocks;     //空闲块的位图
+    alignas(16) char m_frames[FRAME_BLOCKS][FRAME_BLOCK_SIZE];
+};
+
+template<typename P>
+std::coroutine_handle<> conn_promise_base::final_awaiter::await_suspend(std::coroutine_handle<P> h) noexcept
+{
+    conn_promise_base& p = h.promise();
+    if(p.m_continuation){
+        return p.m_continuation;
+    }
+    //顶层协程结束，finished可能销毁这个帧，之后不能再访问p
+    if(p.m_top_io){
+        p.m_top_io->finished();
+    }
+    return std::noop_coroutine();
+}
+
+#endif // CORO_H_INCLUDED
@@ -0,0 +1,239 @@
+#include "file_cache.h"
+#include "memory_budget.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+file_cache::file_cache(int max_entries, off_t max_file_size, int ttl):
+    m_max_entries(max_entries), m_max_file_size(max_file_size), m_ttl(ttl),
+    m_count(0), m_bytes(0), m_evict_cursor(0), m_buckets(max_entries > 0 ? max_entries : 1, (entry*)NULL)
+{
+}
+
+file_cache::~file_cache()
+{
+    for(size_t i = 0; i < m_buckets.size(); i++){
+        entry* e = m_buckets[i];
+        while(e){
+            entry* next = e->next;
+            destroy(e);
+            e = next;
+        }
+    }
+}
+
+//FNV-1a
+unsigned file_cache::hash_path(const char* path)
+{
+    unsigned h = 2166136261u;
+    for(; *path; path++){
+        h ^= (unsigned char)*path;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+file_cache::entry* file_cache::find_locked(const char* path, unsigned hash)
+{
+    entry* e = m_buckets[hash % m_buckets.size()];
+    for(; e; e = e->next){
+        if(e->hash == hash && strcmp(e->path, path) == 0){
+            return e;
+        }
+    }
+    return NULL;
+}
+
+//将条目从哈希表中摘除，并释放缓存持有的引用
+void file_cache::unlink_locked(entry* e)
+{
+    entry** pp = &m_buckets[e->hash % m_buckets.size()];
+    while(*pp && *pp != e){
+        pp = &(*pp)->next;
+    }
+    if(*pp){
+        *pp = e->next;
+        m_count--;
+        m_bytes -= e->size;
+    }
+    e->next = NULL;
+    if(--e->refcnt == 0){
+        destroy(e);
+    }
+}
+
+void file_cache::destroy(entry* e)
+{
+    munmap(e->addr, e->size);
+    memory_budget::charge(MEM_FILE_CACHE, -(long long)e->size);
+    free(e->path);
+    delete e;
+}
+
+void file_cache::put_locked(entry* e)
+{
+    entry** bucket = &m_buckets[e->hash % m_buckets.size()];
+    e->next = *bucket;
+    *bucket = e;
+    m_count++;
+    m_bytes += e->size;
+}
+
+//淘汰一个没有被连接引用的条目，全部都在使用时允许暂时超出容量
+void file_cache::evict_locked()
+{
+    for(size_t n = 0; n < m_buckets.size(); n++){
+        size_t i = (m_evict_cursor + n) % m_buckets.size();
+        for(entry* e = m_buckets[i]; e; e = e->next){
+            if(e->refcnt == 1){
+                m_evict_cursor = i + 1;
+                unlink_locked(e);
+                return;
+            }
+        }
+    }
+}
+
+file_cache::entry* file_cache::lookup(const char* path)
+{
+    unsigned hash = hash_path(path);
+    time_t now = time(NULL);
+    m_locker.lock();
+    entry* e = find_locked(path, hash);
+    if(!e || now - e->checked >= m_ttl){
+        m_locker.unlock();
+        return NULL;
+    }
+    e->refcnt++;
+    m_locker.unlock();
+    return e;
+}
+
+file_cache::entry* file_cache::acquire(const char* path, const struct stat& st)
+{
+    if(st.st_size <= 0 || st.st_size > m_max_file_size){
+        return NULL;
+    }
+    unsigned hash = hash_path(path);
+    m_locker.lock();
+    entry* e = find_locked(path, hash);
+    if(e){
+        if(e->mtime == st.st_mtime && e->size == st.st_size){
+            e->checked = time(NULL);
+            e->refcnt++;
+            m_locker.unlock();
+            return e;
+        }
+        //文件已经被修改，丢弃旧的映射
+        unlink_locked(e);
+    }
+    m_locker.unlock();
+    //超过内存的硬限制时不再缓存新的文件，由调用者自己映射
+    if(memory_budget::over_hard()){
+        return NULL;
+    }
+
+    //映射文件时不持有锁
+    int fd = open(path, O_RDONLY);
+    if(fd < 0){
+        return NULL;
+    }
+    e = map_file(path, hash, fd, st, 0, 2);     //缓存与调用者各持有一个引用
+    close(fd);
+    if(e){
+        insert(e);
+    }
+    return e;
+}
+
+file_cache::entry* file_cache::map_file(const char* path, unsigned hash, int fd, const struct stat& st, int flags, int refcnt)
+{
+    char* addr = (char*)mmap(0, st.st_size, PROT_READ, MAP_PRIVATE | flags, fd, 0);
+    if(addr == MAP_FAILED){
+        return NULL;
+    }
+    memory_budget::charge(MEM_FILE_CACHE, st.st_size);
+    entry* e = new entry;
+    e->path = strdup(path);
+    e->addr = addr;
+    e->size = st.st_size;
+    e->mtime = st.st_mtime;
+    e->checked = time(NULL);
+    e->refcnt = refcnt;
+    e->hash = hash;
+    e->next = NULL;
+    return e;
+}
+
+void file_cache::insert(entry* e)
+{
+    m_locker.lock();
+    //其他线程可能同时插入了同一个文件，替换掉它
+    entry* old = find_locked(e->path, e->hash);
+    if(old){
+        unlink_locked(old);
+    }
+    if(m_count >= m_max_entries){
+        evict_locked();
+    }
+    put_locked(e);
+    m_locker.unlock();
+}
+
+bool file_cache::adopt(const char* path, int fd)
+{
+    struct stat st;
+    if(fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size <= 0 || st.st_size > m_max_file_size){
+        return false;
+    }
+    //页面在旧进程运行期间已经位于页缓存中，预先建立映射，新进程的第一个请求不会再缺页
+    entry* e = map_file(path, hash_path(path), fd, st, MAP_POPULATE, 1);
+    if(!e){
+        return false;
+    }
+    insert(e);
+    return true;
+}
+
+void file_cache::paths(std::vector<std::string>& out)
+{
+    m_locker.lock();
+    for(size_t i = 0; i < m_buckets.size(); i++){
+        for(entry* e = m_buckets[i]; e; e = e->next){
+            out.push_back(e->path);
+        }
+    }
+    m_locker.unlock();
+}
+
+void file_cache::release(entry* e)
+{
+    m_locker.lock();
+    if(--e->refcnt == 0){
+        destroy(e);
+    }
+    m_locker.unlock();
+}
+
+void file_cache::shrink()
+{
+    m_locker.lock();
+    off_t target = m_bytes / 2;
+    for(size_t n = 0; n < m_buckets.size() && m_bytes > target; n++){
+        size_t i = (m_evict_cursor + n) % m_buckets.size();
+        entry* e = m_buckets[i];
+        while(e && m_bytes > target){
+            entry* next = e->next;
+            if(e->refcnt == 1){
+                unlink_locked(e);
+            }
+            e = next;
+        }
+        m_evict_cursor = i + 1;
+    }
+    m_locker.unlock();
+}
@@ -0,0 +1,73 @@
+#ifndef FILE_CACHE_H_INCLUDED
+#define FILE_CACHE_H_INCLUDED
+
+#include <time.h>
+#include <sys/types.h>
+#include <vector>
+#include <string>
+#include "locker.h"
+
+//小文件映射缓存，缓存已经mmap到内存中的文件，避免每次请求都stat、open、mmap
+//条目带引用计数，连接在发送完响应之前一直持有引用，被替换或淘汰的条目在最后一个引用释放时才munmap
+class file_cache
+{
+public:
+    //缓存中的一个文件
+    struct entry
+    {
+        char* path;         //文件完整路径
+        char* addr;         //文件被mmap到内存中的起始位置
+        off_t size;         //文件大小
+        time_t mtime;       //文件的修改时间，用于判断文件是否被修改
+        time_t checked;     //上一次stat确认文件未修改的时间
+        int refcnt;         //引用计数，缓存本身持有一个引用
+        unsigned hash;
+        entry* next;        //哈希桶链表
+    };
+
+public:
+    //max_entries为最多缓存的文件数量，max_file_size为可以缓存的最大文件，ttl为无需重新stat的秒数
+    file_cache(int max_entries = 1024, off_t max_file_size = 64 * 1024, int ttl = 1);
+    ~file_cache();
+
+    //不做任何系统调用的查找，条目存在且在ttl内有效时返回并增加引用，否则返回NULL
+    entry* lookup(const char* path);
+    //由已经stat过的调用者使用：若缓存中的条目与st一致则刷新检查时间并返回，否则映射文件并插入缓存
+    //文件过大或映射失败时返回NULL，由调用者自行处理
+    entry* acquire(const char* path, const struct stat& st);
+    //释放一个引用
+    void release(entry* e);
+    //热升级时由新进程调用：映射旧进程交来的已打开文件并放入缓存，只有缓存持有引用
+    bool adopt(const char* path, int fd);
+    //列出缓存中文件的路径，热升级时旧进程据此把文件交给新进程
+    void paths(std::vector<std::string>& out);
+    //内存超过硬限制时由reactor调用：淘汰没有被连接引用的条目，直到缓存的字节数减半
+    void shrink();
+
+    off_t max_file_size() const { return m_max_file_size; }
+
+private:
+    static unsigned hash_path(const char* path);
+    entry* find_locked(const char* path, unsigned hash);
+    void unlink_locked(entry* e);
+    void put_locked(entry* e);
+    void evict_locked();
+    //映射已经打开的文件，返回引用计数为refcnt的新条目，失败时返回NULL
+    static entry* map_file(const char* path, unsigned hash, int fd, const struct stat& st, int flags, int refcnt);
+    //插入条目，替换同名的旧条目，必要时淘汰
+    void insert(entry* e);
+    //解除映射并释放条目
+    static void destroy(entry* e);
+
+private:
+    int m_max_entries;
+    off_t m_max_file_size;
+    int m_ttl;
+    int m_count;
+    off_t m_bytes;          //缓存中的条目映射的字节数
+    size_t m_evict_cursor;  //淘汰时从该桶开始扫描，使淘汰在各个桶之间轮转
+    std::vector<entry*> m_buckets;
+    locker m_locker;    //保护哈希表和引用计数
+};
+
+#endif // FILE_CACHE_H_INCLUDED
@@ -0,0 +1,295 @@
+#include "handoff.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+//消息的第一个字节为类型：'L'携带监听socket，'F'携带一批文件及其路径(每个以'\0'结尾)，'E'表示结束；新进程回复'R'表示就绪
+//使用SOCK_SEQPACKET，每条消息与它携带的文件描述符一起到达，不需要自己分帧
+static const size_t MAX_PAYLOAD = 16 * 1024;
+
+static bool fill_address(const char* path, sockaddr_un& adr)
+{
+    memset(&adr, 0, sizeof(adr));
+    adr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(adr.sun_path)){
+        printf("control socket path too long: %s\n", path);
+        return false;
+    }
+    strcpy(adr.sun_path, path);
+    return true;
+}
+
+static void set_timeout(int fd, int seconds)
+{
+    struct timeval tv;
+    tv.tv_sec = seconds;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+bool handoff::send_fds(int conn, char type, const char* data, size_t len, const int* fds, int nfds)
+{
+    struct iovec iov[2];
+    iov[0].iov_base = &type;
+    iov[0].iov_len = 1;
+    iov[1].iov_base = (void*)data;
+    iov[1].iov_len = len;
+    char control[CMSG_SPACE(sizeof(int) * FILES_PER_MESSAGE)];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    if(nfds > 0){
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+    }
+    return sendmsg(conn, &msg, MSG_NOSIGNAL) == (ssize_t)(1 + len);
+}
+
+ssize_t handoff::recv_fds(int conn, char* buf, size_t len, int* fds, int& nfds)
+{
+    struct iovec iov;
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    char control[CMSG_SPACE(sizeof(int) * FILES_PER_MESSAGE)];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    nfds = 0;
+    ssize_t n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+    for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); n >= 0 && cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)){
+        if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS){
+            int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds + nfds, CMSG_DATA(cmsg), sizeof(int) * count);
+            nfds += count;
+        }
+    }
+    //消息或描述符被截断说明两端版本不一致，不能继续
+    if(n >= 0 && (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))){
+        for(int i = 0; i < nfds; i++){
+            close(fds[i]);
+        }
+        nfds = 0;
+        return -1;
+    }
+    return n;
+}
+
+int handoff::receive(const char* path, file_cache& cache, int& conn)
+{
+    conn = -1;
+    sockaddr_un adr;
+    if(!fill_address(path, adr)){
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if(fd < 0){
+        return -1;
+    }
+    //路径不存在或是上一个进程留下的，全新启动
+    if(connect(fd, (struct sockaddr*)&adr, sizeof(adr)) < 0){
+        close(fd);
+        return -1;
+    }
+    set_timeout(fd, IO_TIMEOUT);
+
+    char buf[MAX_PAYLOAD + 2];
+    int fds[FILES_PER_MESSAGE];
+    int nfds = 0;
+    ssize_t n = recv_fds(fd, buf, MAX_PAYLOAD + 1, fds, nfds);
+    if(n < 1 || buf[0] != 'L' || nfds != 1){
+        for(int i = 0; i < nfds; i++){
+            close(fds[i]);
+        }
+        close(fd);
+        printf("handoff from %s failed\n", path);
+        return -1;
+    }
+    int listenfd = fds[0];
+
+    //之后是缓存的文件，以'E'结束；中途出错时旧进程已经放弃这次交接，不能接管监听socket
+    int files = 0;
+    bool complete = false;
+    while(true){
+        n = recv_fds(fd, buf, MAX_PAYLOAD + 1, fds, nfds);
+        if(n < 1){
+            break;
+        }
+        if(buf[0] == 'E'){
+            complete = true;
+            break;
+        }
+        buf[n] = '\0';
+        const char* p = buf + 1;
+        const char* end = buf + n;
+        for(int i = 0; i < nfds; i++){
+            if(p < end && cache.adopt(p, fds[i])){
+                files++;
+            }
+            close(fds[i]);
+            p += strlen(p) + 1;
+        }
+    }
+    if(!complete){
+        close(listenfd);
+        close(fd);
+        printf("handoff from %s was interrupted\n", path);
+        return -1;
+    }
+    printf("took over the listening socket and %d cached files from %s\n", files, path);
+    conn = fd;
+    return listenfd;
+}
+
+void handoff::ready(int conn)
+{
+    char c = 'R';
+    if(send(conn, &c, 1, MSG_NOSIGNAL) != 1){
+        printf("notify the old server failed, it keeps accepting until it is stopped\n");
+    }
+    close(conn);
+}
+
+int handoff::listen_control(const char* path)
+{
+    sockaddr_un adr;
+    if(!fill_address(path, adr)){
+        return -1;
+    }
+    //上一个进程的控制socket已经交接完毕或者已经失效
+    unlink(path);
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0){
+        return -1;
+    }
+    if(bind(fd, (struct sockaddr*)&adr, sizeof(adr)) < 0 || listen(fd, 1) < 0){
+        close(fd);
+        return -1;
+    }
+    //能连接控制socket就能拿到监听socket，只允许同一用户
+    chmod(path, 0600);
+    return fd;
+}
+
+//辅助线程持有连接的一个副本，reactor在新进程退出时关闭自己的描述符不会影响正在进行的发送
+struct transfer_job
+{
+    int fd;
+    int listenfd;
+    file_cache* cache;
+};
+
+bool handoff::offer(int control_fd, int listenfd, file_cache& cache, int& conn)
+{
+    bool started = false;
+    //控制socket注册为边沿触发，接受所有等待的连接
+    while(true){
+        int fd = accept4(control_fd, NULL, NULL, SOCK_CLOEXEC);
+        if(fd < 0){
+            break;
+        }
+        //同一时间只进行一次交接
+        if(conn >= 0){
+            close(fd);
+            continue;
+        }
+        //发送可能被新进程阻塞，打开缓存中的文件也要访问文件系统，都放在辅助线程中
+        transfer_job* job = new transfer_job;
+        job->fd = dup(fd);
+        job->listenfd = listenfd;
+        job->cache = &cache;
+        pthread_t tid;
+        if(job->fd < 0 || pthread_create(&tid, NULL, transfer, job) != 0){
+            printf("handoff failed: %s\n", strerror(errno));
+            if(job->fd >= 0){
+                close(job->fd);
+            }
+            delete job;
+            close(fd);
+            continue;
+        }
+        pthread_detach(tid);
+        conn = fd;
+        started = true;
+    }
+    return started;
+}
+
+void* handoff::transfer(void* arg)
+{
+    transfer_job* job = (transfer_job*)arg;
+    int fd = job->fd;
+    set_timeout(fd, IO_TIMEOUT);
+    bool ok = send_fds(fd, 'L', NULL, 0, &job->listenfd, 1);
+
+    //在交接时重新打开缓存中的文件，新进程映射的是路径当前对应的文件
+    std::vector<std::string> paths;
+    job->cache->paths(paths);
+    std::string payload;
+    int fds[FILES_PER_MESSAGE];
+    int nfds = 0;
+    int sent = 0;
+    for(size_t i = 0; ok && i <= paths.size(); i++){
+        bool last = i == paths.size();
+        if(nfds > 0 && (last || nfds == FILES_PER_MESSAGE || payload.size() + paths[i].size() + 1 > MAX_PAYLOAD)){
+            ok = send_fds(fd, 'F', payload.data(), payload.size(), fds, nfds);
+            for(int j = 0; j < nfds; j++){
+                close(fds[j]);
+            }
+            nfds = 0;
+            payload.clear();
+            if(!ok){
+                break;
+            }
+        }
+        if(last || paths[i].size() + 1 > MAX_PAYLOAD){
+            continue;
+        }
+        int file = open(paths[i].c_str(), O_RDONLY | O_CLOEXEC);
+        if(file >= 0){
+            fds[nfds++] = file;
+            sent++;
+            payload.append(paths[i].c_str(), paths[i].size() + 1);
+        }
+    }
+    if(!ok || !send_fds(fd, 'E', NULL, 0, NULL, 0)){
+        printf("handoff failed: %s\n", strerror(errno));
+        //让reactor在控制连接上读到EOF，由它关闭自己的描述符并继续服务
+        shutdown(fd, SHUT_RDWR);
+    }
+    else{
+        printf("handed the listening socket and %d cached files to the new server\n", sent);
+    }
+    close(fd);
+    delete job;
+    return NULL;
+}
+
+int handoff::poll_ready(int conn)
+{
+    char c;
+    ssize_t n = recv(conn, &c, 1, 0);
+    if(n == 1 && c == 'R'){
+        return 1;
+    }
+    if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+        return 0;
+    }
+    return -1;
+}
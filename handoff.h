@@ -0,0 +1,39 @@
+#ifndef HANDOFF_H_INCLUDED
+#define HANDOFF_H_INCLUDED
+
+#include "file_cache.h"
+
+//热升级：运行中的进程在一个unix域socket(控制socket)上等待新版本的进程
+//新进程启动时连接控制socket，旧进程用SCM_RIGHTS交出监听socket以及文件缓存中的文件，
+//新进程开始accept后回复就绪，旧进程随即停止accept并排空已有的连接，新进程接着在同一路径上等待下一次升级
+//两个进程accept的是同一个监听socket，交接期间已完成握手的连接留在队列中，不会被拒绝
+class handoff
+{
+public:
+    //新进程启动时调用：path上有旧进程时接收它的监听socket，并把它缓存的文件放入cache
+    //成功时返回监听socket，conn为控制连接，开始accept后用ready通知旧进程；没有旧进程时返回-1
+    static int receive(const char* path, file_cache& cache, int& conn);
+    //通知旧进程新进程已经就绪，并关闭控制连接
+    static void ready(int conn);
+    //在path上创建控制socket，等待下一次升级，失败时返回-1
+    static int listen_control(const char* path);
+    //旧进程在控制socket可读时调用：接受新进程的连接，由辅助线程交出listenfd与缓存的文件，reactor不等待传输
+    //conn为正在进行的交接，已经有交接时拒绝新的连接；建立了新的交接时返回true，由调用者把conn注册到epoll
+    //传输失败时辅助线程关闭连接的读写两端，poll_ready随后返回-1
+    static bool offer(int control_fd, int listenfd, file_cache& cache, int& conn);
+    //旧进程在控制连接可读时调用：新进程就绪时返回1，需要继续等待时返回0，新进程退出时返回-1
+    static int poll_ready(int conn);
+
+private:
+    //每条消息携带的文件数上限
+    static const int FILES_PER_MESSAGE = 64;
+    //交接期间单次收发的超时(秒)，新进程卡住时旧进程不会一直阻塞
+    static const int IO_TIMEOUT = 5;
+
+    static bool send_fds(int conn, char type, const char* data, size_t len, const int* fds, int nfds);
+    //辅助线程的入口，arg为transfer_job
+    static void* transfer(void* arg);
+    static ssize_t recv_fds(int conn, char* buf, size_t len, int* fds, int& nfds);
+};
+
+#endif // HANDOFF_H_INCLUDED
@@ -0,0 +1,417 @@
+#include "hpack.h"
+
+#include <string.h>
+
+//静态表(RFC 7541附录A)，索引从1开始
+static const char* const static_table[][2] = {
+    {":authority", ""}, {":method", "GET"}, {":method", "POST"}, {":path", "/"},
+    {":path", "/index.html"}, {":scheme", "http"}, {":scheme", "https"}, {":status", "200"},
+    {":status", "204"}, {":status", "206"}, {":status", "304"}, {":status", "400"},
+    {":status", "404"}, {":status", "500"}, {"accept-charset", ""}, {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""}, {"accept-ranges", ""}, {"accept", ""}, {"access-control-allow-origin", ""},
+    {"age", ""}, {"allow", ""}, {"authorization", ""}, {"cache-control", ""},
+    {"content-disposition", ""}, {"content-encoding", ""}, {"content-language", ""}, {"content-length", ""},
+    {"content-location", ""}, {"content-range", ""}, {"content-type", ""}, {"cookie", ""},
+    {"date", ""}, {"etag", ""}, {"expect", ""}, {"expires", ""},
+    {"from", ""}, {"host", ""}, {"if-match", ""}, {"if-modified-since", ""},
+    {"if-none-match", ""}, {"if-range", ""}, {"if-unmodified-since", ""}, {"last-modified", ""},
+    {"link", ""}, {"location", ""}, {"max-forwards", ""}, {"proxy-authenticate", ""},
+    {"proxy-authorization", ""}, {"range", ""}, {"referer", ""}, {"refresh", ""},
+    {"retry-after", ""}, {"server", ""}, {"set-cookie", ""}, {"strict-transport-security", ""},
+    {"transfer-encoding", ""}, {"user-agent", ""}, {"vary", ""}, {"via", ""},
+    {"www-authenticate", ""},
+};
+static const size_t STATIC_COUNT = sizeof(static_table) / sizeof(static_table[0]);
+
+//Huffman编码表(RFC 7541附录B)，下标256为EOS
+static const uint32_t huffman_codes[257] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+    0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+    0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+    0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+    0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+    0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+    0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+    0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+    0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+    0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+    0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+    0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+    0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+    0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+    0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+    0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+    0x3fffffff,
+};
+static const uint8_t huffman_lengths[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+//把编码表展开成一棵二叉树，解码时逐位向下走；树只在第一次使用时构建
+struct huffman_node
+{
+    int16_t child[2];       //子节点下标，-1表示没有
+    int16_t symbol;         //叶子的符号，内部节点为-1
+};
+
+struct huffman_tree
+{
+    huffman_node nodes[513];
+    int count;
+
+    huffman_tree(): count(1)
+    {
+        nodes[0].child[0] = nodes[0].child[1] = -1;
+        nodes[0].symbol = -1;
+        for(int sym = 0; sym < 257; sym++){
+            int cur = 0;
+            for(int bit = huffman_lengths[sym] - 1; bit >= 0; bit--){
+                int b = (huffman_codes[sym] >> bit) & 1;
+                if(nodes[cur].child[b] < 0){
+                    nodes[count].child[0] = nodes[count].child[1] = -1;
+                    nodes[count].symbol = -1;
+                    nodes[cur].child[b] = count++;
+                }
+                cur = nodes[cur].child[b];
+            }
+            nodes[cur].symbol = sym;
+        }
+    }
+};
+
+bool hpack_huffman_decode(const uint8_t* data, size_t len, std::string& out)
+{
+    static const huffman_tree tree;
+    int cur = 0;
+    int depth = 0;          //当前未完成符号已经读了多少位
+    bool all_ones = true;   //未完成符号的位是否全为1，结尾的填充必须是EOS的前缀
+    for(size_t i = 0; i < len; i++){
+        for(int bit = 7; bit >= 0; bit--){
+            int b = (data[i] >> bit) & 1;
+            cur = tree.nodes[cur].child[b];
+            if(cur < 0){
+                return false;
+            }
+            depth++;
+            all_ones = all_ones && b;
+            int sym = tree.nodes[cur].symbol;
+            if(sym >= 0){
+                if(sym == 256){
+                    return false;   //EOS不能出现在字符串中
+                }
+                out.push_back((char)sym);
+                cur = 0;
+                depth = 0;
+                all_ones = true;
+            }
+        }
+    }
+    //填充最多7位且全为1
+    return depth <= 7 && all_ones;
+}
+
+bool hpack_decode_int(const uint8_t*& p, const uint8_t* end, int prefix_bits, uint64_t& value)
+{
+    if(p >= end){
+        return false;
+    }
+    uint64_t max_prefix = (1u << prefix_bits) - 1;
+    value = *p++ & max_prefix;
+    if(value < max_prefix){
+        return true;
+    }
+    int shift = 0;
+    while(p < end){
+        uint8_t b = *p++;
+        value += (uint64_t)(b & 0x7f) << shift;
+        if(!(b & 0x80)){
+            return true;
+        }
+        shift += 7;
+        if(shift > 28){
+            return false;   //超过头部块可能需要的范围，按格式错误处理
+        }
+    }
+    return false;
+}
+
+void hpack_encode_int(std::string& out, uint8_t first_byte, int prefix_bits, uint64_t value)
+{
+    uint64_t max_prefix = (1u << prefix_bits) - 1;
+    if(value < max_prefix){
+        out.push_back((char)(first_byte | value));
+        return;
+    }
+    out.push_back((char)(first_byte | max_prefix));
+    value -= max_prefix;
+    while(value >= 0x80){
+        out.push_back((char)(0x80 | (value & 0x7f)));
+        value >>= 7;
+    }
+    out.push_back((char)value);
+}
+
+//读取一个字符串字面量，最高位表示是否经过Huffman编码
+static bool decode_string(const uint8_t*& p, const uint8_t* end, std::string& out)
+{
+    if(p >= end){
+        return false;
+    }
+    bool huffman = *p & 0x80;
+    uint64_t len;
+    if(!hpack_decode_int(p, end, 7, len) || len > (uint64_t)(end - p)){
+        return false;
+    }
+    if(huffman){
+        if(!hpack_huffman_decode(p, len, out)){
+            return false;
+        }
+    }
+    else{
+        out.assign((const char*)p, len);
+    }
+    p += len;
+    return true;
+}
+
+static void encode_string(std::string& out, const std::string& s)
+{
+    hpack_encode_int(out, 0, 7, s.size());
+    out += s;
+}
+
+void hpack_table::add(const std::string& name, const std::string& value)
+{
+    size_t size = name.size() + value.size() + 32;
+    if(size > m_max_size){
+        //比整个表还大的条目会清空表，自己也不加入
+        m_entries.clear();
+        m_size = 0;
+        return;
+    }
+    m_size += size;
+    m_entries.push_front(hpack_header(name, value));
+    evict();
+}
+
+void hpack_table::set_max_size(size_t max_size)
+{
+    m_max_size = max_size;
+    evict();
+}
+
+void hpack_table::evict()
+{
+    while(m_size > m_max_size && !m_entries.empty()){
+        const hpack_header& h = m_entries.back();
+        m_size -= h.name.size() + h.value.size() + 32;
+        m_entries.pop_back();
+    }
+}
+
+//静态表的hpack_header形式，函数内静态对象只初始化一次
+struct static_headers
+{
+    hpack_header entries[STATIC_COUNT];
+
+    static_headers()
+    {
+        for(size_t i = 0; i < STATIC_COUNT; i++){
+            entries[i].name = static_table[i][0];
+            entries[i].value = static_table[i][1];
+        }
+    }
+};
+
+const hpack_header* hpack_table::get(size_t index) const
+{
+    static const static_headers statics;
+    if(index == 0){
+        return NULL;
+    }
+    if(index <= STATIC_COUNT){
+        return &statics.entries[index - 1];
+    }
+    index -= STATIC_COUNT + 1;
+    if(index >= m_entries.size()){
+        return NULL;
+    }
+    return &m_entries[index];
+}
+
+void hpack_table::find(const std::string& name, const std::string& value, size_t& full, size_t& name_only) const
+{
+    full = name_only = 0;
+    for(size_t i = 0; i < STATIC_COUNT; i++){
+        if(name == static_table[i][0]){
+            if(value == static_table[i][1]){
+                full = i + 1;
+                return;
+            }
+            if(!name_only){
+                name_only = i + 1;
+            }
+        }
+    }
+    for(size_t i = 0; i < m_entries.size(); i++){
+        const hpack_header& h = m_entries[i];
+        if(h.name == name){
+            if(h.value == value){
+                full = STATIC_COUNT + 1 + i;
+                return;
+            }
+            if(!name_only){
+                name_only = STATIC_COUNT + 1 + i;
+            }
+        }
+    }
+}
+
+bool hpack_decoder::decode(const uint8_t* data, size_t len, std::vector<hpack_header>& out)
+{
+    const uint8_t* p = data;
+    const uint8_t* end = data + len;
+    bool header_seen = false;
+    size_t list_size = 0;
+    while(p < end){
+        uint8_t b = *p;
+        if(b & 0x80){
+            //索引头部字段
+            uint64_t index;
+            if(!hpack_decode_int(p, end, 7, index)){
+                return false;
+            }
+            const hpack_header* h = m_table.get(index);
+            if(!h){
+                return false;
+            }
+            //在复制之前检查，超过上限的头部列表不会被展开
+            list_size += h->name.size() + h->value.size() + 32;
+            if(list_size > MAX_HEADER_LIST_SIZE){
+                return false;
+            }
+            out.push_back(*h);
+            header_seen = true;
+        }
+        else if((b & 0xe0) == 0x20){
+            //动态表大小更新，只能出现在头部块开头，且不能超过我们通告的上限
+            uint64_t size;
+            if(header_seen || !hpack_decode_int(p, end, 5, size) || size > m_limit){
+                return false;
+            }
+            m_table.set_max_size(size);
+        }
+        else{
+            //字面量：0x40带增量索引，0x00不索引，0x10永不索引
+            bool indexing = (b & 0xc0) == 0x40;
+            int prefix = indexing ? 6 : 4;
+            uint64_t index;
+            if(!hpack_decode_int(p, end, prefix, index)){
+                return false;
+            }
+            hpack_header h;
+            if(index){
+                const hpack_header* named = m_table.get(index);
+                if(!named){
+                    return false;
+                }
+                h.name = named->name;
+            }
+            else if(!decode_string(p, end, h.name)){
+                return false;
+            }
+            if(!decode_string(p, end, h.value)){
+                return false;
+            }
+            list_size += h.name.size() + h.value.size() + 32;
+            if(list_size > MAX_HEADER_LIST_SIZE){
+                return false;
+            }
+            if(indexing){
+                m_table.add(h.name, h.value);
+            }
+            out.push_back(h);
+            header_seen = true;
+        }
+    }
+    return true;
+}
+
+void hpack_encoder::set_max_size(size_t max_size)
+{
+    //我们的动态表不超过4096字节，对端允许更大时也不扩大
+    if(max_size > 4096){
+        max_size = 4096;
+    }
+    if(max_size != m_table.max_size()){
+        m_table.set_max_size(max_size);
+        m_pending_size_update = true;
+    }
+}
+
+//这些头部的值每个响应都不同，放进动态表只会把有用的条目挤出去
+static bool volatile_header(const std::string& name)
+{
+    return name == "content-length" || name == "date" || name == "etag" || name == "last-modified";
+}
+
+void hpack_encoder::encode(const std::vector<hpack_header>& headers, std::string& out)
+{
+    if(m_pending_size_update){
+        hpack_encode_int(out, 0x20, 5, m_table.max_size());
+        m_pending_size_update = false;
+    }
+    for(size_t i = 0; i < headers.size(); i++){
+        const hpack_header& h = headers[i];
+        size_t full, name_only;
+        m_table.find(h.name, h.value, full, name_only);
+        if(full){
+            hpack_encode_int(out, 0x80, 7, full);
+            continue;
+        }
+        if(volatile_header(h.name)){
+            //不索引的字面量
+            hpack_encode_int(out, 0x00, 4, name_only);
+        }
+        else{
+            hpack_encode_int(out, 0x40, 6, name_only);
+            m_table.add(h.name, h.value);
+        }
+        if(!name_only){
+            encode_string(out, h.name);
+        }
+        encode_string(out, h.value);
+    }
+}
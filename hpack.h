@@ -0,0 +1,82 @@
+#ifndef HPACK_H_INCLUDED
+#define HPACK_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <deque>
+
+//HPACK(RFC 7541)头部压缩，供http2_session使用
+
+struct hpack_header
+{
+    std::string name;
+    std::string value;
+
+    hpack_header() {}
+    hpack_header(const std::string& n, const std::string& v): name(n), value(v) {}
+};
+
+//动态表，编码器与解码器各有一份，新条目插入在最前面，索引从静态表之后的62开始
+class hpack_table
+{
+public:
+    hpack_table(size_t max_size = 4096): m_size(0), m_max_size(max_size) {}
+
+    void add(const std::string& name, const std::string& value);
+    void set_max_size(size_t max_size);
+    size_t max_size() const { return m_max_size; }
+    //按完整索引(1开始，包括静态表)取条目，越界返回NULL
+    const hpack_header* get(size_t index) const;
+    //查找完整匹配与仅名字匹配的索引，找不到时为0
+    void find(const std::string& name, const std::string& value, size_t& full, size_t& name_only) const;
+
+private:
+    void evict();
+
+private:
+    std::deque<hpack_header> m_entries;
+    size_t m_size;          //按RFC计算的大小：每个条目为name+value+32
+    size_t m_max_size;
+};
+
+class hpack_decoder
+{
+public:
+    //解码后头部列表的上限，按RFC 7541的算法每个头部计名字、值再加32字节，通过SETTINGS_MAX_HEADER_LIST_SIZE通告
+    //很小的头部块可以用索引反复引用动态表中的大条目，解码结果可能比头部块大几千倍，必须限制
+    static const size_t MAX_HEADER_LIST_SIZE = 64 * 1024;
+
+    //max_size为我们在SETTINGS_HEADER_TABLE_SIZE中通告的上限
+    hpack_decoder(size_t max_size = 4096): m_table(max_size), m_limit(max_size) {}
+
+    //解码一个完整的头部块，格式错误或解码结果超过MAX_HEADER_LIST_SIZE时返回false，连接应以COMPRESSION_ERROR关闭
+    bool decode(const uint8_t* data, size_t len, std::vector<hpack_header>& out);
+
+private:
+    hpack_table m_table;
+    size_t m_limit;
+};
+
+class hpack_encoder
+{
+public:
+    hpack_encoder(): m_table(4096), m_pending_size_update(false) {}
+
+    //对端通过SETTINGS_HEADER_TABLE_SIZE限制我们可以使用的动态表大小
+    void set_max_size(size_t max_size);
+    //编码一组头部并追加到out；内容随响应变化的头部不进入动态表
+    void encode(const std::vector<hpack_header>& headers, std::string& out);
+
+private:
+    hpack_table m_table;
+    bool m_pending_size_update;     //下一个头部块开头需要发送动态表大小更新
+};
+
+//整数与Huffman字符串的编解码
+bool hpack_decode_int(const uint8_t*& p, const uint8_t* end, int prefix_bits, uint64_t& value);
+void hpack_encode_int(std::string& out, uint8_t first_byte, int prefix_bits, uint64_t value);
+bool hpack_huffman_decode(const uint8_t* data, size_t len, std::string& out);
+
+#endif // HPACK_H_INCLUDED
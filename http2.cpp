@@ -0,0 +1,725 @@
+#include "http2.h"
+
+#include <string.h>
+#include <stdio.h>
+
+const char http2_session::PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+//帧类型
+enum
+{
+    FRAME_DATA = 0x0, FRAME_HEADERS = 0x1, FRAME_PRIORITY = 0x2, FRAME_RST_STREAM = 0x3,
+    FRAME_SETTINGS = 0x4, FRAME_PUSH_PROMISE = 0x5, FRAME_PING = 0x6, FRAME_GOAWAY = 0x7,
+    FRAME_WINDOW_UPDATE = 0x8, FRAME_CONTINUATION = 0x9
+};
+//帧标志
+enum
+{
+    FLAG_END_STREAM = 0x1, FLAG_ACK = 0x1, FLAG_END_HEADERS = 0x4,
+    FLAG_PADDED = 0x8, FLAG_PRIORITY = 0x20
+};
+//SETTINGS参数
+enum
+{
+    SETTINGS_HEADER_TABLE_SIZE = 0x1, SETTINGS_ENABLE_PUSH = 0x2, SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+    SETTINGS_INITIAL_WINDOW_SIZE = 0x4, SETTINGS_MAX_FRAME_SIZE = 0x5, SETTINGS_MAX_HEADER_LIST_SIZE = 0x6
+};
+
+//我们接受的最大帧长度，即协议默认值，不通过SETTINGS放大
+static const uint32_t MAX_FRAME_SIZE = 16384;
+//头部块(HEADERS加上所有CONTINUATION)的上限
+static const size_t MAX_HEADER_BLOCK = 64 * 1024;
+//每次produce最多积累的输出，避免一个大文件把整个响应复制进输出缓冲
+static const size_t OUTPUT_HIGH_WATER = 64 * 1024;
+static const int64_t MAX_WINDOW = 0x7fffffff;
+
+static uint32_t read_u32(const uint8_t* p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void append_u32(std::string& out, uint32_t v)
+{
+    out.push_back((char)(v >> 24));
+    out.push_back((char)(v >> 16));
+    out.push_back((char)(v >> 8));
+    out.push_back((char)v);
+}
+
+//解码HTTP2-Settings头部使用的base64url，允许省略结尾的'='
+static bool base64url_decode(const char* s, std::string& out)
+{
+    uint32_t acc = 0;
+    int bits = 0;
+    for(; *s && *s != '='; s++){
+        char c = *s;
+        int v;
+        if(c >= 'A' && c <= 'Z') v = c - 'A';
+        else if(c >= 'a' && c <= 'z') v = c - 'a' + 26;
+        else if(c >= '0' && c <= '9') v = c - '0' + 52;
+        else if(c == '-' || c == '+') v = 62;
+        else if(c == '_' || c == '/') v = 63;
+        else if(c == ' ' || c == '\t') continue;
+        else return false;
+        acc = (acc << 6) | v;
+        bits += 6;
+        if(bits >= 8){
+            bits -= 8;
+            out.push_back((char)(acc >> bits));
+        }
+    }
+    return true;
+}
+
+http2_session::http2_session(request_handler handler, void* ctx):
+    m_handler(handler), m_ctx(ctx), m_last_stream_id(0), m_send_window(65535),
+    m_peer_initial_window(65535), m_peer_max_frame(16384), m_in_read(0),
+    m_preface_done(false), m_settings_seen(false), m_header_stream(0), m_header_end_stream(false),
+    m_out_sent(0), m_goaway_sent(false), m_goaway_received(false), m_failed(false)
+{
+}
+
+http2_session::~http2_session()
+{
+    while(!m_streams.empty()){
+        close_stream(m_streams.begin()->second);
+    }
+}
+
+void http2_session::start()
+{
+    write_settings();
+}
+
+bool http2_session::upgrade(const char* settings, const http2_request& req)
+{
+    std::string payload;
+    if(!base64url_decode(settings, payload) || payload.size() % 6 != 0){
+        return false;
+    }
+    m_out += "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+    write_settings();
+    if(!apply_settings((const uint8_t*)payload.data(), payload.size())){
+        return false;
+    }
+    //升级的请求作为流1，客户端一方已经结束
+    m_last_stream_id = 1;
+    stream* s = new stream;
+    s->id = 1;
+    s->remote_closed = true;
+    s->responded = false;
+    s->send_window = m_peer_initial_window;
+    s->request = req;
+    s->body.data = NULL;
+    s->body.len = 0;
+    s->body.release = NULL;
+    s->body_sent = 0;
+    s->queued = false;
+    m_streams[1] = s;
+    dispatch(s);
+    return true;
+}
+
+bool http2_session::receive(const char* data, size_t len)
+{
+    if(m_in.size() - m_in_read + len > INPUT_LIMIT){
+        return false;
+    }
+    m_in.append(data, len);
+    return true;
+}
+
+bool http2_session::process_input()
+{
+    while(!m_failed){
+        size_t avail = m_in.size() - m_in_read;
+        const uint8_t* p = (const uint8_t*)m_in.data() + m_in_read;
+        if(!m_preface_done){
+            size_t n = avail < PREFACE_LEN ? avail : PREFACE_LEN;
+            if(memcmp(p, PREFACE, n) != 0){
+                return connection_error(H2_PROTOCOL_ERROR);
+            }
+            if(n < PREFACE_LEN){
+                break;
+            }
+            m_in_read += PREFACE_LEN;
+            m_preface_done = true;
+            continue;
+        }
+        //帧头：24位长度，8位类型，8位标志，31位流标识
+        if(avail < 9){
+            break;
+        }
+        uint32_t len = ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+        if(len > MAX_FRAME_SIZE){
+            return connection_error(H2_FRAME_SIZE_ERROR);
+        }
+        if(avail < 9 + len){
+            break;
+        }
+        uint8_t type = p[3];
+        uint8_t flags = p[4];
+        uint32_t id = read_u32(p + 5) & 0x7fffffff;
+        m_in_read += 9 + len;
+        if(!handle_frame(type, flags, id, p + 9, len)){
+            return false;
+        }
+    }
+    //丢弃已经处理的输入
+    if(m_in_read == m_in.size()){
+        m_in.clear();
+        m_in_read = 0;
+    }
+    else if(m_in_read > INPUT_LIMIT / 2){
+        m_in.erase(0, m_in_read);
+        m_in_read = 0;
+    }
+    return !m_failed;
+}
+
+bool http2_session::handle_frame(uint8_t type, uint8_t flags, uint32_t id, const uint8_t* payload, uint32_t len)
+{
+    //头部块必须连续，中间不能插入其他帧
+    if(m_header_stream && type != FRAME_CONTINUATION){
+        return connection_error(H2_PROTOCOL_ERROR);
+    }
+    //前言之后的第一个帧必须是SETTINGS
+    if(!m_settings_seen){
+        if(type != FRAME_SETTINGS || (flags & FLAG_ACK)){
+            return connection_error(H2_PROTOCOL_ERROR);
+        }
+        m_settings_seen = true;
+    }
+    switch(type)
+    {
+    case FRAME_DATA:
+        return on_data(flags, id, payload, len);
+    case FRAME_HEADERS:
+        return on_headers(flags, id, payload, len);
+    case FRAME_CONTINUATION:
+        return on_continuation(flags, id, payload, len);
+    case FRAME_SETTINGS:
+        return on_settings(flags, id, payload, len);
+    case FRAME_WINDOW_UPDATE:
+        return on_window_update(id, payload, len);
+    case FRAME_PRIORITY:
+        //不按优先级调度，只检查格式
+        if(id == 0){
+            return connection_error(H2_PROTOCOL_ERROR);
+        }
+        if(len != 5){
+            reset_stream(id, H2_FRAME_SIZE_ERROR);
+        }
+        return true;
+    case FRAME_RST_STREAM:
+    {
+        if(id == 0 || id > m_last_stream_id){
+            return connection_error(H2_PROTOCOL_ERROR);
+        }
+        if(len != 4){
+            return connection_error(H2_FRAME_SIZE_ERROR);
+        }
+        std::map<uint32_t, stream*>::iterator it = m_streams.find(id);
+        if(it != m_streams.end()){
+            close_stream(it->second);
+        }
+        return true;
+    }
+    case FRAME_PING:
+        if(id != 0){
+            return connection_error(H2_PROTOCOL_ERROR);
+        }
+        if(len != 8){
+            return connection_error(H2_FRAME_SIZE_ERROR);
+        }
+        if(!(flags & FLAG_ACK)){
+            write_frame_header(8, FRAME_PING, FLAG_ACK, 0);
+            m_out.append((const char*)payload, 8);
+        }
+        return true;
+    case FRAME_GOAWAY:
+        if(id != 0){
+            return connection_error(H2_PROTOCOL_ERROR);
+        }
+        m_goaway_received = true;
+        return true;
+    case FRAME_PUSH_PROMISE:
+        //客户端不能推送
+        return connection_error(H2_PROTOCOL_ERROR);
+    default:
+        //未知类型的帧必须忽略
+        return true;
+    }
+}
+
+bool http2_session::on_headers(uint8_t flags, uint32_t id, const uint8_t* payload, uint32_t len)
+{
+    if(id == 0 || !(id & 1)){
+        return connection_error(H2_PROTOCOL_ERROR);
+    }
+    if(flags & FLAG_PADDED){
+        if(len < 1 || payload[0] >= len){
+            return connection_error(H2_PROTOCOL_ERROR);
+        }
+        len -= 1 + payload[0];
+        payload++;
+    }
+    if(flags & FLAG_PRIORITY){
+        if(len < 5){
+            return connection_error(H2_FRAME_SIZE_ERROR);
+        }
+        payload += 5;
+        len -= 5;
+    }
+    m_header_stream = id;
+    m_header_end_stream = flags & FLAG_END_STREAM;
+    m_header_block.assign((const char*)payload, len);
+    if(flags & FLAG_END_HEADERS){
+        return on_header_block();
+    }
+    return true;
+}
+
+bool http2_session::on_continuation(uint8_t flags, uint32_t id, const uint8_t* payload, uint32_t len)
+{
+    if(m_header_stream == 0 || id != m_header_stream){
+        return connection_error(H2_PROTOCOL_ERROR);
+    }
+    if(m_header_block.size() + len > MAX_HEADER_BLOCK){
+        return connection_error(H2_PROTOCOL_ERROR);
+    }
+    m_header_block.append((const char*)payload, len);
+    if(flags & FLAG_END_HEADERS){
+        return on_header_block();
+    }
+    return true;
+}
+
+//头部块接收完整：解码，建立新的流或处理trailer
+bool http2_session::on_header_block()
+{
+    uint32_t id = m_header_stream;
+    m_header_stream = 0;
+    //即使流随后被拒绝也必须解码，否则两端的动态表会不一致
+    std::vector<hpack_header> headers;
+    bool ok = m_decoder.decode((const uint8_t*)m_header_block.data(), m_header_block.size(), headers);
+    m_header_block.clear();
+    if(!ok){
+        return connection_error(H2_COMPRESSION_ERROR);
+    }
+
+    std::map<uint32_t, stream*>::iterator it = m_streams.find(id);
+    if(it != m_streams.end()){
+        //已经存在的流上的HEADERS是trailer，必须结束流
+        stream* s = it->second;
+        if(s->remote_closed || !m_header_end_stream){
+            reset_stream(id, s->remote_closed ? H2_STREAM_CLOSED : H2_PROTOCOL_ERROR);
+            close_stream(s);
+            return true;
+        }
+        s->remote_closed = true;
+        dispatch(s);
+        return true;
+    }
+    //流标识必须递增，更小的标识属于已经关闭的流
+    if(id <= m_last_stream_id){
+        return connection_error(H2_STREAM_CLOSED);
+    }
+    m_last_stream_id = id;
+    //发送GOAWAY之后的新流直接忽略，客户端会在新的连接上重试
+    if(m_goaway_sent){
+        return true;
+    }
+    if(m_streams.size() >= MAX_STREAMS){
+        reset_stream(id, H2_REFUSED_STREAM);
+        return true;
+    }
+
+    stream* s = new stream;
+    s->id = id;
+    s->remote_closed = false;
+    s->responded = false;
+    s->send_window = m_peer_initial_window;
+    s->body.data = NULL;
+    s->body.len = 0;
+    s->body.release = NULL;
+    s->body_sent = 0;
+    s->queued = false;
+    //伪头部必须在普通头部之前，普通头部的名字必须是小写，且不能有连接相关的头部
+    bool malformed = false;
+    bool regular_seen = false;
+    for(size_t i = 0; i < headers.size() && !malformed; i++){
+        hpack_header& h = headers[i];
+        if(!h.name.empty() && h.name[0] == ':'){
+            if(regular_seen){
+                malformed = true;
+            }
+            else if(h.name == ":method"){
+                s->request.method.swap(h.value);
+            }
+            else if(h.name == ":path"){
+                s->request.path.swap(h.value);
+            }
+            else if(h.name == ":authority"){
+                s->request.authority.swap(h.value);
+            }
+            else if(h.name != ":scheme"){
+                malformed = true;
+            }
+            continue;
+        }
+        regular_seen = true;
+        for(size_t j = 0; j < h.name.size(); j++){
+            if(h.name[j] >= 'A' && h.name[j] <= 'Z'){
+                malformed = true;
+            }
+        }
+        if(h.name == "connection" || h.name == "keep-alive" || h.name == "upgrade" ||
+           h.name == "transfer-encoding"){
+            malformed = true;
+        }
+        if(h.name == "host" && s->request.authority.empty()){
+            s->request.authority = h.value;
+        }
+        s->request.headers.push_back(hpack_header());
+        s->request.headers.back().name.swap(h.name);
+        s->request.headers.back().value.swap(h.value);
+    }
+    if(malformed || s->request.method.empty() || s->request.path.empty()){
+        delete s;
+        reset_stream(id, H2_PROTOCOL_ERROR);
+        return true;
+    }
+    m_streams[id] = s;
+    if(m_header_end_stream){
+        s->remote_closed = true;
+        dispatch(s);
+    }
+    return true;
+}
+
+bool http2_session::on_data(uint8_t flags, uint32_t id, const uint8_t* payload, uint32_t len)
+{
+    if(id == 0){
+        return connection_error(H2_PROTOCOL_ERROR);
+    }
+    if(flags & FLAG_PADDED){
+        if(len < 1 || payload[0] >= len){
+            return connection_error(H2_PROTOCOL_ERROR);
+        }
+    }
+    //请求体不被使用，收到的数据立即归还连接级窗口
+    if(len){
+        write_window_update(0, len);
+    }
+    std::map<uint32_t, stream*>::iterator it = m_streams.find(id);
+    if(it == m_streams.end()){
+        if(id > m_last_stream_id){
+            return connection_error(H2_PROTOCOL_ERROR);
+        }
+        reset_stream(id, H2_STREAM_CLOSED);
+        return true;
+    }
+    stream* s = it->second;
+    if(s->remote_closed){
+        reset_stream(id, H2_STREAM_CLOSED);
+        close_stream(s);
+        return true;
+    }
+    if(flags & FLAG_END_STREAM){
+        s->remote_closed = true;
+        dispatch(s);
+    }
+    else if(len){
+        write_window_update(id, len);
+    }
+    return true;
+}
+
+bool http2_session::on_settings(uint8_t flags, uint32_t id, const uint8_t* payload, uint32_t len)
+{
+    if(id != 0){
+        return connection_error(H2_PROTOCOL_ERROR);
+    }
+    if(flags & FLAG_ACK){
+        return len == 0 ? true : connection_error(H2_FRAME_SIZE_ERROR);
+    }
+    if(len % 6 != 0){
+        return connection_error(H2_FRAME_SIZE_ERROR);
+    }
+    if(!apply_settings(payload, len)){
+        return false;
+    }
+    write_frame_header(0, FRAME_SETTINGS, FLAG_ACK, 0);
+    return true;
+}
+
+bool http2_session::apply_settings(const uint8_t* payload, uint32_t len)
+{
+    for(uint32_t off = 0; off + 6 <= len; off += 6){
+        uint16_t key = (payload[off] << 8) | payload[off + 1];
+        uint32_t value = read_u32(payload + off + 2);
+        switch(key)
+        {
+        case SETTINGS_HEADER_TABLE_SIZE:
+            m_encoder.set_max_size(value);
+            break;
+        case SETTINGS_ENABLE_PUSH:
+            if(value > 1){
+                return connection_error(H2_PROTOCOL_ERROR);
+            }
+            break;
+        case SETTINGS_INITIAL_WINDOW_SIZE:
+        {
+            if(value > MAX_WINDOW){
+                return connection_error(H2_FLOW_CONTROL_ERROR);
+            }
+            //初始窗口的变化作用于所有已经打开的流
+            int64_t delta = (int64_t)value - m_peer_initial_window;
+            m_peer_initial_window = value;
+            for(std::map<uint32_t, stream*>::iterator it = m_streams.begin(); it != m_streams.end(); ++it){
+                it->second->send_window += delta;
+                schedule(it->second);
+            }
+            break;
+        }
+        case SETTINGS_MAX_FRAME_SIZE:
+            if(value < 16384 || value > 16777215){
+                return connection_error(H2_PROTOCOL_ERROR);
+            }
+            m_peer_max_frame = value;
+            break;
+        default:
+            break;
+        }
+    }
+    return true;
+}
+
+bool http2_session::on_window_update(uint32_t id, const uint8_t* payload, uint32_t len)
+{
+    if(len != 4){
+        return connection_error(H2_FRAME_SIZE_ERROR);
+    }
+    uint32_t increment = read_u32(payload) & 0x7fffffff;
+    if(id == 0){
+        if(increment == 0){
+            return connection_error(H2_PROTOCOL_ERROR);
+        }
+        m_send_window += increment;
+        if(m_send_window > MAX_WINDOW){
+            return connection_error(H2_FLOW_CONTROL_ERROR);
+        }
+        return true;
+    }
+    std::map<uint32_t, stream*>::iterator it = m_streams.find(id);
+    if(it == m_streams.end()){
+        return true;
+    }
+    stream* s = it->second;
+    s->send_window += increment;
+    if(increment == 0 || s->send_window > MAX_WINDOW){
+        reset_stream(id, increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+        close_stream(s);
+        return true;
+    }
+    schedule(s);
+    return true;
+}
+
+void http2_session::dispatch(stream* s)
+{
+    uint32_t id = s->id;
+    m_handler(m_ctx, this, id, s->request);
+    //处理函数可能已经发送完响应并关闭了流
+    std::map<uint32_t, stream*>::iterator it = m_streams.find(id);
+    if(it == m_streams.end()){
+        return;
+    }
+    if(!it->second->responded){
+        reset_stream(id, H2_INTERNAL_ERROR);
+        close_stream(it->second);
+        return;
+    }
+    it->second->request = http2_request();
+}
+
+void http2_session::respond(uint32_t stream_id, int status, const std::vector<hpack_header>& headers, const http2_body& body)
+{
+    std::map<uint32_t, stream*>::iterator it = m_streams.find(stream_id);
+    if(it == m_streams.end() || it->second->responded){
+        if(body.release){
+            body.release(body.handle, body.data, body.len);
+        }
+        return;
+    }
+    stream* s = it->second;
+    s->responded = true;
+    s->body = body;
+    s->body_sent = 0;
+
+    std::vector<hpack_header> all;
+    all.reserve(headers.size() + 1);
+    char status_text[8];
+    snprintf(status_text, sizeof(status_text), "%d", status);
+    all.push_back(hpack_header(":status", status_text));
+    all.insert(all.end(), headers.begin(), headers.end());
+    std::string block;
+    m_encoder.encode(all, block);
+
+    //头部块超过对端的最大帧长度时拆分为HEADERS与CONTINUATION
+    size_t off = 0;
+    bool first = true;
+    do{
+        size_t n = block.size() - off;
+        if(n > m_peer_max_frame){
+            n = m_peer_max_frame;
+        }
+        uint8_t flags = off + n == block.size() ? FLAG_END_HEADERS : 0;
+        if(first && body.len == 0){
+            flags |= FLAG_END_STREAM;
+        }
+        write_frame_header(n, first ? FRAME_HEADERS : FRAME_CONTINUATION, flags, stream_id);
+        m_out.append(block, off, n);
+        off += n;
+        first = false;
+    }while(off < block.size());
+
+    if(body.len == 0){
+        close_stream(s);
+    }
+    else{
+        schedule(s);
+    }
+}
+
+void http2_session::shutdown()
+{
+    if(m_goaway_sent){
+        return;
+    }
+    write_frame_header(8, FRAME_GOAWAY, 0, 0);
+    append_u32(m_out, m_last_stream_id);
+    append_u32(m_out, H2_NO_ERROR);
+    m_goaway_sent = true;
+}
+
+void http2_session::produce()
+{
+    //h2c升级后在收到客户端的SETTINGS之前不发送数据，客户端在此之前只能缓冲很少的数据
+    if(!m_settings_seen){
+        return;
+    }
+    while(!m_ready.empty() && m_send_window > 0 && pending() < OUTPUT_HIGH_WATER){
+        stream* s = m_ready.front();
+        m_ready.pop_front();
+        s->queued = false;
+        //窗口可能在排队期间被SETTINGS缩小
+        if(s->send_window <= 0){
+            continue;
+        }
+        size_t left = s->body.len - s->body_sent;
+        size_t n = left;
+        //每个DATA帧不超过16KB，让多个流交替发送
+        if(n > MAX_FRAME_SIZE) n = MAX_FRAME_SIZE;
+        if(n > (size_t)s->send_window) n = s->send_window;
+        if(n > (size_t)m_send_window) n = m_send_window;
+        bool last = n == left;
+        write_frame_header(n, FRAME_DATA, last ? FLAG_END_STREAM : 0, s->id);
+        m_out.append(s->body.data + s->body_sent, n);
+        s->body_sent += n;
+        s->send_window -= n;
+        m_send_window -= n;
+        if(last){
+            close_stream(s);
+        }
+        else{
+            schedule(s);
+        }
+    }
+}
+
+void http2_session::consume(size_t n)
+{
+    m_out_sent += n;
+    if(m_out_sent == m_out.size()){
+        m_out.clear();
+        m_out_sent = 0;
+    }
+}
+
+bool http2_session::finished() const
+{
+    return m_failed || ((m_goaway_sent || m_goaway_received) && m_streams.empty());
+}
+
+void http2_session::schedule(stream* s)
+{
+    if(!s->queued && s->responded && s->body_sent < s->body.len && s->send_window > 0){
+        m_ready.push_back(s);
+        s->queued = true;
+    }
+}
+
+void http2_session::close_stream(stream* s)
+{
+    if(s->body.release){
+        s->body.release(s->body.handle, s->body.data, s->body.len);
+    }
+    if(s->queued){
+        m_ready.remove(s);
+    }
+    m_streams.erase(s->id);
+    delete s;
+}
+
+void http2_session::reset_stream(uint32_t id, ERROR_CODE code)
+{
+    write_frame_header(4, FRAME_RST_STREAM, 0, id);
+    append_u32(m_out, code);
+}
+
+bool http2_session::connection_error(ERROR_CODE code)
+{
+    if(!m_failed){
+        printf("http2 connection error:%d\n", code);
+        write_frame_header(8, FRAME_GOAWAY, 0, 0);
+        append_u32(m_out, m_last_stream_id);
+        append_u32(m_out, code);
+        m_goaway_sent = true;
+        m_failed = true;
+    }
+    return false;
+}
+
+void http2_session::write_frame_header(uint32_t len, uint8_t type, uint8_t flags, uint32_t id)
+{
+    char header[9];
+    header[0] = len >> 16;
+    header[1] = len >> 8;
+    header[2] = len;
+    header[3] = type;
+    header[4] = flags;
+    header[5] = (id >> 24) & 0x7f;
+    header[6] = id >> 16;
+    header[7] = id >> 8;
+    header[8] = id;
+    m_out.append(header, 9);
+}
+
+void http2_session::write_settings()
+{
+    write_frame_header(12, FRAME_SETTINGS, 0, 0);
+    m_out.push_back(0);
+    m_out.push_back(SETTINGS_MAX_CONCURRENT_STREAMS);
+    append_u32(m_out, MAX_STREAMS);
+    m_out.push_back(0);
+    m_out.push_back(SETTINGS_MAX_HEADER_LIST_SIZE);
+    append_u32(m_out, hpack_decoder::MAX_HEADER_LIST_SIZE);
+}
+
+void http2_session::write_window_update(uint32_t id, uint32_t increment)
+{
+    write_frame_header(4, FRAME_WINDOW_UPDATE, 0, id);
+    append_u32(m_out, increment);
+}
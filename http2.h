@@ -0,0 +1,148 @@
+#ifndef HTTP2_H_INCLUDED
+#define HTTP2_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <list>
+#include "hpack.h"
+
+//HTTP/2(RFC 7540)明文连接的会话层：帧解析、HPACK、流量控制与流调度
+//会话不接触socket，读到的数据通过receive交给它，待发送的帧从pending_data取走，由http_conn负责收发
+//一个连接上的所有流共享一个会话，会话对象只被当前持有连接的线程访问，不需要加锁
+
+//响应体，数据由调用者提供，流结束或被重置时调用release释放
+struct http2_body
+{
+    const char* data;
+    size_t len;
+    void (*release)(void* handle, const char* data, size_t len);
+    void* handle;
+};
+
+//一个完整的请求，只保留文件层需要的部分，请求体被丢弃
+struct http2_request
+{
+    std::string method;
+    std::string path;
+    std::string authority;
+    std::vector<hpack_header> headers;      //伪头部之外的头部
+};
+
+class http2_session
+{
+public:
+    //错误码
+    enum ERROR_CODE
+    {
+        H2_NO_ERROR = 0x0, H2_PROTOCOL_ERROR = 0x1, H2_INTERNAL_ERROR = 0x2,
+        H2_FLOW_CONTROL_ERROR = 0x3, H2_STREAM_CLOSED = 0x5, H2_FRAME_SIZE_ERROR = 0x6,
+        H2_REFUSED_STREAM = 0x7, H2_CANCEL = 0x8, H2_COMPRESSION_ERROR = 0x9
+    };
+    //客户端连接前言
+    static const char PREFACE[];
+    static const size_t PREFACE_LEN = 24;
+    //同时处理的流的上限，通过SETTINGS_MAX_CONCURRENT_STREAMS通告
+    static const uint32_t MAX_STREAMS = 100;
+    //输入缓冲的上限，超过说明对端不遵守流量控制
+    static const size_t INPUT_LIMIT = 256 * 1024;
+
+    //请求完整到达时调用，处理函数必须在返回前调用respond
+    typedef void (*request_handler)(void* ctx, http2_session* session, uint32_t stream_id, const http2_request& req);
+
+    http2_session(request_handler handler, void* ctx);
+    ~http2_session();
+
+    //以prior knowledge方式开始：发送服务端的SETTINGS，等待客户端前言
+    void start();
+    //h2c升级：写入101响应与服务端SETTINGS，HTTP2-Settings(base64url)作为客户端的初始设置，
+    //升级前的请求成为已经半关闭的流1；设置格式错误时返回false
+    bool upgrade(const char* settings, const http2_request& req);
+    //保存读到的数据，超过INPUT_LIMIT时返回false
+    bool receive(const char* data, size_t len);
+    //解析已经保存的完整帧，请求到达时调用处理函数；
+    //返回false表示连接错误，GOAWAY已经写入输出缓冲，发送完后应关闭连接
+    bool process_input();
+    //提交流的响应，headers不包括:status
+    void respond(uint32_t stream_id, int status, const std::vector<hpack_header>& headers, const http2_body& body);
+    //不再接受新的流：发送GOAWAY，已经开始的流继续发送完
+    void shutdown();
+    //按流量控制窗口轮流为各个流生成DATA帧，追加到输出缓冲
+    void produce();
+
+    const char* pending_data() const { return m_out.data() + m_out_sent; }
+    size_t pending() const { return m_out.size() - m_out_sent; }
+    void consume(size_t n);
+    //连接是否可以关闭：发生连接错误，或任一方发送了GOAWAY且所有流都已结束
+    bool finished() const;
+    //输入输出缓冲与流占用的内存，不含响应体引用的缓存或映射
+    size_t memory() const
+    {
+        return m_in.capacity() + m_out.capacity() + m_header_block.capacity() + m_streams.size() * sizeof(stream);
+    }
+
+private:
+    struct stream
+    {
+        uint32_t id;
+        bool remote_closed;         //收到了END_STREAM
+        bool responded;
+        int64_t send_window;
+        http2_request request;
+        http2_body body;
+        size_t body_sent;
+        bool queued;                //是否在m_ready中
+    };
+
+    bool handle_frame(uint8_t type, uint8_t flags, uint32_t id, const uint8_t* payload, uint32_t len);
+    bool on_headers(uint8_t flags, uint32_t id, const uint8_t* payload, uint32_t len);
+    bool on_continuation(uint8_t flags, uint32_t id, const uint8_t* payload, uint32_t len);
+    bool on_header_block();
+    bool on_data(uint8_t flags, uint32_t id, const uint8_t* payload, uint32_t len);
+    bool on_settings(uint8_t flags, uint32_t id, const uint8_t* payload, uint32_t len);
+    bool on_window_update(uint32_t id, const uint8_t* payload, uint32_t len);
+    bool apply_settings(const uint8_t* payload, uint32_t len);
+    void dispatch(stream* s);
+    void close_stream(stream* s);
+    void reset_stream(uint32_t id, ERROR_CODE code);
+    bool connection_error(ERROR_CODE code);
+    void write_frame_header(uint32_t len, uint8_t type, uint8_t flags, uint32_t id);
+    void write_settings();
+    void write_window_update(uint32_t id, uint32_t increment);
+    void schedule(stream* s);
+
+private:
+    request_handler m_handler;
+    void* m_ctx;
+    hpack_decoder m_decoder;
+    hpack_encoder m_encoder;
+
+    std::map<uint32_t, stream*> m_streams;
+    //有数据待发送且窗口未耗尽的流，按轮询顺序
+    std::list<stream*> m_ready;
+    uint32_t m_last_stream_id;      //收到的最大流标识
+    int64_t m_send_window;          //连接级发送窗口
+    uint32_t m_peer_initial_window;
+    uint32_t m_peer_max_frame;
+
+    std::string m_in;
+    size_t m_in_read;
+    bool m_preface_done;
+    bool m_settings_seen;           //前言之后的第一个帧必须是SETTINGS
+
+    //正在接收的头部块，等待CONTINUATION时非0
+    uint32_t m_header_stream;
+    bool m_header_end_stream;
+    std::string m_header_block;
+
+    std::string m_out;
+    size_t m_out_sent;
+
+    bool m_goaway_sent;
+    bool m_goaway_received;
+    bool m_failed;
+};
+
+#endif // HTTP2_H_INCLUDED
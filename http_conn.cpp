@@ -1,4 +1,5 @@
 #include "http_conn.h"
+#include "trace.h"
 
 //定义http响应的一些状态信息
 const char* ok_200_title = "OK";
@@ -10,6 +11,16 @@ const char* error_404_title = "Not Found";
 const char* error_404_form = "The requested file was not found on this server.\n";
 const char* error_500_title = "Internal Error";
 const char* error_500_form = "There was an unusual problem serving the requested file.\n";
+const char* error_413_title = "Payload Too Large";
+const char* error_413_form = "The request body is too large for this resource.\n";
+const char* error_429_title = "Too Many Requests";
+const char* error_429_form = "You have sent too many requests, please slow down.\n";
+const char* error_502_title = "Bad Gateway";
+const char* error_502_form = "The upstream server is unavailable.\n";
+const char* error_503_title = "Service Unavailable";
+const char* error_503_form = "The server is overloaded, please retry later.\n";
+const char* error_505_title = "HTTP Version Not Supported";
+const char* error_505_form = "This resource is only served over HTTP/1.1.\n";
 //网站根目录
 const char* doc_root = "/home/sapphire/";
 
@@ -46,16 +57,90 @@ void modfd(int epollfd, int fd, int ev)
     epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event);
 }
 
-int http_conn::m_user_count = 0;
+std::atomic<int> http_conn::m_user_count(0);
+std::atomic<bool> http_conn::m_draining(false);
 int http_conn::m_epollfd = -1;
+file_cache http_conn::m_file_cache;
+micro_cache http_conn::m_micro_cache;
+std::atomic<uint64_t> http_conn::m_next_request_id(1);
+std::vector<std::pair<std::string, int> > http_conn::m_class_rules;
+std::vector<std::pair<std::string, coro_handler> > http_conn::m_coro_routes;
+//与METHOD的顺序一致
+static const char* method_names[] = {"GET", "POST", "HEAD", "PUT", "DELETE",
+                                     "TRACE", "OPTIONS", "CONNECT", "PATCH"};
+
+//估计的响应超过这个大小时作为耗时请求调度，与文件缓存可以缓存的最大文件一致
+static const uint64_t BULK_RESPONSE_SIZE = 64 * 1024;
+
+//url到响应大小的提示，工作线程找到文件或内容包条目后写入，reactor分类时不加锁读取
+//每项为url哈希的高位加上最低位的耗时标记，0表示空；哈希冲突只会让分类偶尔出错
+static const size_t SIZE_HINTS = 4096;
+static std::atomic<uint32_t> size_hints[SIZE_HINTS];
+
+//FNV-1a，与文件缓存相同；第1位总是置位，项不会为0
+static uint32_t url_hash(const char* url)
+{
+    uint32_t h = 2166136261u;
+    for(; *url; url++){
+        h ^= (unsigned char)*url;
+        h *= 16777619u;
+    }
+    return (h | 2) & ~1u;
+}
+
+static void remember_size(const char* url, uint64_t size)
+{
+    uint32_t h = url_hash(url);
+    uint32_t hint = h | (size > BULK_RESPONSE_SIZE ? 1 : 0);
+    std::atomic<uint32_t>& slot = size_hints[h % SIZE_HINTS];
+    //热门url的提示几乎不变，只在变化时写入，避免各个线程反复争用同一缓存行
+    if(slot.load(std::memory_order_relaxed) != hint){
+        slot.store(hint, std::memory_order_relaxed);
+    }
+}
 
 void http_conn::close_conn(bool real_close)
 {
     printf("closing client...\n");
     if(real_close && (m_sockfd != -1)){
-        removefd(m_epollfd, m_sockfd);
+        TRACE2(close, m_request_id, m_sockfd);
+        //释放仍在发送中的响应引用的缓存条目或内容包
+        unmap();
+        m_tx.release_all();
+#ifdef ENABLE_TLS
+        if(m_ssl){
+            SSL_shutdown(m_ssl);
+            SSL_free(m_ssl);
+            m_ssl = NULL;
+        }
+#endif
+        //会话析构时释放各个流仍持有的文件映射
+        delete m_h2;
+        m_h2 = 0;
+        //WebSocket连接只在reactor线程中关闭，退订后广播线程不再引用它
+        if(m_ws){
+            ws_hub::unsubscribe(m_ws);
+            delete m_ws;
+            m_ws = 0;
+        }
+        //挂起中的handler的帧随之销毁，其中的局部对象被析构
+        if(m_io){
+            conn_io::destroy(m_io);
+            m_io = 0;
+            m_coro_active = false;
+        }
+        if(m_relay){
+            proxy::discard(m_relay);
+            m_relay = 0;
+        }
+        memory_budget::charge(MEM_CONNECTION, -m_mem);
+        m_mem = 0;
+        //关闭fd之后reactor可能立即accept到复用同一个fd的新连接并在这个对象上调用init，
+        //所以先完成所有成员的重置，关闭fd是最后一步，之后不能再访问任何成员
+        int fd = m_sockfd;
         m_sockfd = -1;
         m_user_count--;
+        removefd(m_epollfd, fd);
     }
 }
 
@@ -69,24 +154,59 @@ void http_conn::init(int sockfd, const sockaddr_in &adr)
 
     addfd(m_epollfd, sockfd, true);
     m_user_count++;
+    m_file_adr = 0;
+    m_cache_entry = 0;
+    m_cached = 0;
+    m_bundle = 0;
+    m_zerocopy = false;
+    m_tx.reset(transmitter::enabled() && transmitter::setup_socket(sockfd));
+    m_h2 = 0;
+    m_ws = 0;
+    m_io = 0;
+    m_coro_active = false;
+    m_relay = 0;
+    m_mem = 0;
+#ifdef ENABLE_TLS
+    m_ssl = tls::enabled() ? tls::accept(sockfd) : NULL;
+    m_tls_handshaking = m_ssl != NULL;
+    m_ktls_send = false;
+#endif
 
     init();
+    TRACE2(accept, m_request_id, sockfd);
 }
 
 void http_conn::init()
 {
+    m_request_id = m_next_request_id.fetch_add(1, std::memory_order_relaxed);
     m_check_state = CHECK_STATE_REQUEST_LINE;
     m_linger = false;
+    m_parsed = false;
+    m_accept_gzip = false;
+    m_if_none_match = 0;
+    m_upgrade_h2c = false;
+    m_h2_settings = 0;
+    m_upgrade_websocket = false;
+    m_ws_key = 0;
+    m_ws_version = 0;
 
     m_method = GET;
     m_url = 0;
     m_version = 0;
     m_content_length = 0;
+    m_body = 0;
+    m_body_chunked = false;
+    m_body_streamed = false;
+    m_header_start = 0;
+    m_header_end = 0;
+    m_proxy_route = 0;
     m_host = 0;
     m_start_line = 0;
     m_check_index = 0;
     m_read_index = 0;
     m_write_index = 0;
+    m_bytes_to_send = 0;
+    m_bytes_have_send = 0;
     memset(m_read_buf, '\0', READ_BUFFER_SIZE);
     memset(m_write_buf, '\0', WRITE_BUFFER_SIZE);
     memset(m_real_file, '\0', FILENAME_LEN);
@@ -129,12 +249,34 @@ http_conn::LINE_STATUS http_conn::parse_line()
 //循环读取客户端数据，直到无数据可读或对方关闭连接
 bool http_conn::read()
 {
-    if(m_read_index > READ_BUFFER_SIZE){
+    //HTTP/2连接的读缓冲只用于中转，读到的数据全部交给会话，由工作线程解析
+    if(m_h2){
+        while(true){
+            int bytes_read = recv(m_sockfd, m_read_buf, READ_BUFFER_SIZE, 0);
+            if(bytes_read == -1){
+                if(errno == EAGAIN || errno == EWOULDBLOCK)
+                    break;
+                return false;
+            }
+            if(bytes_read == 0 || !m_h2->receive(m_read_buf, bytes_read)){
+                return false;
+            }
+        }
+        return true;
+    }
+    //读缓冲已满仍然没有得到完整的请求头
+    if(m_read_index >= READ_BUFFER_SIZE){
         return false;
     }
+#ifdef ENABLE_TLS
+    if(m_ssl){
+        return tls_read();
+    }
+#endif
 
+    //读满之后剩余的数据留在内核中，例如由代理转发的大请求体
     int bytes_read = 0;
-    while(true){
+    while(m_read_index < READ_BUFFER_SIZE){
         bytes_read = recv(m_sockfd, m_read_buf + m_read_index, READ_BUFFER_SIZE - m_read_index, 0);
         if(bytes_read == -1){
             //无数据可读
@@ -153,6 +295,63 @@ bool http_conn::read()
     return true;
 }
 
+#ifdef ENABLE_TLS
+//推进握手并读取解密后的数据；握手未完成时返回true但不读入数据，请求解析得到NO_REQUEST后重新注册EPOLLIN
+bool http_conn::tls_read()
+{
+    if(m_tls_handshaking){
+        int ret = SSL_do_handshake(m_ssl);
+        if(ret != 1){
+            int err = SSL_get_error(m_ssl, ret);
+            //服务端的握手消息很小，总能一次写入socket缓冲，因此WANT_WRITE同样等待客户端的下一条消息
+            return err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE;
+        }
+        m_tls_handshaking = false;
+        m_ktls_send = tls::ktls_send(m_ssl);
+        printf("tls handshake done, ktls send:%d\n", m_ktls_send);
+    }
+    while(m_read_index < READ_BUFFER_SIZE){
+        int bytes_read = SSL_read(m_ssl, m_read_buf + m_read_index, READ_BUFFER_SIZE - m_read_index);
+        if(bytes_read <= 0){
+            //无数据可读
+            if(SSL_get_error(m_ssl, bytes_read) == SSL_ERROR_WANT_READ)
+                break;
+            return false;
+        }
+        m_read_index += bytes_read;
+    }
+    return true;
+}
+
+//代理在用户态TLS连接上写响应时使用，语义与send相同；已经设置SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER，重试时缓冲可以移动
+ssize_t http_conn::tls_send(void* ctx, const char* buf, size_t len)
+{
+    http_conn* conn = (http_conn*)ctx;
+    int n = SSL_write(conn->m_ssl, buf, len);
+    if(n <= 0){
+        if(SSL_get_error(conn->m_ssl, n) == SSL_ERROR_WANT_WRITE){
+            errno = EAGAIN;
+        }
+        return -1;
+    }
+    return n;
+}
+
+ssize_t http_conn::tls_recv(void* ctx, char* buf, size_t len)
+{
+    http_conn* conn = (http_conn*)ctx;
+    int n = SSL_read(conn->m_ssl, buf, len);
+    if(n <= 0){
+        if(SSL_get_error(conn->m_ssl, n) == SSL_ERROR_WANT_READ){
+            errno = EAGAIN;
+            return -1;
+        }
+        return n == 0 ? 0 : -1;
+    }
+    return n;
+}
+#endif
+
 //解析http请求行，获取请求方法、目标url，http版本号
 http_conn::HTTP_CODE http_conn::parse_request_line(char* text)
 {
@@ -166,9 +365,25 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char* text)
     *m_url++ = '\0';
     char* method = text;
     //strcasecmp忽略大小写比较
+    //除GET之外的方法只能用于代理路由，由do_request检查
     if(strcasecmp(method, "GET") == 0){
         m_method = GET;
     }
+    else if(strcasecmp(method, "HEAD") == 0){
+        m_method = HEAD;
+    }
+    else if(strcasecmp(method, "POST") == 0){
+        m_method = POST;
+    }
+    else if(strcasecmp(method, "PUT") == 0){
+        m_method = PUT;
+    }
+    else if(strcasecmp(method, "DELETE") == 0){
+        m_method = DELETE;
+    }
+    else if(strcasecmp(method, "PATCH") == 0){
+        m_method = PATCH;
+    }
     else{
         return BAD_REQUEST;
     }
@@ -193,6 +408,7 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char* text)
     }
     //状态转移到头部分析
     m_check_state = CHECK_STATE_HEADER;
+    m_header_start = m_check_index;
     return NO_REQUEST;
 }
 
@@ -201,6 +417,16 @@ http_conn::HTTP_CODE http_conn::parse_headers(char* text)
 {
     //遇到空行，表示头部解析完毕
     if(text[0] == '\0'){
+        m_header_end = m_check_index;
+        if(m_content_length < 0){
+            return BAD_REQUEST;
+        }
+        //chunked编码或放不进读缓冲的请求体不等待读完，代理路由边读边转发给上游，其他请求返回413
+        if(m_body_chunked || m_check_index + m_content_length >= READ_BUFFER_SIZE){
+            m_body_streamed = true;
+            m_body = m_read_buf + m_check_index;
+            return GET_REQUEST;
+        }
         //若请求有消息体，还应该读取m_content_length字节的消息体，状态转移
         if(m_content_length != 0){
             m_check_state = CHECK_STATE_CONTENT;
@@ -213,8 +439,9 @@ http_conn::HTTP_CODE http_conn::parse_headers(char* text)
     else if(strncasecmp(text, "Connection:", 11) == 0){
         text += 11;
         text += strspn(text, " \t");
+        //排空期间不再保持连接，响应之后关闭，客户端在新进程上重新建立连接
         if(strcasecmp(text, "keep-alive") == 0){
-            m_linger= true;
+            m_linger = !m_draining;
         }
     }
     //处理content-length头部字段
@@ -223,6 +450,46 @@ http_conn::HTTP_CODE http_conn::parse_headers(char* text)
         text += strspn(text, " \t");
         m_content_length = atoi(text);
     }
+    //处理transfer-encoding头部字段，同时出现时chunked优先于content-length
+    else if(strncasecmp(text, "Transfer-Encoding:", 18) == 0){
+        text += 18;
+        m_body_chunked = strcasestr(text, "chunked") != NULL;
+    }
+    //处理accept-encoding头部字段，只关心是否接受gzip
+    else if(strncasecmp(text, "Accept-Encoding:", 16) == 0){
+        text += 16;
+        m_accept_gzip = strstr(text, "gzip") != NULL;
+    }
+    //处理if-none-match头部字段
+    else if(strncasecmp(text, "If-None-Match:", 14) == 0){
+        text += 14;
+        text += strspn(text, " \t");
+        m_if_none_match = text;
+    }
+    //处理upgrade头部字段，支持升级到h2c与websocket
+    else if(strncasecmp(text, "Upgrade:", 8) == 0){
+        text += 8;
+        text += strspn(text, " \t");
+        m_upgrade_h2c = strcasecmp(text, "h2c") == 0;
+        m_upgrade_websocket = strcasecmp(text, "websocket") == 0;
+    }
+    //处理sec-websocket-key与sec-websocket-version头部字段
+    else if(strncasecmp(text, "Sec-WebSocket-Key:", 18) == 0){
+        text += 18;
+        text += strspn(text, " \t");
+        m_ws_key = text;
+    }
+    else if(strncasecmp(text, "Sec-WebSocket-Version:", 22) == 0){
+        text += 22;
+        text += strspn(text, " \t");
+        m_ws_version = text;
+    }
+    //处理http2-settings头部字段
+    else if(strncasecmp(text, "HTTP2-Settings:", 15) == 0){
+        text += 15;
+        text += strspn(text, " \t");
+        m_h2_settings = text;
+    }
     //处理host头部字段
     else if(strncasecmp(text, "Host:", 5) == 0){
         text += 5;
@@ -240,6 +507,7 @@ http_conn::HTTP_CODE http_conn::parse_content(char*text)
 {
     if(m_read_index >= (m_content_length + m_check_index)){
         text[m_content_length] = '\0';
+        m_body = text;
         return GET_REQUEST;
     }
     return NO_REQUEST;
@@ -275,13 +543,13 @@ http_conn::HTTP_CODE http_conn::process_read()
                 return BAD_REQUEST;
             }
             else if(ret == GET_REQUEST){
-                return do_request();
+                return GET_REQUEST;
             }
             break;
         case CHECK_STATE_CONTENT:
             ret = parse_content(text);
             if(ret == GET_REQUEST){
-                return do_request();
+                return GET_REQUEST;
             }
             line_stat = LINE_OPEN;
             break;
@@ -295,9 +563,35 @@ http_conn::HTTP_CODE http_conn::process_read()
 //当得到一个完整的正确的http请求时，分析目标文件的属性，若文件存在，对用户可读，且不是目录，则使用mmap将其映射到内存地址m_file_address处，并通知调用者获取文件成功
 http_conn::HTTP_CODE http_conn::do_request()
 {
+    //代理路由优先
+    m_proxy_route = proxy::match(m_url);
+    if(m_proxy_route){
+        return PROXY_REQUEST;
+    }
+    //其他请求都需要完整的请求体
+    if(m_body_streamed){
+        return BODY_TOO_LARGE;
+    }
+    //协程handler直接读写socket，TLS连接按普通请求处理，HTTP/2的流由h2_respond应答505
+    m_coro_handler = tls_active() ? NULL : match_coro(m_url);
+    if(m_coro_handler){
+        return CORO_REQUEST;
+    }
+    if(m_method == POST && ws_hub::match(m_url)){
+        return do_publish();
+    }
+    //文件只支持GET
+    if(m_method != GET){
+        return BAD_REQUEST;
+    }
+    //启用内容包时只从包中应答
+    content_bundle* bundle = content_bundle::current();
+    if(bundle){
+        return do_bundle_request(bundle);
+    }
     strcpy(m_real_file, doc_root);
     int len = strlen(doc_root);
-    strncpy(m_real_file+len, m_url, FILENAME_MAX - len - 1);
+    strncpy(m_real_file+len, m_url, FILENAME_LEN - len - 1);
     //获取文件属性
     if(stat(m_real_file, &m_file_stat) < 0){
         return NO_RESOURCE;
@@ -309,6 +603,14 @@ http_conn::HTTP_CODE http_conn::do_request()
     if(S_ISDIR(m_file_stat.st_mode)){
         return BAD_REQUEST;
     }
+    remember_size(m_url, m_file_stat.st_size);
+
+    //小文件放入缓存，之后的请求可以在reactor线程中直接应答
+    m_cache_entry = m_file_cache.acquire(m_real_file, m_file_stat);
+    if(m_cache_entry){
+        m_file_adr = m_cache_entry->addr;
+        return FILE_REQUEST;
+    }
 
     //打开文件
     int fd = open(m_real_file, O_RDONLY);
@@ -317,47 +619,197 @@ http_conn::HTTP_CODE http_conn::do_request()
     return FILE_REQUEST;
 }
 
+//只查询文件缓存，不做任何文件系统调用；未命中时返回NO_REQUEST，由工作线程调用do_request
+http_conn::HTTP_CODE http_conn::do_cached_request()
+{
+    if(m_method != GET || m_body_streamed || match_coro(m_url)){
+        return NO_REQUEST;
+    }
+    //转发给上游会阻塞，交给工作线程；只有微缓存中新鲜的响应可以直接应答
+    if(proxy::match(m_url)){
+        std::string key;
+        if(!m_micro_cache.enabled() || !cache_key(key)){
+            return NO_REQUEST;
+        }
+        m_cached = m_micro_cache.peek(key);
+        return m_cached ? CACHED_REQUEST : NO_REQUEST;
+    }
+    //内容包的查找本身就是内存中的二分查找，全部在reactor线程中完成
+    content_bundle* bundle = content_bundle::current();
+    if(bundle){
+        return do_bundle_request(bundle);
+    }
+    strcpy(m_real_file, doc_root);
+    int len = strlen(doc_root);
+    strncpy(m_real_file+len, m_url, FILENAME_LEN - len - 1);
+    m_cache_entry = m_file_cache.lookup(m_real_file);
+    if(!m_cache_entry){
+        return NO_REQUEST;
+    }
+    m_file_adr = m_cache_entry->addr;
+    m_file_stat.st_size = m_cache_entry->size;
+    return FILE_REQUEST;
+}
+
+//在内容包中查找目标文件，调用者已经为bundle增加了引用，由本函数或unmap释放
+http_conn::HTTP_CODE http_conn::do_bundle_request(content_bundle* bundle)
+{
+    const bundle_entry* e = bundle->find(m_url);
+    if(!e){
+        bundle->release();
+        return NO_RESOURCE;
+    }
+    remember_size(m_url, e->body_len);
+    m_bundle = bundle;
+    m_bundle_entry = e;
+    m_bundle_gzip = m_accept_gzip && e->gz_body_len != 0;
+    //If-None-Match可能是以逗号分隔的多个ETag
+    if(m_if_none_match){
+        uint64_t off = m_bundle_gzip ? e->gz_etag_offset : e->etag_offset;
+        uint64_t len = m_bundle_gzip ? e->gz_etag_len : e->etag_len;
+        if(strcmp(m_if_none_match, "*") == 0 ||
+           memmem(m_if_none_match, strlen(m_if_none_match), bundle->at(off), len)){
+            return NOT_MODIFIED;
+        }
+    }
+    return BUNDLE_REQUEST;
+}
+
+//释放响应引用的映射，HTTP/2的流与零拷贝发送完成时也使用这组函数
+static void release_cache_entry(void* handle, const char*, size_t)
+{
+    http_conn::m_file_cache.release((file_cache::entry*)handle);
+}
+
+static void release_bundle(void* handle, const char*, size_t)
+{
+    ((content_bundle*)handle)->release();
+}
+
+static void release_mapping(void*, const char* data, size_t len)
+{
+    munmap((void*)data, len);
+}
+
 //对内存映射区执行munmap操作
+//响应体用零拷贝发送且内核尚未发送完成时，映射交给m_tx，收到完成通知后才释放
 void http_conn::unmap()
 {
-    if(m_file_adr){
-        munmap(m_file_adr, m_file_stat.st_size);
+    bool defer = m_zerocopy && m_tx.outstanding();
+    m_zerocopy = false;
+    if(m_cached){
+        m_cached->release();
+        m_cached = 0;
+    }
+    if(m_bundle){
+        if(defer){
+            m_tx.hold(release_bundle, m_bundle, NULL, 0);
+        }
+        else{
+            m_bundle->release();
+        }
+        m_bundle = 0;
+    }
+    if(m_cache_entry){
+        if(defer){
+            m_tx.hold(release_cache_entry, m_cache_entry, NULL, 0);
+        }
+        else{
+            m_file_cache.release(m_cache_entry);
+        }
+        m_cache_entry = 0;
         m_file_adr = 0;
     }
+    else if(m_file_adr){
+        if(defer){
+            m_tx.hold(release_mapping, NULL, m_file_adr, m_file_stat.st_size);
+        }
+        else{
+            munmap(m_file_adr, m_file_stat.st_size);
+        }
+        m_file_adr = 0;
+    }
+}
+
+void http_conn::account_memory()
+{
+    long long bytes = 0;
+    if(m_h2){
+        bytes += m_h2->memory();
+    }
+    if(m_ws){
+        bytes += m_ws->memory();
+    }
+    if(m_io){
+        bytes += sizeof(conn_io);
+    }
+    if(bytes != m_mem){
+        memory_budget::charge(MEM_CONNECTION, bytes - m_mem);
+        m_mem = bytes;
+    }
+}
+
+void http_conn::arm_read()
+{
+    account_memory();
+    //暂停的连接不在epoll中等待任何事件，对端的数据留在接收缓冲中，由reactor在用量回落后重新注册
+    if(memory_budget::should_pause(m_mem, m_user_count)){
+        memory_budget::pause(m_sockfd);
+        return;
+    }
+    modfd(m_epollfd, m_sockfd, EPOLLIN);
 }
 
 //写http响应
+//连接注册了EPOLLONESHOT，调用write的线程(工作线程或reactor)在重新注册事件之前独占该连接的写状态，
+//因此所有分支都在最后一步才调用modfd，之后不再访问任何成员
 bool http_conn::write()
 {
     printf("write!!!\n");
+    if(m_h2){
+        return h2_write();
+    }
     int tmp = 0;
-    int bytes_have_send = 0;
-    int bytes_to_send = m_write_index;
-    if(bytes_to_send == 0){
-        modfd(m_epollfd, m_sockfd, EPOLLIN);
+    if(m_bytes_to_send == 0){
         init();
+        arm_read();
         return true;
     }
     printf("ivcount:%d\n", m_iv_count);
+    //顺便回收之前的零拷贝发送已经完成的映射
+    if(m_tx.pending() && !m_tx.reap(m_sockfd)){
+        unmap();
+        return false;
+    }
+    //头部与响应体分两次发送，TCP_CORK保证它们被合并成满长度的报文段
+    if(m_zerocopy){
+        m_tx.cork(m_sockfd, true);
+    }
     while(1){
-        tmp = writev(m_sockfd, m_iv, m_iv_count);
+        tmp = send_iov();
         if(tmp <= -1){
             //若tcp写缓冲没有空间，等待下一轮epollout事件，在此期间，
             //服务器无法立即接受到同一个客户端的下一个请求，但保证了连接的完整
             if(errno == EAGAIN){
                 modfd(m_epollfd, m_sockfd, EPOLLOUT);
+                return true;
             }
             unmap();
             return false;
         }
-        bytes_to_send -= tmp;
-        bytes_have_send += tmp;
-        if(bytes_to_send <= bytes_have_send){
+        if(m_bytes_have_send == 0 && tmp > 0){
+            TRACE2(first_byte, m_request_id, m_sockfd);
+        }
+        m_bytes_to_send -= tmp;
+        m_bytes_have_send += tmp;
+        if(m_bytes_to_send <= 0){
+            TRACE3(last_byte, m_request_id, m_sockfd, m_bytes_have_send);
             //发送响应成功，根据connection字段决定是否关闭连接
+            m_tx.cork(m_sockfd, false);
             unmap();
             if(m_linger){
                 init();
-                modfd(m_epollfd, m_sockfd, EPOLLIN);
+                arm_read();
                 return true;
             }
             else{
@@ -365,13 +817,66 @@ bool http_conn::write()
                 //init();//
                 //modfd(m_epollfd, m_sockfd, EPOLLIN);
                 //return true;//
-		modfd(m_epollfd, m_sockfd, EPOLLIN);
-		return false;
+                return false;
+            }
+        }
+        //部分写入，调整iovec跳过已经发送的数据
+        for(int i = 0; i < m_iv_count && tmp > 0; i++){
+            if((size_t)tmp >= m_iv[i].iov_len){
+                tmp -= m_iv[i].iov_len;
+                m_iv[i].iov_len = 0;
+            }
+            else{
+                m_iv[i].iov_base = (char*)m_iv[i].iov_base + tmp;
+                m_iv[i].iov_len -= tmp;
+                tmp = 0;
             }
         }
     }
 }
 
+ssize_t http_conn::send_iov()
+{
+#ifdef ENABLE_TLS
+    if(m_ssl && !m_ktls_send){
+        //SSL_write要么写完整个缓冲区，要么返回WANT_WRITE且之后必须用相同的数据重试，因此每次只写一个iovec
+        for(int i = 0; i < m_iv_count; i++){
+            if(m_iv[i].iov_len == 0){
+                continue;
+            }
+            int n = SSL_write(m_ssl, m_iv[i].iov_base, m_iv[i].iov_len);
+            if(n <= 0){
+                errno = SSL_get_error(m_ssl, n) == SSL_ERROR_WANT_WRITE ? EAGAIN : EIO;
+                return -1;
+            }
+            return n;
+        }
+        return 0;
+    }
+#endif
+    if(m_zerocopy){
+        return m_tx.send(m_sockfd, m_iv, m_iv_count);
+    }
+    //未启用TLS或内核TLS已经接管加密，直接写socket
+    return writev(m_sockfd, m_iv, m_iv_count);
+}
+
+//内核TLS需要在加密前读取数据，不支持零拷贝；堆上的数据(微缓存)在完成前可能被释放重用，也不使用零拷贝
+bool http_conn::use_zerocopy(size_t len) const
+{
+    return transmitter::enabled() && m_tx.usable() && !tls_active() && len >= transmitter::threshold();
+}
+
+bool http_conn::reap_zerocopy()
+{
+    if(!m_tx.reap(m_sockfd)){
+        return false;
+    }
+    //只有在等待事件的连接才会收到EPOLLERR，按原来的等待方向重新注册
+    modfd(m_epollfd, m_sockfd, m_bytes_to_send > 0 ? EPOLLOUT : EPOLLIN);
+    return true;
+}
+
 //往写缓冲中写入待发送的数据
 bool http_conn::add_response(const char*format, ...)
 {
@@ -413,6 +918,11 @@ bool http_conn::add_linger()
     return add_response("Connection: %s\r\n", (m_linger?"keep-alive":"close"));
 }
 
+bool http_conn::add_retry_after(int seconds)
+{
+    return add_response("Retry-After: %d\r\n", seconds);
+}
+
 bool http_conn::add_blank_line()
 {
     return add_response("%s", "\r\n");
@@ -456,6 +966,85 @@ bool http_conn::process_write(http_conn::HTTP_CODE ret)
             return false;
         }
         break;
+    case SERVICE_UNAVAILABLE:
+        m_linger = false;
+        add_status_line(503, error_503_title);
+        add_retry_after(1);
+        add_headers(strlen(error_503_form));
+        if(!add_content(error_503_form)){
+            return false;
+        }
+        break;
+    case BAD_GATEWAY:
+        add_status_line(502, error_502_title);
+        add_headers(strlen(error_502_form));
+        if(!add_content(error_502_form)){
+            return false;
+        }
+        break;
+    case PUBLISH_REQUEST:
+        add_status_line(204, "No Content");
+        add_linger();
+        add_blank_line();
+        break;
+    case BODY_TOO_LARGE:
+        //请求体还留在socket中，应答之后关闭连接
+        m_linger = false;
+        add_status_line(413, error_413_title);
+        add_headers(strlen(error_413_form));
+        if(!add_content(error_413_form)){
+            return false;
+        }
+        break;
+    case TOO_MANY_REQUESTS:
+        m_linger = false;
+        add_status_line(429, error_429_title);
+        add_retry_after(1);
+        add_headers(strlen(error_429_form));
+        if(!add_content(error_429_form)){
+            return false;
+        }
+        break;
+    case NOT_MODIFIED:
+    {
+        const bundle_entry* e = m_bundle_entry;
+        uint64_t off = m_bundle_gzip ? e->gz_etag_offset : e->etag_offset;
+        int len = m_bundle_gzip ? e->gz_etag_len : e->etag_len;
+        add_status_line(304, "Not Modified");
+        add_response("ETag: %.*s\r\n", len, m_bundle->at(off));
+        add_linger();
+        add_blank_line();
+        break;
+    }
+    case BUNDLE_REQUEST:
+    {
+        //状态行与响应头在打包时已经生成，这里只补充Connection头部
+        const bundle_entry* e = m_bundle_entry;
+        add_linger();
+        add_blank_line();
+        m_iv[0].iov_base = (void*)m_bundle->at(m_bundle_gzip ? e->gz_header_offset : e->header_offset);
+        m_iv[0].iov_len = m_bundle_gzip ? e->gz_header_len : e->header_len;
+        m_iv[1].iov_base = m_write_buf;
+        m_iv[1].iov_len = m_write_index;
+        m_iv[2].iov_base = (void*)m_bundle->at(m_bundle_gzip ? e->gz_body_offset : e->body_offset);
+        m_iv[2].iov_len = m_bundle_gzip ? e->gz_body_len : e->body_len;
+        m_iv_count = 3;
+        m_zerocopy = use_zerocopy(m_iv[2].iov_len);
+        m_bytes_to_send = m_iv[0].iov_len + m_iv[1].iov_len + m_iv[2].iov_len;
+        return true;
+    }
+    case CACHED_REQUEST:
+        add_linger();
+        add_blank_line();
+        m_iv[0].iov_base = (void*)m_cached->head();
+        m_iv[0].iov_len = m_cached->head_len;
+        m_iv[1].iov_base = m_write_buf;
+        m_iv[1].iov_len = m_write_index;
+        m_iv[2].iov_base = (void*)m_cached->body();
+        m_iv[2].iov_len = m_cached->body_len;
+        m_iv_count = 3;
+        m_bytes_to_send = m_iv[0].iov_len + m_iv[1].iov_len + m_iv[2].iov_len;
+        return true;
     case FILE_REQUEST:
         add_status_line(200, ok_200_title);
         if(m_file_stat.st_size != 0){
@@ -465,6 +1054,8 @@ bool http_conn::process_write(http_conn::HTTP_CODE ret)
             m_iv[1].iov_base = m_file_adr;
             m_iv[1].iov_len = m_file_stat.st_size;
             m_iv_count = 2;
+            m_zerocopy = use_zerocopy(m_iv[1].iov_len);
+            m_bytes_to_send = m_write_index + m_file_stat.st_size;
             return true;
         }
         else{
@@ -481,23 +1072,725 @@ bool http_conn::process_write(http_conn::HTTP_CODE ret)
     m_iv[0].iov_base = m_write_buf;
     m_iv[0].iov_len = m_write_index;
     m_iv_count = 1;
+    m_bytes_to_send = m_write_index;
     return true;
 }
 
 //由线程池中的工作线程调用，处理http请求的入口函数
 void http_conn::process()
 {
-    HTTP_CODE read_ret = process_read();
+    TRACE2(dequeue, m_request_id, m_sockfd);
+    if(m_relay){
+        proxy_resume();
+        return;
+    }
+    if(m_h2){
+        process_h2();
+        return;
+    }
+    //以prior knowledge方式直接开始的HTTP/2连接
+    int preface = m_parsed ? 0 : check_h2_preface();
+    if(preface < 0){
+        arm_read();
+        return;
+    }
+    if(preface > 0){
+        h2_start();
+        process_h2();
+        return;
+    }
+    bool parsed = m_parsed;
+    HTTP_CODE read_ret = parsed ? GET_REQUEST : process_read();
+    m_parsed = false;
     printf("ret:%d\n", read_ret);
     if(read_ret == NO_REQUEST){
-        modfd(m_epollfd, m_sockfd, EPOLLIN);
+        arm_read();
+        return;
+    }
+    //reactor已经解析过的请求在process_inline中记录
+    if(!parsed){
+        TRACE3(parse_done, m_request_id, m_sockfd, (int)m_method);
+    }
+    //不带请求体的GET/HEAD可以升级到h2c，其他请求忽略Upgrade头部按HTTP/1.1应答
+    if(read_ret == GET_REQUEST && m_upgrade_h2c && m_h2_settings && m_content_length == 0 && !m_body_chunked &&
+       (m_method == GET || m_method == HEAD)){
+        if(!h2_upgrade()){
+            close_conn(true);
+            return;
+        }
+        process_h2();
+        return;
+    }
+    //WebSocket握手，成功后连接已经交给reactor，不能再访问
+    if(read_ret == GET_REQUEST && m_upgrade_websocket && m_method == GET && ws_hub::match(m_url) && !tls_active()){
+        if(ws_upgrade()){
+            return;
+        }
+        read_ret = BAD_REQUEST;
+    }
+    if(read_ret == GET_REQUEST){
+        read_ret = do_request();
+        TRACE3(file_resolved, m_request_id, m_sockfd, (int)read_ret);
+    }
+    if(read_ret == PROXY_REQUEST){
+        if(!do_proxy()){
+            close_conn(true);
+        }
+        return;
+    }
+    if(read_ret == CORO_REQUEST){
+        coro_start();
         return;
     }
     bool write_ret = process_write(read_ret);
     if(!write_ret){
         close_conn(true);
+        return;
+    }
+    //socket写缓冲几乎总是可写的，直接在工作线程中发送，只有内核返回EAGAIN时才注册EPOLLOUT
+    if(!write()){
+        close_conn(true);
     }
-    modfd(m_epollfd, m_sockfd, EPOLLOUT);
 }
 
+//由reactor线程调用，命中缓存的文件请求和请求错误直接在当前线程中应答并发送，省去两次线程切换
+bool http_conn::process_inline()
+{
+    //HTTP/2的帧处理全部在工作线程中进行
+    if(m_h2 || check_h2_preface() != 0){
+        return false;
+    }
+    HTTP_CODE read_ret = process_read();
+    if(read_ret == NO_REQUEST){
+        arm_read();
+        return true;
+    }
+    TRACE3(parse_done, m_request_id, m_sockfd, (int)m_method);
+    if(read_ret == GET_REQUEST && (m_upgrade_h2c || m_upgrade_websocket)){
+        m_parsed = true;
+        return false;
+    }
+    if(read_ret == GET_REQUEST){
+        read_ret = do_cached_request();
+        if(read_ret == NO_REQUEST){
+            //需要访问文件系统，交给工作线程
+            m_parsed = true;
+            return false;
+        }
+        TRACE3(file_resolved, m_request_id, m_sockfd, (int)read_ret);
+    }
+    if(!process_write(read_ret) || !write()){
+        close_conn();
+    }
+    return true;
+}
 
+//由线程池或reactor在过载或限速时调用，不再解析请求，直接返回503或429
+void http_conn::shed(HTTP_CODE code)
+{
+    //HTTP/2连接发送GOAWAY，已经开始的流继续发送完，尚未处理的流由客户端在新连接上重试
+    if(m_h2){
+        m_h2->shutdown();
+        if(!h2_write()){
+            close_conn();
+        }
+        return;
+    }
+    //响应已经发送了一部分，不能再插入错误响应
+    if(m_relay){
+        close_conn();
+        return;
+    }
+    unmap();
+    m_write_index = 0;
+    if(!process_write(code) || !write()){
+        close_conn();
+    }
+}
+
+bool http_conn::add_class_rule(const char* spec)
+{
+    static const char* names[CLASS_COUNT] = {"latency", "bulk", "background"};
+    const char* eq = strchr(spec, '=');
+    if(!eq || spec[0] != '/'){
+        return false;
+    }
+    for(int i = 0; i < CLASS_COUNT; i++){
+        if(strcmp(eq + 1, names[i]) == 0){
+            m_class_rules.push_back(std::make_pair(std::string(spec, eq - spec), i));
+            return true;
+        }
+    }
+    return false;
+}
+
+int http_conn::classify()
+{
+    //HTTP/2的帧处理与握手都是交互式的
+    if(m_h2 || (!m_parsed && check_h2_preface() != 0)){
+        return CLASS_LATENCY;
+    }
+    char url[FILENAME_LEN];
+    const char* path = url;
+    if(m_parsed){
+        path = m_url;
+    }
+    else{
+        //请求还没有解析，从读缓冲中取出请求行中的url，取不到时按交互式处理，解析时再报错
+        const char* end = m_read_buf + m_read_index;
+        const char* p = (const char*)memchr(m_read_buf, ' ', m_read_index);
+        const char* q = p ? (const char*)memchr(p + 1, ' ', end - p - 1) : NULL;
+        if(!q || q - p - 1 >= FILENAME_LEN){
+            return CLASS_LATENCY;
+        }
+        memcpy(url, p + 1, q - p - 1);
+        url[q - p - 1] = '\0';
+        if(strncasecmp(path, "http://", 7) == 0){
+            path = strchr(path + 7, '/');
+        }
+        if(!path){
+            return CLASS_LATENCY;
+        }
+    }
+
+    size_t best = 0;
+    int cls = -1;
+    for(size_t i = 0; i < m_class_rules.size(); i++){
+        const std::string& prefix = m_class_rules[i].first;
+        if(prefix.size() > best && strncmp(path, prefix.c_str(), prefix.size()) == 0){
+            best = prefix.size();
+            cls = m_class_rules[i].second;
+        }
+    }
+    if(cls >= 0){
+        return cls;
+    }
+    //转发需要阻塞等待上游
+    if(proxy::match(path)){
+        return CLASS_BULK;
+    }
+    if(ws_hub::match(path)){
+        return CLASS_LATENCY;
+    }
+    //大小来自之前应答同一url时留下的提示，不查询内容包与文件缓存，reactor不与工作线程争用锁
+    //没有提示的url还没有被应答过，多半是冷文件，按耗时请求处理
+    uint32_t h = url_hash(path);
+    uint32_t hint = size_hints[h % SIZE_HINTS].load(std::memory_order_relaxed);
+    if((hint & ~1u) != h){
+        return CLASS_BULK;
+    }
+    return hint & 1 ? CLASS_BULK : CLASS_LATENCY;
+}
+
+//把请求转发给上游，响应由proxy直接写回客户端socket
+//与write一样，重新注册事件是最后一步；返回false表示连接应当关闭
+bool http_conn::do_proxy()
+{
+    proxy_request req;
+    req.method = method_names[m_method];
+    req.url = m_url;
+    req.headers = m_read_buf + m_header_start;
+    req.headers_end = m_read_buf + m_header_end;
+    req.body = m_body;
+    req.body_len = m_body ? m_content_length : 0;
+    req.body_left = 0;
+    req.body_chunked = m_body_chunked;
+    if(m_body_streamed){
+        //读缓冲中已经读到的部分先发送，其余部分由proxy从客户端读出后转发
+        req.body_len = m_read_index - m_check_index;
+        req.body_left = m_body_chunked ? 0 : m_content_length - req.body_len;
+    }
+    req.keep_alive = m_linger;
+    req.client_addr = m_address.sin_addr.s_addr;
+    req.reader = NULL;
+    req.writer = NULL;
+    req.io_ctx = NULL;
+#ifdef ENABLE_TLS
+    if(m_ssl){
+        req.reader = tls_recv;
+        req.io_ctx = this;
+        if(!m_ktls_send){
+            req.writer = tls_send;
+        }
+    }
+#endif
+
+    proxy::RESULT ret;
+    std::string key;
+    if(m_method == GET && !m_body_streamed && m_micro_cache.enabled() && cache_key(key)){
+        bool leader = false;
+        cached_response* resp = m_micro_cache.lookup(key, leader);
+        if(resp && !leader){
+            m_cached = resp;
+            return process_write(CACHED_REQUEST) && write();
+        }
+        if(resp){
+            //先用过期的条目应答，再由当前线程刷新；write之后连接可能已经属于其他线程，刷新只使用局部变量
+            std::string request = proxy::build_request(req);
+            proxy_route* route = m_proxy_route;
+            m_cached = resp;
+            bool ok = process_write(CACHED_REQUEST) && write();
+            cached_response* fresh = proxy::fetch(route, request, &m_micro_cache);
+            m_micro_cache.complete(key, fresh);
+            if(fresh){
+                fresh->release();
+            }
+            return ok;
+        }
+        if(leader){
+            //由当前请求生成，等待同一个键的其他请求在complete之后得到结果
+            cached_response* fresh = NULL;
+            ret = proxy::forward(m_proxy_route, m_sockfd, req, &m_relay, &m_micro_cache, &fresh);
+            //上游给出了响应却没有生成条目，说明响应不可缓存，之后的请求不再等待
+            m_micro_cache.complete(key, fresh, !fresh && ret != proxy::BAD_GATEWAY);
+            if(fresh){
+                fresh->release();
+            }
+        }
+        else{
+            //生成者失败、等待超时或响应不可缓存，各自转发
+            ret = proxy::forward(m_proxy_route, m_sockfd, req, &m_relay);
+        }
+    }
+    else{
+        ret = proxy::forward(m_proxy_route, m_sockfd, req, &m_relay);
+    }
+    if(ret == proxy::BAD_GATEWAY){
+        //请求体可能只转发了一部分，剩余的数据还在socket中
+        if(m_body_streamed){
+            m_linger = false;
+        }
+        return process_write(BAD_GATEWAY) && write();
+    }
+    if(ret == proxy::CLOSE){
+        return false;
+    }
+    //剩余的响应等客户端可写之后再转发，期间工作线程去处理其他请求
+    if(ret == proxy::PENDING){
+        modfd(m_epollfd, m_sockfd, EPOLLOUT);
+        return true;
+    }
+    init();
+    arm_read();
+    return true;
+}
+
+void http_conn::proxy_resume()
+{
+    proxy::RESULT ret = proxy::resume(m_relay, m_sockfd);
+    if(ret == proxy::PENDING){
+        modfd(m_epollfd, m_sockfd, EPOLLOUT);
+        return;
+    }
+    m_relay = 0;
+    if(ret != proxy::OK){
+        close_conn();
+        return;
+    }
+    init();
+    arm_read();
+}
+
+const char* http_conn::find_header(const char* name) const
+{
+    size_t n = strlen(name);
+    const char* p = m_read_buf + m_header_start;
+    const char* end = m_read_buf + m_header_end;
+    while(p < end){
+        size_t len = strlen(p);
+        if(len > n && p[n] == ':' && strncasecmp(p, name, n) == 0){
+            return p + n + 1 + strspn(p + n + 1, " \t");
+        }
+        p += len + 1;
+    }
+    return NULL;
+}
+
+bool http_conn::cache_key(std::string& key)
+{
+    //带凭证的请求得到的多半是个人化的响应
+    if(find_header("Authorization") || find_header("Cookie")){
+        return false;
+    }
+    key.assign("GET ").append(m_host ? m_host : "").append(m_url);
+    std::string vary = m_micro_cache.vary_of(key);
+    //Vary中的每个头部名及其值追加到键中，以换行分隔
+    size_t pos = 0;
+    while(pos < vary.size()){
+        size_t comma = vary.find(',', pos);
+        if(comma == std::string::npos){
+            comma = vary.size();
+        }
+        std::string name = vary.substr(pos, comma - pos);
+        pos = comma + 1;
+        const char* value = find_header(name.c_str());
+        key.append("\n").append(name).append(":").append(value ? value : "");
+    }
+    return true;
+}
+
+int http_conn::check_h2_preface()
+{
+    //TLS上的HTTP/2需要ALPN协商，只支持明文h2c
+    if(tls_active()){
+        return 0;
+    }
+    int n = m_read_index < (int)http2_session::PREFACE_LEN ? m_read_index : http2_session::PREFACE_LEN;
+    if(n == 0 || memcmp(m_read_buf, http2_session::PREFACE, n) != 0){
+        return 0;
+    }
+    return n < (int)http2_session::PREFACE_LEN ? -1 : 1;
+}
+
+bool http_conn::h2_start()
+{
+    m_h2 = new http2_session(h2_request, this);
+    m_h2->start();
+    m_h2->receive(m_read_buf, m_read_index);
+    m_read_index = 0;
+    return true;
+}
+
+bool http_conn::h2_upgrade()
+{
+    http2_request req;
+    req.method = m_method == HEAD ? "HEAD" : "GET";
+    req.path = m_url;
+    if(m_host){
+        req.authority = m_host;
+    }
+    if(m_accept_gzip){
+        req.headers.push_back(hpack_header("accept-encoding", "gzip"));
+    }
+    if(m_if_none_match){
+        req.headers.push_back(hpack_header("if-none-match", m_if_none_match));
+    }
+    m_h2 = new http2_session(h2_request, this);
+    if(!m_h2->upgrade(m_h2_settings, req)){
+        delete m_h2;
+        m_h2 = 0;
+        return false;
+    }
+    //请求之后已经读到的数据是客户端的连接前言
+    m_h2->receive(m_read_buf + m_check_index, m_read_index - m_check_index);
+    m_read_index = 0;
+    return true;
+}
+
+void http_conn::process_h2()
+{
+    //连接错误时GOAWAY已经在输出缓冲中，h2_write发送完后返回false
+    m_h2->process_input();
+    if(!h2_write()){
+        close_conn(true);
+    }
+}
+
+//与write一样，重新注册事件是最后一步
+bool http_conn::h2_write()
+{
+    while(true){
+        //先补充DATA帧，让响应头与第一段数据在同一次send中发出
+        m_h2->produce();
+        if(m_h2->pending() == 0){
+            break;
+        }
+        ssize_t n = send(m_sockfd, m_h2->pending_data(), m_h2->pending(), 0);
+        if(n < 0){
+            if(errno == EAGAIN){
+                //发送期间对端仍可能发来WINDOW_UPDATE或新的请求，同时等待可读
+                modfd(m_epollfd, m_sockfd, EPOLLIN | EPOLLOUT);
+                return true;
+            }
+            return false;
+        }
+        m_h2->consume(n);
+    }
+    if(m_h2->finished()){
+        return false;
+    }
+    arm_read();
+    return true;
+}
+
+void http_conn::h2_request(void* ctx, http2_session* session, uint32_t stream_id, const http2_request& req)
+{
+    ((http_conn*)ctx)->h2_respond(session, stream_id, req);
+}
+
+//流结束或被重置时释放响应体
+//把内容包中预先生成的HTTP/1.1响应头转换为HTTP/2头部：跳过状态行，名字转为小写
+static void bundle_headers(const char* p, size_t len, std::vector<hpack_header>& out)
+{
+    const char* end = p + len;
+    const char* eol = (const char*)memchr(p, '\n', len);
+    if(!eol){
+        return;
+    }
+    for(p = eol + 1; p < end; p = eol + 2){
+        eol = (const char*)memmem(p, end - p, "\r\n", 2);
+        if(!eol || eol == p){
+            break;
+        }
+        const char* colon = (const char*)memchr(p, ':', eol - p);
+        if(!colon){
+            continue;
+        }
+        std::string name(p, colon);
+        for(size_t i = 0; i < name.size(); i++){
+            name[i] = tolower(name[i]);
+        }
+        const char* value = colon + 1;
+        value += strspn(value, " \t");
+        out.push_back(hpack_header(name, std::string(value, eol)));
+    }
+}
+
+void http_conn::h2_respond(http2_session* session, uint32_t stream_id, const http2_request& req)
+{
+    //借用HTTP/1.1的请求字段调用do_request，结束后复位
+    bool head = req.method == "HEAD";
+    m_method = head || req.method == "GET" ? GET : POST;
+    m_url = const_cast<char*>(req.path.c_str());
+    m_accept_gzip = false;
+    m_if_none_match = 0;
+    m_body = 0;
+    for(size_t i = 0; i < req.headers.size(); i++){
+        const hpack_header& h = req.headers[i];
+        if(h.name == "accept-encoding"){
+            m_accept_gzip = h.value.find("gzip") != std::string::npos;
+        }
+        else if(h.name == "if-none-match"){
+            m_if_none_match = const_cast<char*>(h.value.c_str());
+        }
+    }
+    HTTP_CODE ret = do_request();
+
+    int status = 200;
+    const char* form = NULL;
+    std::vector<hpack_header> headers;
+    http2_body body = {NULL, 0, NULL, NULL};
+    char length[32];
+    switch(ret)
+    {
+    case FILE_REQUEST:
+        if(m_file_stat.st_size > 0 && m_file_adr == MAP_FAILED){
+            status = 500;
+            form = error_500_form;
+            break;
+        }
+        snprintf(length, sizeof(length), "%ld", (long)m_file_stat.st_size);
+        headers.push_back(hpack_header("content-length", length));
+        if(m_file_stat.st_size > 0 && !head){
+            //映射或缓存条目的所有权转交给流
+            body.data = m_file_adr;
+            body.len = m_file_stat.st_size;
+            if(m_cache_entry){
+                body.release = release_cache_entry;
+                body.handle = m_cache_entry;
+                m_cache_entry = 0;
+            }
+            else{
+                body.release = release_mapping;
+            }
+            m_file_adr = 0;
+        }
+        break;
+    case BUNDLE_REQUEST:
+    {
+        const bundle_entry* e = m_bundle_entry;
+        bundle_headers(m_bundle->at(m_bundle_gzip ? e->gz_header_offset : e->header_offset),
+                       m_bundle_gzip ? e->gz_header_len : e->header_len, headers);
+        size_t len = m_bundle_gzip ? e->gz_body_len : e->body_len;
+        if(len > 0 && !head){
+            body.data = m_bundle->at(m_bundle_gzip ? e->gz_body_offset : e->body_offset);
+            body.len = len;
+            body.release = release_bundle;
+            body.handle = m_bundle;
+            m_bundle = 0;
+        }
+        break;
+    }
+    case NOT_MODIFIED:
+    {
+        const bundle_entry* e = m_bundle_entry;
+        uint64_t off = m_bundle_gzip ? e->gz_etag_offset : e->etag_offset;
+        int len = m_bundle_gzip ? e->gz_etag_len : e->etag_len;
+        status = 304;
+        headers.push_back(hpack_header("etag", std::string(m_bundle->at(off), len)));
+        break;
+    }
+    case PROXY_REQUEST:
+        //转发只支持HTTP/1.1客户端
+        status = 502;
+        form = error_502_form;
+        break;
+    case CORO_REQUEST:
+        //协程handler(限速下载、状态页)独占socket，只能在HTTP/1.1连接上运行
+        m_coro_handler = NULL;
+        status = 505;
+        form = error_505_form;
+        break;
+    case NO_RESOURCE:
+        status = 404;
+        form = error_404_form;
+        break;
+    case FORBIDDEN_REQUEST:
+        status = 403;
+        form = error_403_form;
+        break;
+    case BAD_REQUEST:
+        status = 400;
+        form = error_400_form;
+        break;
+    default:
+        status = 500;
+        form = error_500_form;
+        break;
+    }
+    if(form){
+        snprintf(length, sizeof(length), "%zu", strlen(form));
+        headers.push_back(hpack_header("content-length", length));
+        if(!head){
+            body.data = form;
+            body.len = strlen(form);
+        }
+    }
+    //没有转交给流的资源(304的内容包、HEAD请求的映射等)在这里释放
+    unmap();
+    m_url = 0;
+    m_if_none_match = 0;
+    session->respond(stream_id, status, headers, body);
+}
+
+bool http_conn::tls_active() const
+{
+#ifdef ENABLE_TLS
+    return m_ssl != NULL;
+#else
+    return false;
+#endif
+}
+
+bool http_conn::ws_upgrade()
+{
+    if(!m_ws_key || !m_ws_version || strcmp(m_ws_version, "13") != 0){
+        return false;
+    }
+    char accept[32];
+    ws_accept_key(m_ws_key, accept);
+    char response[256];
+    int len = snprintf(response, sizeof(response),
+                       "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\n"
+                       "Connection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n\r\n", accept);
+    m_ws = new ws_conn(m_sockfd, m_url);
+    m_ws->send_raw(response, len);
+    //跟在握手请求之后已经读到的帧
+    m_ws->feed(m_read_buf + m_check_index, m_read_index - m_check_index);
+    //注册EPOLLOUT，由reactor订阅频道并发送101响应
+    modfd(m_epollfd, m_sockfd, EPOLLIN | EPOLLOUT);
+    return true;
+}
+
+//由reactor线程调用，第一次调用时订阅频道并处理握手之后已经读到的帧
+bool http_conn::ws_event(uint32_t events)
+{
+    bool ok;
+    if(!m_ws->m_subscribed){
+        ws_hub::subscribe(m_ws);
+        ok = m_ws->on_readable();
+    }
+    else if(events & EPOLLIN){
+        ok = m_ws->on_readable();
+    }
+    else{
+        ok = m_ws->flush();
+    }
+    //WebSocket连接只由reactor处理，重新注册事件之后仍然可以访问
+    account_memory();
+    return ok;
+}
+
+//只接受本机发布，请求体受读缓冲大小限制
+http_conn::HTTP_CODE http_conn::do_publish()
+{
+    if((ntohl(m_address.sin_addr.s_addr) >> 24) != 127){
+        return FORBIDDEN_REQUEST;
+    }
+    if(!m_body){
+        return BAD_REQUEST;
+    }
+    int count = ws_hub::broadcast(m_url, WS_TEXT, m_body, m_content_length);
+    printf("published %d bytes to %d subscribers of %s\n", m_content_length, count, m_url);
+    return PUBLISH_REQUEST;
+}
+
+void http_conn::add_coro_route(const char* prefix, coro_handler handler)
+{
+    m_coro_routes.push_back(std::make_pair(std::string(prefix), handler));
+}
+
+coro_handler http_conn::match_coro(const char* url)
+{
+    for(size_t i = 0; i < m_coro_routes.size(); i++){
+        if(strncmp(url, m_coro_routes[i].first.c_str(), m_coro_routes[i].first.size()) == 0){
+            return m_coro_routes[i].second;
+        }
+    }
+    return NULL;
+}
+
+//由工作线程调用，handler运行到第一次等待I/O或结束
+void http_conn::coro_start()
+{
+    if(!m_io){
+        m_io = conn_io::create(m_epollfd, m_sockfd);
+        if(!m_io){
+            close_conn();
+            return;
+        }
+    }
+    coro_request req;
+    req.method = method_names[m_method];
+    req.url = m_url;
+    req.headers = m_read_buf + m_header_start;
+    req.headers_end = m_read_buf + m_header_end;
+    req.body = m_body;
+    req.body_len = m_body ? m_content_length : 0;
+    req.keep_alive = m_linger;
+    //请求体之后已经读到的数据交给handler
+    int consumed = m_check_index + req.body_len;
+    const char* pending = m_read_buf + consumed;
+    size_t pending_len = m_read_index > consumed ? m_read_index - consumed : 0;
+    m_coro_active = true;
+    m_io->start(m_coro_handler, req, pending, pending_len, coro_done, this);
+}
+
+//在handler的final_suspend中调用，可能位于工作线程或reactor线程
+void http_conn::coro_done(void* arg, bool keep_alive)
+{
+    http_conn* conn = (http_conn*)arg;
+    conn->m_io->release();
+    conn->m_coro_active = false;
+    if(keep_alive && conn->m_linger){
+        conn->init();
+        conn->arm_read();
+    }
+    else{
+        conn->close_conn();
+    }
+}
+
+//由reactor线程调用，与WebSocket一样对方关闭或出错时返回false
+bool http_conn::coro_event(uint32_t events)
+{
+    if(events & (EPOLLRDHUP | EPOLLHUP)){
+        return false;
+    }
+    //之前的零拷贝响应的完成通知，读完之后等待中的操作多半仍需等待，由on_event重新注册
+    if((events & EPOLLERR) && !(m_tx.pending() && m_tx.reap(m_sockfd))){
+        return false;
+    }
+    m_io->on_event();
+    return true;
+}
@@ -5,6 +5,7 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/epoll.h>
+#include <poll.h>
 #include <fcntl.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -16,10 +17,22 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <stdarg.h>
 #include <errno.h>
 
 #include "locker.h"
+#include "file_cache.h"
+#include "memory_budget.h"
+#include "content_bundle.h"
+#include "proxy.h"
+#include "micro_cache.h"
+#include "tls.h"
+#include "http2.h"
+#include "websocket.h"
+#include "thread_pool.h"
+#include "transmit.h"
+#include "coro.h"
 
 //http连接事务类
 class http_conn
@@ -58,11 +71,19 @@ public:
     //forbidden_request表示客户对资源没有足够的访问权限
     //internal_error表示服务器内部错误
     //close_connection表示客户端已经关闭连接
+    //service_unavailable表示服务器过载，请求被拒绝
+    //too_many_requests表示客户端超过了限速
+    //bundle_request表示目标文件在内容包中找到，not_modified表示客户端缓存的版本仍然有效
+    //proxy_request表示请求匹配代理路由，需要转发给上游，bad_gateway表示上游不可用
+    //publish_request表示请求体已经广播给WebSocket频道的订阅者
+    //cached_request表示代理请求由微缓存中的响应应答
     enum HTTP_CODE
     {
         NO_REQUEST, GET_REQUEST, BAD_REQUEST,
         NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST,
-        INTERNAL_ERROR, CLOSED_CONNECTION
+        INTERNAL_ERROR, CLOSED_CONNECTION, SERVICE_UNAVAILABLE,
+        TOO_MANY_REQUESTS, BUNDLE_REQUEST, NOT_MODIFIED,
+        PROXY_REQUEST, BAD_GATEWAY, PUBLISH_REQUEST, CACHED_REQUEST, CORO_REQUEST, BODY_TOO_LARGE
     };
     //行的读取状态,分别表示读取到一个完整的行，行出错，行不完整
     enum LINE_STATUS
@@ -81,10 +102,36 @@ public:
     void close_conn(bool real_close = true);
     //处理客户请求
     void process();
+    //混合执行模式下由reactor线程调用：解析请求，若响应已被缓存或无需访问文件系统则直接应答
+    //返回false表示请求需要交给线程池处理，解析结果被保留，工作线程不会重复解析
+    bool process_inline();
+    //服务器过载或客户端超过限速时快速返回503/429并关闭连接，不解析请求
+    void shed(HTTP_CODE code = SERVICE_UNAVAILABLE);
+    //由reactor在交给线程池之前调用，根据路由规则或估计的响应大小给出调度类别(TASK_CLASS)
+    int classify();
+    //添加"prefix=latency|bulk|background"形式的调度规则，最长前缀优先
+    static bool add_class_rule(const char* spec);
+    //客户端的IPv4地址(网络字节序)
+    in_addr_t peer_addr() const { return m_address.sin_addr.s_addr; }
+    //当前请求的ID，用于跟踪点(trace.h)
+    uint64_t request_id() const { return m_request_id; }
     //非阻塞读操作
     bool read();
     //非阻塞写操作
     bool write();
+    //连接是否已经升级为WebSocket，此后的事件由reactor调用ws_event处理，不进入线程池
+    bool websocket() const { return m_ws != NULL; }
+    bool ws_event(uint32_t events);
+    //零拷贝发送的完成通知通过EPOLLERR到达，由reactor读取后重新注册事件；socket本身出错时返回false
+    bool zerocopy_pending() const { return m_tx.pending(); }
+    bool reap_zerocopy();
+    //请求正在由协程handler处理，此时的事件由reactor调用coro_event推进handler，不进入线程池
+    bool coroutine() const { return m_coro_active; }
+    //代理的响应因客户端写满而暂停，EPOLLOUT到来后交给工作线程继续
+    bool relaying() const { return m_relay != NULL; }
+    bool coro_event(uint32_t events);
+    //url在prefix之下的请求由协程handler处理
+    static void add_coro_route(const char* prefix, coro_handler handler);
 
 private:
     //初始化连接
@@ -99,9 +146,58 @@ private:
     HTTP_CODE parse_headers(char* text);
     HTTP_CODE parse_content(char* text);
     HTTP_CODE do_request();
+    HTTP_CODE do_cached_request();
+    HTTP_CODE do_bundle_request(content_bundle* bundle);
+    bool do_proxy();
+    //客户端可写后继续暂停的代理响应
+    void proxy_resume();
+    //代理请求在微缓存中的键：方法、主机、url与Vary列出的请求头部；请求带有凭证时不使用缓存，返回false
+    bool cache_key(std::string& key);
+    //在读缓冲的头部区域中查找请求头部，返回去掉前导空白的值
+    const char* find_header(const char* name) const;
+
+    //HTTP/2：读缓冲开头是否为客户端前言，1为完整前言，0为不是，-1为需要继续读取
+    int check_h2_preface();
+    //切换到HTTP/2，读缓冲中剩余的数据交给会话
+    bool h2_start();
+    //h2c升级，当前请求成为流1
+    bool h2_upgrade();
+    void process_h2();
+    //发送会话的输出，输出清空后按流量控制窗口继续生成帧
+    bool h2_write();
+    static void h2_request(void* ctx, http2_session* session, uint32_t stream_id, const http2_request& req);
+    //复用do_request查找目标文件，得到的映射或缓存条目转交给流，流结束时释放
+    void h2_respond(http2_session* session, uint32_t stream_id, const http2_request& req);
+
+    //完成WebSocket握手，连接交给reactor，握手头部不正确时返回false
+    bool ws_upgrade();
+    //本机POST到WebSocket频道的请求体广播给订阅者
+    HTTP_CODE do_publish();
+    static coro_handler match_coro(const char* url);
+    //把请求交给协程handler，之后不能再访问连接
+    void coro_start();
+    //handler结束，keep_alive为false时关闭连接
+    static void coro_done(void* arg, bool keep_alive);
+    //连接是否由用户态或内核TLS加密
+    bool tls_active() const;
+    //重新计算连接私有的动态内存并计入全局用量，只能由连接的持有者调用
+    void account_memory();
+    //等待下一次读取，与modfd一样是持有者的最后一步；内存超过软限制时占用最多的连接交给memory_budget暂停
+    void arm_read();
     char* get_line(){return m_read_buf + m_start_line;}
     LINE_STATUS parse_line();
 
+    //发送m_iv中的数据，启用TLS且内核未接管加密时使用SSL_write，响应体足够大时使用零拷贝
+    ssize_t send_iov();
+    //大小为len的响应体是否使用零拷贝发送
+    bool use_zerocopy(size_t len) const;
+#ifdef ENABLE_TLS
+    bool tls_read();
+    static ssize_t tls_send(void* ctx, const char* buf, size_t len);
+    //代理在用户态TLS连接上读取请求体的剩余部分时使用，语义与recv相同
+    static ssize_t tls_recv(void* ctx, char* buf, size_t len);
+#endif
+
     //下面这组函数被process_write调用
     void unmap();
     bool add_response(const char* format, ...);
@@ -110,18 +206,37 @@ private:
     bool add_headers(int content_length);
     bool add_content_length(int content_length);
     bool add_linger();
+    bool add_retry_after(int seconds);
     bool add_blank_line();
 
 public:
     //所有socket上的事件都被注册到同一个epoll内核事件表中，故声明为静态
     static int m_epollfd;
-    //统计用户数量
-    static int m_user_count;
+    //统计用户数量，排空时reactor据此判断是否可以退出
+    static std::atomic<int> m_user_count;
+    //正在排空(热升级或SIGTERM)：之后解析的请求一律以Connection: close响应
+    static std::atomic<bool> m_draining;
+    //所有连接共享的小文件缓存
+    static file_cache m_file_cache;
+    //代理响应的微缓存，未配置时不启用
+    static micro_cache m_micro_cache;
+    //url前缀到调度类别的规则
+    static std::vector<std::pair<std::string, int> > m_class_rules;
+    //url前缀到协程handler的路由
+    static std::vector<std::pair<std::string, coro_handler> > m_coro_routes;
 
 private:
     //读http连接的socket和对方的的socket地址
     int m_sockfd;
     sockaddr_in m_address;
+#ifdef ENABLE_TLS
+    //TLS会话，未启用TLS时为NULL
+    SSL* m_ssl;
+    //握手是否仍在进行
+    bool m_tls_handshaking;
+    //发送方向是否已经由内核TLS加密
+    bool m_ktls_send;
+#endif
 
     //读缓冲区
     char m_read_buf[READ_BUFFER_SIZE];
@@ -151,16 +266,71 @@ private:
     char* m_host;
     //http请求的消息体的长度
     int m_content_length;
+    //消息体在读缓冲中的位置
+    char* m_body;
+    //请求体为chunked编码
+    bool m_body_chunked;
+    //请求体没有完整读入读缓冲，m_body之后只有已经读到的部分，代理路由在转发时读取其余部分
+    bool m_body_streamed;
+    //头部在读缓冲中的范围，转发给上游时使用
+    int m_header_start;
+    int m_header_end;
+    //请求匹配的代理路由
+    proxy_route* m_proxy_route;
     //http请求是否要求保持连接
     bool m_linger;
+    //客户端是否接受gzip编码的响应
+    bool m_accept_gzip;
+    //If-None-Match头部的值
+    char* m_if_none_match;
+    //请求要求升级到h2c，以及HTTP2-Settings头部的值
+    bool m_upgrade_h2c;
+    char* m_h2_settings;
+    //连接切换到HTTP/2之后的会话，HTTP/1.1连接为NULL
+    http2_session* m_h2;
+    //请求要求升级到WebSocket，以及握手用到的两个头部
+    bool m_upgrade_websocket;
+    char* m_ws_key;
+    char* m_ws_version;
+    //升级之后的WebSocket连接
+    ws_conn* m_ws;
+    //协程handler的运行环境，第一次使用时创建，连接关闭时销毁
+    conn_io* m_io;
+    //暂停的代理响应，期间连接不读取新的请求
+    proxy_relay* m_relay;
+    coro_handler m_coro_handler;
+    bool m_coro_active;
+    //已经计入MEM_CONNECTION的字节数
+    long long m_mem;
 
     //客户请求的目标文件被mmap到内存中的起始位置
     char* m_file_adr;
+    //目标文件来自缓存时持有的缓存条目，此时m_file_adr指向条目的映射，不能直接munmap
+    file_cache::entry* m_cache_entry;
+    //由微缓存应答时持有的缓存条目
+    cached_response* m_cached;
+    //请求已经在reactor线程中解析完毕，工作线程直接从do_request开始
+    bool m_parsed;
+    //从内容包应答时持有的包与条目，m_bundle_gzip表示发送预压缩版本
+    content_bundle* m_bundle;
+    const bundle_entry* m_bundle_entry;
+    bool m_bundle_gzip;
     //目标文件的状态，判断文件是否存在，是否为目录， 是否可读，并获取文件大小等信息
     struct stat m_file_stat;
     //采用writev来执行写操作， m_iv_count表示被写内存块的数量
-    struct iovec m_iv[2];
+    //内容包与微缓存应答时依次为预先生成的响应头、写缓冲中的Connection头部、响应体
+    struct iovec m_iv[3];
     int m_iv_count;
+    //当前响应的响应体(m_iv的最后一块)是否用零拷贝发送
+    bool m_zerocopy;
+    //零拷贝发送的状态，以及等待完成通知才能释放的映射
+    transmitter m_tx;
+    //还需要发送的字节数与已经发送的字节数，部分写入后由下一次write继续
+    int m_bytes_to_send;
+    int m_bytes_have_send;
+    //init()为每个请求分配新的ID
+    uint64_t m_request_id;
+    static std::atomic<uint64_t> m_next_request_id;
 
 };
 
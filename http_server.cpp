@@ -1,12 +1,40 @@
 #include "locker.h"
 #include "thread_pool.h"
 #include "http_conn.h"
+#include "topology.h"
+#include "rate_limiter.h"
+#include "content_bundle.h"
+#include "proxy.h"
+#include "tls.h"
+#include "websocket.h"
+#include "transmit.h"
+#include "arena.h"
+#include "trace.h"
+#include "throttle.h"
+#include "handoff.h"
+#include "memory_budget.h"
+
+#include <sys/eventfd.h>
 
 #define MAX_FD 65536
 #define MAX_EVENT_NUMBER 10000
 
+//过载时在读取请求之前直接拒绝新连接
+static const char* busy_response = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\n"
+                                   "Content-Length: 0\r\nConnection: close\r\n\r\n";
+//客户端超过限速时在读取请求之前直接拒绝新连接
+static const char* limited_response = "HTTP/1.1 429 Too Many Requests\r\nRetry-After: 1\r\n"
+                                      "Content-Length: 0\r\nConnection: close\r\n\r\n";
+
+//按来源地址与/24前缀限速，未配置时为NULL
+static rate_limiter* ip_limiter = NULL;
+static rate_limiter* prefix_limiter = NULL;
+
 extern int addfd(int epollfd, int fd, bool one_shot);
 extern int removefd(int epollfd, int fd);
+extern void modfd(int epollfd, int fd, int ev);
+//网站根目录，定义在http_conn.cpp中
+extern const char* doc_root;
 
 void addsig(int sig, void(handler)(int), bool restart = true)
 {
@@ -27,91 +55,638 @@ void show_error(int connfd, const char* info)
     close(connfd);
 }
 
+//解析"rate,burst"形式的限速参数
+rate_limiter* make_limiter(const char* arg)
+{
+    double rate = 0, burst = 0;
+    if(sscanf(arg, "%lf,%lf", &rate, &burst) != 2 || rate <= 0 || burst < 1){
+        return NULL;
+    }
+    return new rate_limiter(rate, burst);
+}
+
+//检查客户端是否超过限速，连接建立与每个请求各消耗一个令牌
+bool client_allowed(in_addr_t addr)
+{
+    if(ip_limiter && !ip_limiter->allow(ntohl(addr))){
+        return false;
+    }
+    if(prefix_limiter && !prefix_limiter->allow(ntohl(addr) & 0xffffff00)){
+        return false;
+    }
+    return true;
+}
+
+//解析"prefix[,policy[,max_kb]]"形式的WebSocket参数，policy为oldest、newest或close
+bool setup_websocket(const char* arg)
+{
+    std::string spec(arg);
+    std::string prefix = spec.substr(0, spec.find(','));
+    std::string policy = spec.find(',') == std::string::npos ? "oldest" : spec.substr(spec.find(',') + 1);
+    int max_kb = 256;
+    if(policy.find(',') != std::string::npos){
+        max_kb = atoi(policy.c_str() + policy.find(',') + 1);
+        policy.erase(policy.find(','));
+    }
+    if(prefix.empty() || prefix[0] != '/' || max_kb <= 0){
+        return false;
+    }
+    WS_POLICY p;
+    if(policy == "oldest"){
+        p = WS_DROP_OLDEST;
+    }
+    else if(policy == "newest"){
+        p = WS_DROP_NEWEST;
+    }
+    else if(policy == "close"){
+        p = WS_DISCONNECT;
+    }
+    else{
+        return false;
+    }
+    return ws_hub::init(prefix.c_str(), p, (size_t)max_kb * 1024);
+}
+
+//收到SIGHUP时重新加载内容包，信号处理函数中只设置标志，由主循环完成加载
+static volatile sig_atomic_t reload_bundle = 0;
+
+void sighup_handler(int)
+{
+    reload_bundle = 1;
+}
+
+//加载内容包要读入整个文件(-H复制到大页，-p预先触发缺页)，在辅助线程中进行，完成后通过eventfd通知reactor安装
+struct bundle_loader
+{
+    const char* path;
+    bool populate;
+    bool hugepage;
+    int event_fd;
+    bool busy;                              //只由reactor读写
+    std::atomic<content_bundle*> loaded;    //加载的结果，失败时为NULL
+};
+static bundle_loader loader;
+
+static void* load_bundle(void*)
+{
+    loader.loaded.store(content_bundle::open(loader.path, loader.populate, loader.hugepage));
+    uint64_t one = 1;
+    ssize_t ret = write(loader.event_fd, &one, sizeof(one));
+    (void)ret;
+    return NULL;
+}
+
+//由reactor调用，上一次加载还没有结束时等它结束后再开始
+static void start_bundle_load()
+{
+    if(!reload_bundle || loader.busy){
+        return;
+    }
+    reload_bundle = 0;
+    pthread_t tid;
+    if(pthread_create(&tid, NULL, load_bundle, NULL) != 0){
+        printf("reload bundle %s failed, keep serving the old one\n", loader.path);
+        return;
+    }
+    pthread_detach(tid);
+    loader.busy = true;
+}
+
+//收到SIGTERM时停止accept，排空已有的连接后退出
+static volatile sig_atomic_t stop_server = 0;
+
+void sigterm_handler(int)
+{
+    stop_server = 1;
+}
+
+void usage(const char* prog)
+{
+    printf("Usage: %s [-t thread_number] [-c cpu_list] [-N numa_node] [-i] [-q target_ms]\n"
+           "          [-L rate,burst] [-l rate,burst] [-b bundle [-p] [-H]]\n"
+           "          [-x prefix=ip:port[,ip:port...]] [-X] [-S cert.pem -K key.pem]\n"
+           "          [-W prefix[,oldest|newest|close[,max_kb]]] [-M ttl_ms[,stale_ms]]\n"
+           "          [-P prefix=latency|bulk|background] [-R latency,bulk,background]\n"
+           "          [-Z threshold_kb[,lowat_kb]] [-D prefix=kbps] [-d doc_root]\n"
+           "          [-U control_socket[,drain_seconds]] [-m soft_mb[,hard_mb[,status_url]]] <ip> <port>\n", prog);
+    printf("  -t  number of worker threads (default 8)\n");
+    printf("  -c  pin the reactor to the first cpu and workers to the rest, e.g. 0-3,8\n");
+    printf("  -N  run on the cpus of this numa node and allocate memory there\n");
+    printf("  -i  hybrid mode: answer cached responses on the reactor thread\n");
+    printf("  -q  target queueing delay before shedding load with 503 (default 5, 0 disables)\n");
+    printf("  -L  per client ip token bucket: connections and requests per second, burst\n");
+    printf("  -l  per /24 prefix token bucket: connections and requests per second, burst\n");
+    printf("  -b  serve from a content bundle built by bundle_pack, SIGHUP reloads it\n");
+    printf("  -p  prefault the whole bundle at load time (MAP_POPULATE)\n");
+    printf("  -H  copy the bundle into huge pages\n");
+    printf("  -x  proxy urls under prefix to these backends over pooled keep-alive connections, repeatable\n");
+    printf("  -X  balance proxy backends by least outstanding requests instead of round-robin\n");
+    printf("  -S  serve https with this certificate chain, using kernel TLS when available\n");
+    printf("  -K  private key for -S\n");
+    printf("  -W  accept websockets under prefix, each url is a channel; local POSTs to it are broadcast,\n"
+           "      a slow client's queue beyond max_kb (default 256) drops oldest/newest or closes\n");
+    printf("  -M  micro-cache proxied GET responses for ttl_ms, one upstream request per url at a time;\n"
+           "      for stale_ms after expiry serve the old response while one request refreshes it\n");
+    printf("  -P  schedule urls under prefix in this class, repeatable; otherwise proxied and large or\n"
+           "      uncached files are bulk and the rest latency; classes are dequeued 8:2:1\n");
+    printf("  -R  workers reserved for each class (default a quarter of the workers for latency)\n");
+    printf("  -Z  send file and bundle bodies of at least threshold_kb with MSG_ZEROCOPY, corking the headers\n"
+           "      with the body, and cap unsent socket data at lowat_kb (default 128) with TCP_NOTSENT_LOWAT\n");
+    printf("  -D  send files under prefix at kbps per connection from a coroutine handler\n");
+    printf("  -d  serve files from this directory (default %s)\n", doc_root);
+    printf("  -U  zero-downtime upgrade: take over the listening socket and file cache of the server waiting\n"
+           "      on control_socket, which then drains for up to drain_seconds (default 10) and exits;\n"
+           "      then wait there for the next upgrade. SIGTERM also drains before exiting\n");
+    printf("  -m  memory budget for caches and connection buffers: above soft_mb the heaviest connections stop\n"
+           "      reading, above hard_mb (default soft_mb * 5 / 4) caches shrink and new connections get 503;\n"
+           "      status_url answers the current usage per subsystem\n");
+}
+
 int main(int argc, char*argv[])
 {
-    if(argc <= 2){
-        printf("Usage: %s <ip> <port>", basename(argv[0]));
+    int thread_number = 8;
+    const char* cpu_arg = NULL;
+    int numa_node = -1;
+    bool hybrid = false;
+    int queue_target_ms = 5;
+    const char* bundle_path = NULL;
+    bool bundle_populate = false;
+    bool bundle_hugepage = false;
+    const char* cert_file = NULL;
+    const char* key_file = NULL;
+    const char* reserve_arg = NULL;
+    const char* control_path = NULL;
+    int drain_seconds = 10;
+    int opt;
+    while((opt = getopt(argc, argv, "t:c:N:iq:L:l:b:pHx:XS:K:W:M:P:R:Z:D:d:U:m:")) != -1){
+        switch(opt)
+        {
+        case 't':
+            thread_number = atoi(optarg);
+            break;
+        case 'c':
+            cpu_arg = optarg;
+            break;
+        case 'N':
+            numa_node = atoi(optarg);
+            break;
+        case 'i':
+            hybrid = true;
+            break;
+        case 'q':
+            queue_target_ms = atoi(optarg);
+            break;
+        case 'b':
+            bundle_path = optarg;
+            break;
+        case 'p':
+            bundle_populate = true;
+            break;
+        case 'H':
+            bundle_hugepage = true;
+            break;
+        case 'x':
+            if(!proxy::add_route(optarg)){
+                printf("bad proxy route: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'X':
+            proxy::set_least_outstanding(true);
+            break;
+        case 'S':
+            cert_file = optarg;
+            break;
+        case 'K':
+            key_file = optarg;
+            break;
+        case 'W':
+            if(!setup_websocket(optarg)){
+                printf("bad websocket option: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'M':
+        {
+            int ttl_ms = atoi(optarg);
+            const char* comma = strchr(optarg, ',');
+            if(ttl_ms <= 0){
+                printf("bad micro-cache option: %s\n", optarg);
+                return 1;
+            }
+            http_conn::m_micro_cache.configure(ttl_ms, comma ? atoi(comma + 1) : 0);
+            break;
+        }
+        case 'P':
+            if(!http_conn::add_class_rule(optarg)){
+                printf("bad class rule: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'R':
+            reserve_arg = optarg;
+            break;
+        case 'Z':
+        {
+            int threshold_kb = atoi(optarg);
+            const char* comma = strchr(optarg, ',');
+            int lowat_kb = comma ? atoi(comma + 1) : 128;
+            if(threshold_kb <= 0 || lowat_kb < 0){
+                printf("bad zerocopy option: %s\n", optarg);
+                return 1;
+            }
+            transmitter::configure((size_t)threshold_kb * 1024, lowat_kb * 1024);
+            break;
+        }
+        case 'D':
+        {
+            char* eq = strchr(optarg, '=');
+            int kbps = eq ? atoi(eq + 1) : 0;
+            if(!eq || kbps <= 0){
+                printf("bad throttle option: %s\n", optarg);
+                return 1;
+            }
+            *eq = '\0';
+            throttled_download::configure(kbps);
+            http_conn::add_coro_route(optarg, throttled_download::handle);
+            break;
+        }
+        case 'd':
+            doc_root = optarg;
+            break;
+        case 'U':
+        {
+            char* comma = strchr(optarg, ',');
+            if(comma){
+                *comma = '\0';
+                drain_seconds = atoi(comma + 1);
+            }
+            control_path = optarg;
+            break;
+        }
+        case 'm':
+        {
+            long long soft_mb = 0, hard_mb = 0;
+            char status_url[256] = "";
+            if(sscanf(optarg, "%lld,%lld,%255s", &soft_mb, &hard_mb, status_url) < 1 || soft_mb <= 0){
+                printf("bad memory budget: %s\n", optarg);
+                return 1;
+            }
+            if(hard_mb <= 0){
+                hard_mb = soft_mb * 5 / 4;
+            }
+            memory_budget::configure(soft_mb << 20, hard_mb << 20);
+            if(status_url[0]){
+                http_conn::add_coro_route(status_url, memory_budget::status);
+            }
+            break;
+        }
+        case 'L':
+        case 'l':
+        {
+            rate_limiter* limiter = make_limiter(optarg);
+            if(!limiter){
+                printf("bad rate limit: %s\n", optarg);
+                return 1;
+            }
+            (opt == 'L' ? ip_limiter : prefix_limiter) = limiter;
+            break;
+        }
+        default:
+            usage(basename(argv[0]));
+            return 1;
+        }
+    }
+    if(argc - optind < 2 || thread_number <= 0){
+        usage(basename(argv[0]));
         return 1;
     }
-    const char* ip = argv[1];
-    int port = atoi(argv[2]);
+    const char* ip = argv[optind];
+    int port = atoi(argv[optind + 1]);
+
+    //确定线程拓扑：-c指定的CPU列表优先，否则使用-N指定节点上的全部CPU
+    std::vector<int> cpus;
+    if(cpu_arg && !parse_cpu_list(cpu_arg, cpus)){
+        printf("bad cpu list: %s\n", cpu_arg);
+        return 1;
+    }
+    if(numa_node >= 0){
+        if(cpus.empty() && !node_cpu_list(numa_node, cpus)){
+            printf("cannot read cpus of numa node %d\n", numa_node);
+            return 1;
+        }
+        //之后分配的连接数组与缓冲区都落在该节点上
+        if(!prefer_numa_node(numa_node)){
+            printf("set_mempolicy for node %d failed\n", numa_node);
+        }
+    }
+    //主线程(reactor)独占第一个CPU，工作线程使用其余CPU；只有一个CPU时共用
+    std::vector<int> worker_cpus;
+    if(!cpus.empty()){
+        if(!pin_thread(pthread_self(), cpus[0])){
+            printf("pin reactor to cpu %d failed\n", cpus[0]);
+        }
+        worker_cpus.assign(cpus.size() > 1 ? cpus.begin() + 1 : cpus.begin(), cpus.end());
+    }
 
     //忽略sigpipe信号
     addsig(SIGPIPE, SIG_IGN);
 
+    if(cert_file || key_file){
+#ifdef ENABLE_TLS
+        if(!cert_file || !key_file || !tls::init(cert_file, key_file)){
+            printf("cannot load certificate %s and key %s\n", cert_file ? cert_file : "", key_file ? key_file : "");
+            return 1;
+        }
+#else
+        printf("TLS support is not compiled in, rebuild with -DENABLE_TLS tls.cpp -lssl -lcrypto\n");
+        return 1;
+#endif
+    }
+
+    //加载内容包
+    if(bundle_path){
+        content_bundle* bundle = content_bundle::open(bundle_path, bundle_populate, bundle_hugepage);
+        if(!bundle){
+            printf("cannot load bundle %s\n", bundle_path);
+            return 1;
+        }
+        printf("loaded bundle %s with %zu files\n", bundle_path, bundle->count());
+        content_bundle::install(bundle);
+        loader.path = bundle_path;
+        loader.populate = bundle_populate;
+        loader.hugepage = bundle_hugepage;
+        loader.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        loader.busy = false;
+        if(loader.event_fd < 0){
+            printf("cannot create the bundle reload eventfd, SIGHUP is ignored\n");
+        }
+        else{
+            addsig(SIGHUP, sighup_handler);
+        }
+    }
+
     //创建线程池
     threadpool<http_conn>* pool = NULL;
     try
     {
-        pool = new threadpool<http_conn>;
+        pool = new threadpool<http_conn>(thread_number, 10000, worker_cpus);
     }
     catch(...)
     {
         return 1;
     }
-    //预先为每个可能的用户分配一个http_conn对象
-    http_conn* users = new http_conn[MAX_FD];
+    pool->set_queue_delay(queue_target_ms);
+    if(reserve_arg){
+        int reserved[CLASS_COUNT] = {0, 0, 0};
+        sscanf(reserve_arg, "%d,%d,%d", &reserved[CLASS_LATENCY], &reserved[CLASS_BULK], &reserved[CLASS_BACKGROUND]);
+        for(int i = 0; i < CLASS_COUNT; i++){
+            pool->set_reserved(i, reserved[i]);
+        }
+    }
+    //预先为每个可能的用户分配一个http_conn对象，连接表连同其中的读写缓冲区放在大页上，
+    //按fd随机访问时不会因为TLB缺失而走页表；大页在reactor线程中构造时被首次写入，按first-touch策略分配在reactor所在节点
+    bool users_hugetlb = false;
+    http_conn* users = (http_conn*)huge_alloc(sizeof(http_conn) * MAX_FD, &users_hugetlb);
     assert(users);
+    for(int i = 0; i < MAX_FD; i++){
+        new (users + i) http_conn();
+    }
+    printf("connection table: %zu MB on %s\n", sizeof(http_conn) * MAX_FD >> 20,
+           users_hugetlb ? "reserved huge pages" : "transparent huge pages");
     int user_count = 0;
 
-    int listenfd = socket(PF_INET, SOCK_STREAM, 0);
-    assert(listenfd >= 0);
-    struct linger tmp = {1,0};
-    setsockopt(listenfd, SOL_SOCKET, SO_LINGER, &tmp, sizeof(tmp));
+    //热升级：控制socket上有正在运行的旧进程时接管它的监听socket与文件缓存，否则自己创建
+    int handoff_conn = -1;
+    int listenfd = control_path ? handoff::receive(control_path, http_conn::m_file_cache, handoff_conn) : -1;
+    if(listenfd < 0){
+        listenfd = socket(PF_INET, SOCK_STREAM, 0);
+        assert(listenfd >= 0);
+        //记录reactor所在的CPU，使用SO_REUSEPORT拆分多个reactor时内核据此把连接交给处理该RX队列的reactor
+        if(!cpus.empty()){
+            int incoming_cpu = cpus[0];
+            setsockopt(listenfd, SOL_SOCKET, SO_INCOMING_CPU, &incoming_cpu, sizeof(incoming_cpu));
+        }
 
-    int ret = 0;
-    sockaddr_in adr;
-    bzero(&adr, sizeof(adr));
-    adr.sin_family = AF_INET;
-    inet_pton(AF_INET, ip, &adr.sin_addr);
-    adr.sin_port = htons(port);
+        int ret = 0;
+        sockaddr_in adr;
+        bzero(&adr, sizeof(adr));
+        adr.sin_family = AF_INET;
+        inet_pton(AF_INET, ip, &adr.sin_addr);
+        adr.sin_port = htons(port);
 
-    ret = bind(listenfd, (struct sockaddr*)&adr, sizeof(adr));
-    assert(ret >= 0);
-    ret = listen(listenfd, 5);
-    assert(ret >= 0);
+        ret = bind(listenfd, (struct sockaddr*)&adr, sizeof(adr));
+        assert(ret >= 0);
+        ret = listen(listenfd, 5);
+        assert(ret >= 0);
+    }
 
     epoll_event events[MAX_EVENT_NUMBER];
     int epollfd = epoll_create(5);
     assert(epollfd != -1);
     addfd(epollfd, listenfd, false);
     http_conn::m_epollfd = epollfd;
+    //广播线程通过eventfd通知reactor发送WebSocket消息
+    if(ws_hub::enabled()){
+        addfd(epollfd, ws_hub::event_fd(), false);
+    }
+    //内容包在辅助线程中加载完成
+    if(bundle_path && loader.event_fd >= 0){
+        addfd(epollfd, loader.event_fd, false);
+    }
+    std::vector<int> ws_failed;
+    std::vector<int> resumed;
+    //一次epoll_wait中读完请求的连接，一次加锁放入线程池
+    std::vector<http_conn*> batch;
+    std::vector<int> batch_cls;
+    time_t last_shrink = 0;
+
+    //已经在accept，通知旧进程开始排空，然后在同一路径上等待下一次升级
+    int control_fd = -1;
+    if(control_path){
+        if(handoff_conn >= 0){
+            handoff::ready(handoff_conn);
+            handoff_conn = -1;
+        }
+        control_fd = handoff::listen_control(control_path);
+        if(control_fd < 0){
+            printf("cannot listen on control socket %s\n", control_path);
+        }
+        else{
+            addfd(epollfd, control_fd, false);
+        }
+    }
+    addsig(SIGTERM, sigterm_handler);
+    //排空期间与有连接暂停读取时epoll_wait定时返回，检查连接是否已经全部关闭、暂停的连接是否可以恢复
+    bool draining = false;
+    bool handed_off = false;
+    time_t drain_deadline = 0;
 
     while(1){
-        int number = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, -1);
-        if(number <= 0 && errno == EINTR){
+        //交给新进程或收到SIGTERM后停止accept，已经在队列中的连接由新进程接受，或随监听socket一起被拒绝
+        if((handed_off || stop_server) && !draining){
+            draining = true;
+            http_conn::m_draining = true;
+            epoll_ctl(epollfd, EPOLL_CTL_DEL, listenfd, 0);
+            close(listenfd);
+            if(control_fd >= 0){
+                close(control_fd);
+                control_fd = -1;
+                //控制socket的路径已经属于新进程
+                if(!handed_off){
+                    unlink(control_path);
+                }
+            }
+            drain_deadline = time(NULL) + drain_seconds;
+            printf("draining %d connections for up to %d seconds\n", (int)http_conn::m_user_count, drain_seconds);
+        }
+        //空闲的keep-alive连接不会再发来请求，等到期限时随进程一起关闭
+        if(draining && (http_conn::m_user_count == 0 || time(NULL) >= drain_deadline)){
+            printf("drained, %d connections left\n", (int)http_conn::m_user_count);
+            break;
+        }
+        int number = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, draining || memory_budget::paused() > 0 ? 100 : -1);
+        if(number < 0 && errno != EINTR){
             printf("epoll faluire\n");
             break;
         }
+        //部署新版本时先原子地替换包文件，再发送SIGHUP，新的包在辅助线程中加载
+        start_bundle_load();
+        //超过内存的硬限制时先收缩缓存，仍然超过时才拒绝新连接；用量回落或暂停太久的连接重新开始读取
+        if(memory_budget::over_hard()){
+            long long before = memory_budget::usage();
+            http_conn::m_file_cache.shrink();
+            http_conn::m_micro_cache.shrink();
+            if(time(NULL) != last_shrink){
+                last_shrink = time(NULL);
+                printf("memory usage %lld over the hard limit, shrank caches to %lld\n", before, memory_budget::usage());
+            }
+        }
+        memory_budget::resume(resumed);
+        for(size_t j = 0; j < resumed.size(); j++){
+            modfd(epollfd, resumed[j], EPOLLIN);
+        }
+        resumed.clear();
 
         for(int i = 0; i < number; i++){
             int sockfd = events[i].data.fd;
 
+            //新进程连接控制socket，交出监听socket与文件缓存
+            if(sockfd == control_fd){
+                if(handoff::offer(control_fd, listenfd, http_conn::m_file_cache, handoff_conn)){
+                    addfd(epollfd, handoff_conn, false);
+                }
+            }
+            //新进程已经开始accept，或者在就绪之前退出
+            else if(sockfd == handoff_conn){
+                int ready = handoff::poll_ready(handoff_conn);
+                if(ready != 0){
+                    close(handoff_conn);
+                    handoff_conn = -1;
+                    if(ready > 0){
+                        handed_off = true;
+                    }
+                    else{
+                        printf("the new server exited before it was ready, keep serving\n");
+                    }
+                }
+            }
             //客户连接请求
-            if(sockfd == listenfd){
-                struct sockaddr_in client_adr;
-                socklen_t client_adr_size = sizeof(client_adr);
-                int connfd = accept(sockfd, (struct sockaddr*)&client_adr, &client_adr_size);
-                if(connfd < 0){
-                    printf("errno is:%d\n", errno);
-                    continue;
+            else if(!draining && sockfd == listenfd){
+                //监听socket注册为边沿触发，必须一次接受所有已完成的连接，否则剩余的连接要等到下一个连接到来才会被处理
+                while(true){
+                    struct sockaddr_in client_adr;
+                    socklen_t client_adr_size = sizeof(client_adr);
+                    int connfd = accept(sockfd, (struct sockaddr*)&client_adr, &client_adr_size);
+                    if(connfd < 0){
+                        if(errno != EAGAIN && errno != EWOULDBLOCK){
+                            printf("errno is:%d\n", errno);
+                        }
+                        break;
+                    }
+                    if(http_conn::m_user_count >= MAX_FD){
+                        show_error(connfd, "Server busy");
+                        continue;
+                    }
+                    //线程池排队时延持续超标或者内存超过硬限制，不再接受新的工作
+                    if(pool->overloaded() || memory_budget::over_hard()){
+                        show_error(connfd, busy_response);
+                        continue;
+                    }
+                    if(!client_allowed(client_adr.sin_addr.s_addr)){
+                        show_error(connfd, limited_response);
+                        continue;
+                    }
+                    //初始化客户连接
+                    users[connfd].init(connfd, client_adr);
                 }
-                if(http_conn::m_user_count >= MAX_FD){
-                    show_error(connfd, "Server busy");
-                    continue;
+            }
+            //新的内容包加载完成，reactor只负责安装，正在发送的响应继续引用旧的包
+            else if(bundle_path && sockfd == loader.event_fd){
+                uint64_t value;
+                while(read(loader.event_fd, &value, sizeof(value)) > 0){
+                }
+                loader.busy = false;
+                content_bundle* bundle = loader.loaded.exchange(NULL);
+                if(bundle){
+                    printf("reloaded bundle %s with %zu files\n", bundle_path, bundle->count());
+                    content_bundle::install(bundle);
+                }
+                else{
+                    printf("reload bundle %s failed, keep serving the old one\n", bundle_path);
+                }
+                //加载期间又收到了SIGHUP
+                start_bundle_load();
+            }
+            //有WebSocket消息需要发送
+            else if(sockfd == ws_hub::event_fd()){
+                ws_hub::flush_dirty(ws_failed);
+                for(size_t j = 0; j < ws_failed.size(); j++){
+                    users[ws_failed[j]].close_conn();
+                }
+                ws_failed.clear();
+            }
+            //协程handler等待的事件，由reactor直接推进并恢复handler
+            else if(users[sockfd].coroutine()){
+                if(!users[sockfd].coro_event(events[i].events)){
+                    users[sockfd].close_conn();
+                }
+            }
+            //零拷贝发送的完成通知也以EPOLLERR的形式到达，读取通知后重新注册，其他事件在下一轮再处理
+            else if((events[i].events & EPOLLERR) && !(events[i].events & (EPOLLRDHUP | EPOLLHUP)) &&
+                    users[sockfd].zerocopy_pending()){
+                if(!users[sockfd].reap_zerocopy()){
+                    users[sockfd].close_conn();
                 }
-                //初始化客户连接
-                users[connfd].init(connfd, client_adr);
             }
             //如果有异常，直接关闭连接
             else if(events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)){
                 users[sockfd].close_conn();
             }
+            //WebSocket连接的读写全部在reactor线程中完成
+            else if(users[sockfd].websocket()){
+                if(!users[sockfd].ws_event(events[i].events)){
+                    users[sockfd].close_conn();
+                }
+            }
             //读
             else if(events[i].events & EPOLLIN){
                 //根据读的结果，决定是否将任务添加到线程池，还是关闭连接
                 if(users[sockfd].read()){
-                    pool->append(users + sockfd);
+                    TRACE2(read_done, users[sockfd].request_id(), sockfd);
+                    if(!client_allowed(users[sockfd].peer_addr())){
+                        users[sockfd].shed(http_conn::TOO_MANY_REQUESTS);
+                        continue;
+                    }
+                    //混合模式下，命中缓存的请求在reactor线程中直接应答，只有慢请求进入线程池
+                    if(hybrid && users[sockfd].process_inline()){
+                        continue;
+                    }
+                    //本轮所有可读的连接处理完之后一起入队，入队后连接属于工作线程，探针在入队之前记录
+                    int cls = users[sockfd].classify();
+                    TRACE3(enqueue, users[sockfd].request_id(), sockfd, cls);
+                    batch.push_back(users + sockfd);
+                    batch_cls.push_back(cls);
                 }
                 else{
                     users[sockfd].close_conn();
@@ -119,6 +694,12 @@ int main(int argc, char*argv[])
             }
             //写
             else if(events[i].events & EPOLLOUT){
+                //暂停的代理响应还要读上游，交给工作线程继续转发
+                if(users[sockfd].relaying()){
+                    batch.push_back(users + sockfd);
+                    batch_cls.push_back(CLASS_BULK);
+                    continue;
+                }
                 //根据写的结果，决定是否关闭连接
                 if(!users[sockfd].write()){
                     users[sockfd].close_conn();
@@ -128,11 +709,35 @@ int main(int argc, char*argv[])
 
             }
         }
+        //请求队列已满时立即返回503，否则连接的EPOLLONESHOT永远不会被重新注册
+        if(!batch.empty()){
+            int queued = pool->append_batch(batch.data(), batch_cls.data(), batch.size());
+            for(size_t j = queued; j < batch.size(); j++){
+                batch[j]->shed();
+            }
+            batch.clear();
+            batch_cls.clear();
+        }
     }
 
     close(epollfd);
-    close(listenfd);
-    delete [] users;
+    if(!draining){
+        close(listenfd);
+    }
+    if(control_fd >= 0){
+        close(control_fd);
+    }
+    if(handoff_conn >= 0){
+        close(handoff_conn);
+    }
+    //先等待工作线程处理完手中的任务并退出，之后才能销毁连接
     delete pool;
+    for(int i = 0; i < MAX_FD; i++){
+        users[i].~http_conn();
+    }
+    huge_free(users, sizeof(http_conn) * MAX_FD);
+    delete ip_limiter;
+    delete prefix_limiter;
+    content_bundle::install(NULL);
     return 0;
 }
@@ -2,8 +2,25 @@
 #define LOCKER_H_INCLUDED
 
 #include <exception>
+#include <atomic>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+//自旋等待时提示CPU：降低功耗，并让出超线程的执行资源
+inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
 
 //封装信号量的类
 class sem
@@ -27,6 +44,24 @@ public:
     {
         return sem_wait(&m_sem) == 0;
     }
+    //最多等待ms毫秒，超时返回false
+    bool timed_wait(int ms)
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += ms / 1000;
+        ts.tv_nsec += (long)(ms % 1000) * 1000000;
+        if(ts.tv_nsec >= 1000000000){
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        while(sem_timedwait(&m_sem, &ts) != 0){
+            if(errno != EINTR){
+                return false;
+            }
+        }
+        return true;
+    }
     //增加信号量
     bool post()
     {
@@ -71,7 +106,8 @@ private:
 };
 
 
-//封装条件变量的类
+//封装条件变量的类，条件由调用者给出的谓词表示
+//谓词的检查与条件的修改都在内部的互斥锁中进行，不会丢失唤醒，也能正确处理虚假唤醒
 class cond
 {
 public:
@@ -95,19 +131,37 @@ public:
         pthread_mutex_destroy(&m_mutex);
         pthread_cond_destroy(&m_cond);
     }
-    //等待条件变量
-    bool wait()
+    //等待直到pred()为true
+    template<typename Pred>
+    bool wait(Pred pred)
     {
         int ret = 0;
         pthread_mutex_lock(&m_mutex);
-        ret = pthread_cond_wait(&m_cond, &m_mutex);
+        while(ret == 0 && !pred()){
+            ret = pthread_cond_wait(&m_cond, &m_mutex);
+        }
         pthread_mutex_unlock(&m_mutex);
         return ret == 0;
     }
-    //唤醒等待条件变量的线程
-    bool signal()
+    //在持有互斥锁时执行update修改条件，然后唤醒一个等待的线程
+    template<typename Update>
+    bool signal(Update update)
     {
-        return pthread_cond_signal(&m_cond) == 0;
+        pthread_mutex_lock(&m_mutex);
+        update();
+        int ret = pthread_cond_signal(&m_cond);
+        pthread_mutex_unlock(&m_mutex);
+        return ret == 0;
+    }
+    //同上，唤醒所有等待的线程
+    template<typename Update>
+    bool broadcast(Update update)
+    {
+        pthread_mutex_lock(&m_mutex);
+        update();
+        int ret = pthread_cond_broadcast(&m_cond);
+        pthread_mutex_unlock(&m_mutex);
+        return ret == 0;
     }
 
 private:
@@ -115,4 +169,33 @@ private:
     pthread_cond_t m_cond;
 };
 
+
+//基于futex的事件计数：等待者先取得序号，再检查自己的条件，条件不满足时才睡眠；
+//唤醒者先修改条件再调用notify，序号的变化保证两者之间的唤醒不会丢失
+class futex_event
+{
+public:
+    futex_event(): m_seq(0) {}
+    uint32_t prepare() const
+    {
+        return m_seq.load();
+    }
+    //序号仍为seq时睡眠，timeout_us为0表示一直等待
+    void wait(uint32_t seq, long timeout_us = 0)
+    {
+        struct timespec ts = {timeout_us / 1000000, (timeout_us % 1000000) * 1000};
+        syscall(SYS_futex, &m_seq, FUTEX_WAIT_PRIVATE, seq, timeout_us > 0 ? &ts : NULL, NULL, 0);
+    }
+    //唤醒最多n个等待者
+    void notify(int n)
+    {
+        m_seq.fetch_add(1);
+        syscall(SYS_futex, &m_seq, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+    }
+
+private:
+    static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex word must be 32 bits");
+    std::atomic<uint32_t> m_seq;
+};
+
 #endif // LOCKER_H_INCLUDED
@@ -0,0 +1,90 @@
+#include "memory_budget.h"
+
+#include <stdio.h>
+#include <time.h>
+
+long long memory_budget::m_soft = 0;
+long long memory_budget::m_hard = 0;
+std::atomic<long long> memory_budget::m_usage[MEM_CLASS_COUNT];
+std::atomic<long long> memory_budget::m_total(0);
+std::vector<std::pair<int, long long> > memory_budget::m_paused;
+std::atomic<int> memory_budget::m_paused_count(0);
+locker memory_budget::m_locker;
+
+static const char* class_names[MEM_CLASS_COUNT] = {"connection", "file_cache", "micro_cache", "websocket"};
+
+static long long now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void memory_budget::configure(long long soft, long long hard)
+{
+    m_soft = soft;
+    m_hard = hard > soft ? hard : soft;
+}
+
+bool memory_budget::should_pause(long long conn_bytes, int conn_count)
+{
+    if(conn_bytes < MIN_HEAVY || !over_soft()){
+        return false;
+    }
+    long long average = usage(MEM_CONNECTION) / (conn_count > 0 ? conn_count : 1);
+    return conn_bytes > average * 2;
+}
+
+void memory_budget::pause(int fd)
+{
+    m_locker.lock();
+    m_paused.push_back(std::make_pair(fd, now_ms()));
+    m_paused_count.store(m_paused.size(), std::memory_order_relaxed);
+    m_locker.unlock();
+}
+
+void memory_budget::resume(std::vector<int>& fds)
+{
+    if(paused() == 0){
+        return;
+    }
+    bool all = !over_soft();
+    long long deadline = now_ms() - MAX_PAUSE_MS;
+    m_locker.lock();
+    //按暂停的先后排列，超时的都在前面
+    size_t n = 0;
+    while(n < m_paused.size() && (all || m_paused[n].second <= deadline)){
+        fds.push_back(m_paused[n].first);
+        n++;
+    }
+    m_paused.erase(m_paused.begin(), m_paused.begin() + n);
+    m_paused_count.store(m_paused.size(), std::memory_order_relaxed);
+    m_locker.unlock();
+}
+
+int memory_budget::report(char* buf, size_t len)
+{
+    int n = 0;
+    for(int i = 0; i < MEM_CLASS_COUNT && n < (int)len; i++){
+        n += snprintf(buf + n, len - n, "%s %lld\n", class_names[i], usage(i));
+    }
+    if(n < (int)len){
+        n += snprintf(buf + n, len - n, "total %lld\nsoft_limit %lld\nhard_limit %lld\npaused %d\n",
+                      usage(), m_soft, m_hard, paused());
+    }
+    return n < (int)len ? n : (int)len - 1;
+}
+
+conn_task<bool> memory_budget::status(conn_io& io)
+{
+    const coro_request& req = io.request();
+    char body[512];
+    int body_len = report(body, sizeof(body));
+    char head[256];
+    int len = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: %d\r\n"
+                       "Connection: %s\r\n\r\n", body_len, req.keep_alive ? "keep-alive" : "close");
+    if(!co_await io.write_all(head, len)){
+        co_return false;
+    }
+    co_return co_await io.write_all(body, body_len) && req.keep_alive;
+}
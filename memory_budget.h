@@ -0,0 +1,70 @@
+#ifndef MEMORY_BUDGET_H_INCLUDED
+#define MEMORY_BUDGET_H_INCLUDED
+
+#include <stddef.h>
+#include <atomic>
+#include <vector>
+#include <utility>
+#include "locker.h"
+#include "coro.h"
+
+//动态内存的类别
+enum MEM_CLASS
+{
+    MEM_CONNECTION,     //连接私有的缓冲：HTTP/2会话、WebSocket输入、协程帧池
+    MEM_FILE_CACHE,     //小文件缓存的映射
+    MEM_MICRO_CACHE,    //代理响应的微缓存
+    MEM_WEBSOCKET,      //排队等待发送的WebSocket消息
+    MEM_CLASS_COUNT
+};
+
+//全局内存预算：各子系统在分配与释放时记账，启动时分配的连接表与其中的读写缓冲是固定的，不计入
+//超过软限制时，占用超过平均两倍的连接在等待下一次读取时暂停，对端的数据留在内核的接收缓冲中，由TCP流量控制挡住；
+//超过硬限制时reactor收缩缓存并拒绝新连接，缓存也不再插入新的条目
+class memory_budget
+{
+public:
+    //单位为字节，soft为0时只记账不限制
+    static void configure(long long soft, long long hard);
+    static bool enabled() { return m_soft > 0; }
+
+    //delta为负时表示释放
+    static void charge(int cls, long long delta)
+    {
+        m_usage[cls].fetch_add(delta, std::memory_order_relaxed);
+        m_total.fetch_add(delta, std::memory_order_relaxed);
+    }
+    static long long usage() { return m_total.load(std::memory_order_relaxed); }
+    static long long usage(int cls) { return m_usage[cls].load(std::memory_order_relaxed); }
+    static bool over_soft() { return m_soft > 0 && usage() > m_soft; }
+    static bool over_hard() { return m_hard > 0 && usage() > m_hard; }
+
+    //连接的持有者在等待下一次读取之前调用：超过软限制且该连接占用超过平均的两倍时应当暂停
+    static bool should_pause(long long conn_bytes, int conn_count);
+    //暂停读取的连接此后由reactor持有，直到resume取出
+    static void pause(int fd);
+    //由reactor定期调用：低于软限制时取出全部暂停的连接，否则只取出暂停超过MAX_PAUSE_MS的，由调用者重新注册EPOLLIN
+    static void resume(std::vector<int>& fds);
+    static int paused() { return m_paused_count.load(std::memory_order_relaxed); }
+
+    //文本格式的用量报告，返回写入的长度
+    static int report(char* buf, size_t len);
+    //以text/plain返回用量报告的协程handler
+    static conn_task<bool> status(conn_io& io);
+
+private:
+    //占用低于它的连接不会被暂停
+    static const long long MIN_HEAVY = 16 * 1024;
+    //用量一直降不下来时，暂停的连接每隔这么久仍然读取一次，不会被永久饿死
+    static const int MAX_PAUSE_MS = 1000;
+
+    static long long m_soft;
+    static long long m_hard;
+    static std::atomic<long long> m_usage[MEM_CLASS_COUNT];
+    static std::atomic<long long> m_total;
+    static std::vector<std::pair<int, long long> > m_paused;   //fd与暂停的时间
+    static std::atomic<int> m_paused_count;
+    static locker m_locker;     //保护m_paused
+};
+
+#endif // MEMORY_BUDGET_H_INCLUDED
@@ -0,0 +1,361 @@
+#include "micro_cache.h"
+#include "arena.h"
+#include "memory_budget.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static long long now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+//索引表中一个条目的大约开销：键、值与哈希表节点
+static long long index_cost(const std::string& key, size_t value_size)
+{
+    return (long long)(key.size() + value_size + 64);
+}
+
+void cached_response::release()
+{
+    if(refcnt.fetch_sub(1, std::memory_order_acq_rel) == 1){
+        size_t size = sizeof(cached_response) + head_len + body_len;
+        this->~cached_response();
+        arena_free(this, size);
+        memory_budget::charge(MEM_MICRO_CACHE, -(long long)size);
+    }
+}
+
+micro_cache::micro_cache():
+    m_ttl_ms(0), m_stale_ms(0), m_max_entries(0), m_max_body(0), m_index_bytes(0)
+{
+}
+
+micro_cache::~micro_cache()
+{
+    for(std::unordered_map<std::string, cached_response*>::iterator it = m_entries.begin(); it != m_entries.end(); ++it){
+        it->second->release();
+    }
+    memory_budget::charge(MEM_MICRO_CACHE, -m_index_bytes);
+}
+
+void micro_cache::configure(int ttl_ms, int stale_ms, size_t max_entries, size_t max_body)
+{
+    m_ttl_ms = ttl_ms;
+    m_stale_ms = stale_ms > 0 ? stale_ms : 0;
+    m_max_entries = max_entries;
+    m_max_body = max_body;
+}
+
+std::string micro_cache::vary_of(const std::string& primary)
+{
+    std::string vary;
+    m_locker.lock();
+    std::unordered_map<std::string, std::string>::iterator it = m_vary.find(primary);
+    if(it != m_vary.end()){
+        vary = it->second;
+    }
+    m_locker.unlock();
+    return vary;
+}
+
+cached_response* micro_cache::peek(const std::string& key)
+{
+    cached_response* resp = NULL;
+    long long now = now_ms();
+    m_locker.lock();
+    std::unordered_map<std::string, cached_response*>::iterator it = m_entries.find(key);
+    if(it != m_entries.end() && it->second->fresh_until > now){
+        resp = it->second;
+        resp->acquire();
+    }
+    m_locker.unlock();
+    return resp;
+}
+
+cached_response* micro_cache::lookup(const std::string& key, bool& leader)
+{
+    leader = false;
+    long long now = now_ms();
+    m_locker.lock();
+    std::unordered_map<std::string, cached_response*>::iterator it = m_entries.find(key);
+    if(it != m_entries.end()){
+        cached_response* resp = it->second;
+        if(resp->fresh_until > now || (resp->stale_until > now && m_flights.count(key))){
+            resp->acquire();
+            m_locker.unlock();
+            return resp;
+        }
+        if(resp->stale_until > now){
+            //第一个看到过期条目的请求负责刷新，刷新期间其他请求继续使用旧条目
+            flight* f = new flight();
+            f->waiters = 0;
+            f->finished = false;
+            f->result = NULL;
+            m_flights[key] = f;
+            resp->acquire();
+            m_locker.unlock();
+            leader = true;
+            return resp;
+        }
+        m_entries.erase(it);
+        resp->release();
+    }
+
+    //最近得到过不可缓存的响应，不合并也不生成
+    std::unordered_map<std::string, long long>::iterator pit = m_pass.find(key);
+    if(pit != m_pass.end()){
+        if(pit->second > now){
+            m_locker.unlock();
+            return NULL;
+        }
+        charge_locked(-index_cost(key, sizeof(long long)));
+        m_pass.erase(pit);
+    }
+
+    std::unordered_map<std::string, flight*>::iterator fit = m_flights.find(key);
+    if(fit == m_flights.end()){
+        flight* f = new flight();
+        f->waiters = 0;
+        f->finished = false;
+        f->result = NULL;
+        m_flights[key] = f;
+        m_locker.unlock();
+        leader = true;
+        return NULL;
+    }
+    //等待正在进行的生成，complete已经把flight从表中摘除，最后一个离开的等待者负责释放它
+    flight* f = fit->second;
+    f->waiters++;
+    m_locker.unlock();
+    if(!f->done.timed_wait(WAIT_MS)){
+        m_locker.lock();
+        //超时与complete同时发生时complete已经为这个等待者取得了引用，结果马上就会post
+        if(!f->finished){
+            //flight仍然在表中，由complete负责释放
+            f->waiters--;
+            m_locker.unlock();
+            return NULL;
+        }
+        m_locker.unlock();
+        f->done.wait();
+    }
+    m_locker.lock();
+    cached_response* resp = f->result;
+    bool last = --f->waiters == 0;
+    m_locker.unlock();
+    if(last){
+        delete f;
+    }
+    return resp;
+}
+
+void micro_cache::complete(const std::string& key, cached_response* resp, bool pass)
+{
+    m_locker.lock();
+    if(pass){
+        std::pair<std::unordered_map<std::string, long long>::iterator, bool> ret =
+            m_pass.insert(std::make_pair(key, now_ms() + PASS_MS));
+        if(!ret.second){
+            ret.first->second = now_ms() + PASS_MS;
+        }
+        else if(m_pass.size() > m_max_entries){
+            //标记只是优化，满了就整体丢掉，最坏的情况是这些键再合并一次
+            for(std::unordered_map<std::string, long long>::iterator it = m_pass.begin(); it != m_pass.end(); ++it){
+                charge_locked(-index_cost(it->first, sizeof(long long)));
+            }
+            m_pass.clear();
+        }
+        else{
+            charge_locked(index_cost(key, sizeof(long long)));
+        }
+    }
+    std::unordered_map<std::string, flight*>::iterator fit = m_flights.find(key);
+    flight* f = NULL;
+    if(fit != m_flights.end()){
+        f = fit->second;
+        m_flights.erase(fit);
+    }
+    if(resp){
+        //键中的请求头部来自上一次响应的Vary，与这次不一致时记下新的Vary，这次的响应不存入
+        //没有Vary的主键不占用m_vary
+        std::string primary = key.substr(0, key.find('\n'));
+        std::unordered_map<std::string, std::string>::iterator vit = m_vary.find(primary);
+        const std::string& vary = vit != m_vary.end() ? vit->second : std::string();
+        if(vary == resp->vary){
+            store_locked(key, resp);
+        }
+        else if(resp->vary.empty()){
+            charge_locked(-index_cost(vit->first, vit->second.size()));
+            m_vary.erase(vit);
+        }
+        else if(vit != m_vary.end()){
+            charge_locked((long long)resp->vary.size() - (long long)vit->second.size());
+            vit->second = resp->vary;
+        }
+        else{
+            if(m_vary.size() >= m_max_entries){
+                //与m_entries一样随意淘汰一个，被淘汰的主键下一次响应时重新记下
+                vit = m_vary.begin();
+                charge_locked(-index_cost(vit->first, vit->second.size()));
+                m_vary.erase(vit);
+            }
+            m_vary.insert(std::make_pair(primary, resp->vary));
+            charge_locked(index_cost(primary, resp->vary.size()));
+        }
+    }
+    int waiters = 0;
+    if(f){
+        waiters = f->waiters;
+        f->finished = true;
+        //每个等待者得到一个引用；等待者不匹配Vary也没有关系，它们的请求与生成者的完全相同
+        f->result = waiters > 0 ? resp : NULL;
+        for(int i = 0; resp && i < waiters; i++){
+            resp->acquire();
+        }
+    }
+    m_locker.unlock();
+    if(f && waiters == 0){
+        delete f;
+    }
+    for(int i = 0; i < waiters; i++){
+        f->done.post();
+    }
+}
+
+void micro_cache::shrink()
+{
+    m_locker.lock();
+    for(std::unordered_map<std::string, cached_response*>::iterator it = m_entries.begin(); it != m_entries.end(); ++it){
+        it->second->release();
+    }
+    m_entries.clear();
+    m_vary.clear();
+    m_pass.clear();
+    charge_locked(-m_index_bytes);
+    m_locker.unlock();
+}
+
+void micro_cache::charge_locked(long long delta)
+{
+    m_index_bytes += delta;
+    memory_budget::charge(MEM_MICRO_CACHE, delta);
+}
+
+//淘汰条目时一起忘掉它的主键的Vary，同一主键的其他变体在下一次生成时重新记下
+void micro_cache::forget_vary_locked(const std::string& key)
+{
+    std::unordered_map<std::string, std::string>::iterator it = m_vary.find(key.substr(0, key.find('\n')));
+    if(it != m_vary.end()){
+        charge_locked(-index_cost(it->first, it->second.size()));
+        m_vary.erase(it);
+    }
+}
+
+void micro_cache::store_locked(const std::string& key, cached_response* resp)
+{
+    resp->acquire();
+    std::pair<std::unordered_map<std::string, cached_response*>::iterator, bool> ret =
+        m_entries.insert(std::make_pair(key, resp));
+    if(!ret.second){
+        ret.first->second->release();
+        ret.first->second = resp;
+        return;
+    }
+    if(m_entries.size() <= m_max_entries){
+        return;
+    }
+    //条目过多时先清掉已经完全过期的，仍然过多时随意淘汰一个
+    long long now = now_ms();
+    for(std::unordered_map<std::string, cached_response*>::iterator it = m_entries.begin(); it != m_entries.end(); ){
+        if(it->second->stale_until <= now && it->second != resp){
+            it->second->release();
+            forget_vary_locked(it->first);
+            it = m_entries.erase(it);
+        }
+        else{
+            ++it;
+        }
+    }
+    if(m_entries.size() > m_max_entries){
+        std::unordered_map<std::string, cached_response*>::iterator it = m_entries.begin();
+        if(it->second == resp){
+            ++it;
+        }
+        it->second->release();
+        forget_vary_locked(it->first);
+        m_entries.erase(it);
+    }
+}
+
+//查找Cache-Control中的"name=数字"，负数按0处理
+static long long directive_seconds(const std::string& cc, const char* name)
+{
+    size_t n = strlen(name);
+    for(size_t pos = cc.find(name); pos != std::string::npos; pos = cc.find(name, pos + 1)){
+        if((pos == 0 || (!isalnum((unsigned char)cc[pos - 1]) && cc[pos - 1] != '-')) &&
+           pos + n < cc.size() && cc[pos + n] == '='){
+            long long seconds = strtoll(cc.c_str() + pos + n + 1, NULL, 10);
+            return seconds > 0 ? seconds : 0;
+        }
+    }
+    return -1;
+}
+
+bool micro_cache::cacheable(int status, long long content_length, const std::string& cache_control,
+                            const std::string& vary, bool set_cookie, int& ttl_ms) const
+{
+    if(!enabled() || status != 200 || content_length < 0 || (size_t)content_length > m_max_body ||
+       set_cookie || vary.find('*') != std::string::npos){
+        return false;
+    }
+    ttl_ms = m_ttl_ms;
+    if(cache_control.empty()){
+        return true;
+    }
+    //cache_control已经转为小写
+    if(cache_control.find("no-store") != std::string::npos || cache_control.find("no-cache") != std::string::npos ||
+       cache_control.find("private") != std::string::npos){
+        return false;
+    }
+    long long seconds = directive_seconds(cache_control, "s-maxage");
+    if(seconds < 0){
+        seconds = directive_seconds(cache_control, "max-age");
+    }
+    if(seconds == 0){
+        return false;
+    }
+    //strtoll在溢出时返回LLONG_MAX，先与上限比较再乘，结果一定放得进int
+    if(seconds > 0){
+        ttl_ms = seconds < MAX_TTL_MS / 1000 ? (int)seconds * 1000 : MAX_TTL_MS;
+    }
+    return true;
+}
+
+cached_response* micro_cache::create(const std::string& head, const std::string& body, const std::string& vary, int ttl_ms) const
+{
+    //超过内存的硬限制时与分配失败一样，响应直接转发而不缓存
+    if(memory_budget::over_hard()){
+        return NULL;
+    }
+    size_t size = sizeof(cached_response) + head.size() + body.size();
+    void* p = arena_alloc(size);
+    if(!p){
+        return NULL;
+    }
+    memory_budget::charge(MEM_MICRO_CACHE, size);
+    cached_response* resp = new(p) cached_response;
+    resp->refcnt = 1;
+    resp->head_len = head.size();
+    resp->body_len = body.size();
+    memcpy((char*)resp->head(), head.data(), head.size());
+    memcpy((char*)resp->body(), body.data(), body.size());
+    resp->vary = vary;
+    resp->fresh_until = now_ms() + ttl_ms;
+    resp->stale_until = resp->fresh_until + m_stale_ms;
+    return resp;
+}
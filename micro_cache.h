@@ -0,0 +1,100 @@
+#ifndef MICRO_CACHE_H_INCLUDED
+#define MICRO_CACHE_H_INCLUDED
+
+#include <stddef.h>
+#include <atomic>
+#include <string>
+#include <unordered_map>
+#include "locker.h"
+
+//代理响应的微缓存：热门的动态url在很短的时间内直接从内存应答
+//同一个键同时只有一个请求向上游生成响应，其他请求等待它的结果，避免缓存过期瞬间所有工作线程一起访问上游
+//等待有时间上限，上游慢时等待者各自转发；不可缓存的键记住一小段时间，期间的请求不再排队等待
+//允许过期后的一段时间内先用旧响应应答，由一个请求在后台刷新
+
+//缓存的响应，创建后不再修改，可以同时被多个连接writev发送
+//头部与响应体紧跟在结构之后，整个条目是一次arena分配
+struct cached_response
+{
+    std::atomic<int> refcnt;
+    std::string vary;           //响应的Vary头部，小写，逗号分隔
+    long long fresh_until;      //毫秒，CLOCK_MONOTONIC
+    long long stale_until;
+    size_t head_len;
+    size_t body_len;
+
+    //状态行与头部，每行以\r\n结尾，不含Connection头部与结尾空行
+    const char* head() const { return (const char*)(this + 1); }
+    const char* body() const { return head() + head_len; }
+    void acquire() { refcnt.fetch_add(1, std::memory_order_relaxed); }
+    void release();
+};
+
+class micro_cache
+{
+public:
+    micro_cache();
+    ~micro_cache();
+
+    //ttl_ms为响应没有Cache-Control时的缓存时间，stale_ms为过期后仍可用旧响应应答的时间
+    void configure(int ttl_ms, int stale_ms, size_t max_entries = 10000, size_t max_body = 256 * 1024);
+    bool enabled() const { return m_ttl_ms > 0; }
+
+    //主键为方法、主机与url；之前的响应带有Vary时返回它列出的请求头部，调用者把这些头部的值加入完整的键
+    std::string vary_of(const std::string& primary);
+    //不等待也不选举的查找，只返回新鲜的条目，供reactor线程使用
+    cached_response* peek(const std::string& key);
+    //返回的条目带有一个引用，leader为true时调用者必须调用complete：
+    //新鲜条目：返回条目，leader为false
+    //过期但在stale时间内：返回旧条目，没有其他请求在刷新时leader为true，由调用者应答后刷新
+    //未命中：已有请求在生成时最多等待WAIT_MS，返回它的结果，生成失败、超时或者键最近不可缓存时返回NULL且leader为false，
+    //        调用者直接转发；否则返回NULL且leader为true，由调用者生成
+    cached_response* lookup(const std::string& key, bool& leader);
+    //生成结束，resp为NULL表示失败或不可缓存，pass为true表示上游的响应不可缓存，之后PASS_MS内的请求不再合并；
+    //不消耗调用者持有的引用
+    void complete(const std::string& key, cached_response* resp, bool pass = false);
+
+    //根据上游的响应头判断是否可以缓存，可以时给出缓存时间
+    bool cacheable(int status, long long content_length, const std::string& cache_control,
+                   const std::string& vary, bool set_cookie, int& ttl_ms) const;
+    //创建条目，内存不足时返回NULL
+    cached_response* create(const std::string& head, const std::string& body, const std::string& vary, int ttl_ms) const;
+    //内存超过硬限制时由reactor调用：丢弃所有条目，正在发送的响应在最后一个引用释放后回收
+    void shrink();
+
+private:
+    //正在进行的生成，等待者在sem上等待
+    struct flight
+    {
+        sem done;
+        int waiters;
+        bool finished;          //complete已经为每个等待者准备了结果
+        cached_response* result;
+    };
+
+    void store_locked(const std::string& key, cached_response* resp);
+    //m_vary与m_pass的条目计入MEM_MICRO_CACHE，delta为字节数
+    void charge_locked(long long delta);
+    void forget_vary_locked(const std::string& key);
+
+    //上游的max-age再长，条目也只缓存这么久，微缓存只用来吸收突发的重复请求
+    static const int MAX_TTL_MS = 60 * 1000;
+    //等待者等待生成者的上限，超过后自己转发，不让一个慢的键占住所有工作线程
+    static const int WAIT_MS = 1000;
+    //不可缓存的键在这么久之内直接转发
+    static const int PASS_MS = 5000;
+
+private:
+    int m_ttl_ms;
+    int m_stale_ms;
+    size_t m_max_entries;
+    size_t m_max_body;
+    std::unordered_map<std::string, cached_response*> m_entries;
+    std::unordered_map<std::string, std::string> m_vary;
+    std::unordered_map<std::string, flight*> m_flights;
+    std::unordered_map<std::string, long long> m_pass;     //不可缓存的键，值为标记失效的时间
+    long long m_index_bytes;        //m_vary与m_pass已经计入预算的字节数
+    locker m_locker;        //保护以上四个表与m_index_bytes
+};
+
+#endif // MICRO_CACHE_H_INCLUDED
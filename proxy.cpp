@@ -0,0 +1,908 @@
+#include "proxy.h"
+#include "micro_cache.h"
+#include "memory_budget.h"
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+std::vector<proxy_route*> proxy::m_routes;
+bool proxy::m_least_outstanding = false;
+
+//连接上游的超时与读写上游的超时
+static const int CONNECT_TIMEOUT_MS = 1000;
+static const int IO_TIMEOUT_MS = 30000;
+//客户端写满时工作线程最多等待这么久，之后剩余的响应由reactor在客户端可写时交回工作线程继续转发
+static const int CLIENT_WAIT_MS = 100;
+//转发请求体时等待客户端下一段数据的超时
+static const int BODY_TIMEOUT_MS = 5000;
+//连续失败这么多次后，后端在DOWN_SECONDS秒内不再被选中
+static const int MAX_FAILS = 3;
+static const int DOWN_SECONDS = 10;
+//每个后端最多保留的空闲连接
+static const size_t MAX_IDLE = 64;
+//上游响应头的最大长度
+static const int HEAD_BUFFER_SIZE = 8192;
+//一次splice搬运的最大字节数
+static const size_t SPLICE_CHUNK = 64 * 1024;
+
+bool proxy::add_route(const char* spec)
+{
+    const char* eq = strchr(spec, '=');
+    if(!eq || eq == spec || spec[0] != '/'){
+        return false;
+    }
+    proxy_route* route = new proxy_route;
+    route->prefix.assign(spec, eq - spec);
+    route->next = 0;
+    std::string list(eq + 1);
+    size_t pos = 0;
+    while(pos <= list.size()){
+        size_t comma = list.find(',', pos);
+        if(comma == std::string::npos){
+            comma = list.size();
+        }
+        std::string item = list.substr(pos, comma - pos);
+        pos = comma + 1;
+        size_t colon = item.rfind(':');
+        if(colon == std::string::npos){
+            delete route;
+            return false;
+        }
+        upstream* up = new upstream;
+        memset(&up->addr, 0, sizeof(up->addr));
+        up->addr.sin_family = AF_INET;
+        up->addr.sin_port = htons(atoi(item.c_str() + colon + 1));
+        if(inet_pton(AF_INET, item.substr(0, colon).c_str(), &up->addr.sin_addr) != 1){
+            delete up;
+            delete route;
+            return false;
+        }
+        up->name = item;
+        up->outstanding = 0;
+        up->fails = 0;
+        up->down_until = 0;
+        route->backends.push_back(up);
+    }
+    m_routes.push_back(route);
+    return true;
+}
+
+proxy_route* proxy::match(const char* url)
+{
+    proxy_route* best = NULL;
+    for(size_t i = 0; i < m_routes.size(); i++){
+        const std::string& prefix = m_routes[i]->prefix;
+        if(strncmp(url, prefix.c_str(), prefix.size()) == 0 &&
+           (!best || prefix.size() > best->prefix.size())){
+            best = m_routes[i];
+        }
+    }
+    return best;
+}
+
+//选择一个健康的后端；全部不健康时仍然轮询尝试，避免后端恢复后永远不被选中
+upstream* proxy::pick(proxy_route* route)
+{
+    size_t n = route->backends.size();
+    long now = time(NULL);
+    unsigned start = route->next++;
+    upstream* best = NULL;
+    for(size_t i = 0; i < n; i++){
+        upstream* up = route->backends[(start + i) % n];
+        if(up->down_until > now){
+            continue;
+        }
+        if(!m_least_outstanding){
+            return up;
+        }
+        if(!best || up->outstanding < best->outstanding){
+            best = up;
+        }
+    }
+    return best ? best : route->backends[start % n];
+}
+
+//取出一个可用的上游连接，优先复用空闲连接
+int proxy::checkout(upstream* up, bool& reused)
+{
+    while(true){
+        up->idle_locker.lock();
+        if(up->idle.empty()){
+            up->idle_locker.unlock();
+            break;
+        }
+        int fd = up->idle.back();
+        up->idle.pop_back();
+        up->idle_locker.unlock();
+        //空闲期间上游可能已经关闭了连接，此时可读且读到0
+        char c;
+        ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+            reused = true;
+            return fd;
+        }
+        close(fd);
+    }
+
+    reused = false;
+    int fd = socket(PF_INET, SOCK_STREAM, 0);
+    if(fd < 0){
+        return -1;
+    }
+    //阻塞socket上connect同样受SO_SNDTIMEO限制
+    struct timeval tv = {CONNECT_TIMEOUT_MS / 1000, (CONNECT_TIMEOUT_MS % 1000) * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if(connect(fd, (struct sockaddr*)&up->addr, sizeof(up->addr)) < 0){
+        printf("proxy: connect %s failed, errno is:%d\n", up->name.c_str(), errno);
+        close(fd);
+        return -1;
+    }
+    tv.tv_sec = IO_TIMEOUT_MS / 1000;
+    tv.tv_usec = (IO_TIMEOUT_MS % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return fd;
+}
+
+void proxy::checkin(upstream* up, int fd)
+{
+    up->idle_locker.lock();
+    if(up->idle.size() < MAX_IDLE){
+        up->idle.push_back(fd);
+        fd = -1;
+    }
+    up->idle_locker.unlock();
+    if(fd >= 0){
+        close(fd);
+    }
+}
+
+//记录后端的健康状况
+void proxy::mark(upstream* up, bool ok)
+{
+    if(ok){
+        up->fails = 0;
+        return;
+    }
+    if(++up->fails >= MAX_FAILS){
+        printf("proxy: backend %s marked down\n", up->name.c_str());
+        up->down_until = time(NULL) + DOWN_SECONDS;
+        up->fails = 0;
+    }
+}
+
+//向阻塞的上游socket写入全部数据
+static bool send_upstream(int fd, const char* buf, size_t len)
+{
+    while(len > 0){
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if(n <= 0){
+            if(n < 0 && errno == EINTR){
+                continue;
+            }
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+//短暂等待非阻塞的客户端socket可写
+static bool wait_writable(int fd)
+{
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+    int ret = poll(&pfd, 1, CLIENT_WAIT_MS);
+    return ret > 0 && !(pfd.revents & (POLLERR | POLLHUP));
+}
+
+//从非阻塞的客户端socket读取请求体，超时或出错时返回-1，客户端关闭时返回0
+static ssize_t recv_client(int fd, const proxy_request& req, char* buf, size_t len)
+{
+    while(true){
+        ssize_t n = req.reader ? req.reader(req.io_ctx, buf, len) : recv(fd, buf, len, 0);
+        if(n >= 0){
+            return n;
+        }
+        if(errno == EINTR){
+            continue;
+        }
+        if(errno != EAGAIN){
+            return -1;
+        }
+        //对端关闭时POLLIN与POLLHUP一起返回，再读一次得到0
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if(poll(&pfd, 1, BODY_TIMEOUT_MS) <= 0){
+            return -1;
+        }
+    }
+}
+
+//每个工作线程一个管道，用于splice
+static thread_local int splice_pipe[2] = {-1, -1};
+
+static void reset_pipe()
+{
+    if(splice_pipe[0] >= 0){
+        close(splice_pipe[0]);
+        close(splice_pipe[1]);
+    }
+    splice_pipe[0] = splice_pipe[1] = -1;
+}
+
+//把管道中剩余的len字节读到pending的末尾
+static bool drain_pipe(size_t len, std::string& pending)
+{
+    size_t off = pending.size();
+    pending.resize(off + len);
+    while(len > 0){
+        ssize_t n = read(splice_pipe[0], &pending[off], len);
+        if(n <= 0){
+            if(n < 0 && errno == EINTR){
+                continue;
+            }
+            reset_pipe();
+            return false;
+        }
+        off += n;
+        len -= n;
+    }
+    return true;
+}
+
+//用splice把上游socket上的left字节经过管道搬到客户端socket
+//客户端写满时把管道中剩余的数据读到pending后返回，管道属于当前线程，不能留给之后继续转发的线程
+//返回1表示没有出错，0表示上游出错，-1表示客户端出错
+static int splice_body(int from, int to, long long& left, std::string& pending)
+{
+    if(splice_pipe[0] < 0 && pipe2(splice_pipe, O_CLOEXEC) < 0){
+        return 0;
+    }
+    while(left > 0){
+        ssize_t in = splice(from, NULL, splice_pipe[1], NULL, left < (long long)SPLICE_CHUNK ? left : SPLICE_CHUNK,
+                            SPLICE_F_MOVE | SPLICE_F_MORE);
+        if(in <= 0){
+            if(in < 0 && errno == EINTR){
+                continue;
+            }
+            reset_pipe();
+            return 0;
+        }
+        left -= in;
+        while(in > 0){
+            ssize_t out = splice(splice_pipe[0], NULL, to, NULL, in, SPLICE_F_MOVE | SPLICE_F_MORE | SPLICE_F_NONBLOCK);
+            if(out < 0){
+                if(errno == EINTR || (errno == EAGAIN && wait_writable(to))){
+                    continue;
+                }
+                if(errno == EAGAIN){
+                    return drain_pipe(in, pending) ? 1 : -1;
+                }
+                //管道中残留的数据不能留给下一个请求
+                reset_pipe();
+                return -1;
+            }
+            in -= out;
+        }
+    }
+    return 1;
+}
+
+//跟踪chunked编码的响应体，判断响应在何处结束
+struct chunk_tracker
+{
+    enum STATE { SIZE, SIZE_EXT, SIZE_LF, DATA, DATA_CR, DATA_LF,
+                 TRAILER_START, TRAILER_LINE, TRAILER_LF, FINAL_LF, DONE, ERROR };
+    STATE state;
+    unsigned long long left;
+
+    chunk_tracker(): state(SIZE), left(0) {}
+
+    //消费数据，返回被消费的字节数，到达DONE或ERROR时停止
+    size_t feed(const char* p, size_t n)
+    {
+        size_t i = 0;
+        while(i < n && state != DONE && state != ERROR){
+            char c = p[i];
+            switch(state)
+            {
+            case SIZE:
+                if(isxdigit((unsigned char)c)){
+                    left = left * 16 + (isdigit((unsigned char)c) ? c - '0' : (tolower(c) - 'a' + 10));
+                }
+                else if(c == '\r'){
+                    state = SIZE_LF;
+                }
+                else{
+                    state = SIZE_EXT;
+                }
+                i++;
+                break;
+            case SIZE_EXT:
+                if(c == '\r'){
+                    state = SIZE_LF;
+                }
+                i++;
+                break;
+            case SIZE_LF:
+                state = c != '\n' ? ERROR : (left == 0 ? TRAILER_START : DATA);
+                i++;
+                break;
+            case DATA:
+            {
+                size_t take = n - i < left ? n - i : (size_t)left;
+                left -= take;
+                i += take;
+                if(left == 0){
+                    state = DATA_CR;
+                }
+                break;
+            }
+            case DATA_CR:
+                state = c == '\r' ? DATA_LF : ERROR;
+                i++;
+                break;
+            case DATA_LF:
+                state = c == '\n' ? SIZE : ERROR;
+                i++;
+                break;
+            case TRAILER_START:
+                state = c == '\r' ? FINAL_LF : TRAILER_LINE;
+                i++;
+                break;
+            case TRAILER_LINE:
+                if(c == '\r'){
+                    state = TRAILER_LF;
+                }
+                i++;
+                break;
+            case TRAILER_LF:
+                state = c == '\n' ? TRAILER_START : ERROR;
+                i++;
+                break;
+            case FINAL_LF:
+                state = c == '\n' ? DONE : ERROR;
+                i++;
+                break;
+            default:
+                break;
+            }
+        }
+        return i;
+    }
+};
+
+//响应体的边界
+enum BODY_MODE { BODY_NONE, BODY_LENGTH, BODY_CHUNKED, BODY_UNTIL_CLOSE };
+
+//响应头之后的转发进度；客户端写满时复制一份保存在连接中，客户端可写后由工作线程继续
+struct proxy_relay
+{
+    upstream* up;
+    int fd;                     //上游连接，响应体全部读出之后为-1
+    BODY_MODE mode;
+    long long left;             //BODY_LENGTH时上游还没有读出的字节数
+    chunk_tracker tracker;      //BODY_CHUNKED时的解析状态
+    bool upstream_close;        //响应结束后不能复用上游连接
+    bool client_close;          //响应结束后关闭客户端连接
+    ssize_t (*writer)(void* ctx, const char* buf, size_t len);
+    void* io_ctx;
+    std::string pending;        //已经从上游读出、还没有写给客户端的数据
+    long long charged;          //保存在连接中时计入MEM_CONNECTION的字节数
+};
+
+static bool body_complete(const proxy_relay& r)
+{
+    return r.mode == BODY_NONE || (r.mode == BODY_LENGTH && r.left == 0) ||
+           (r.mode == BODY_CHUNKED && r.tracker.state == chunk_tracker::DONE);
+}
+
+//向非阻塞的客户端socket写数据，写满时最多等待CLIENT_WAIT_MS，返回写入的字节数，出错时返回-1
+static ssize_t send_client(int fd, const proxy_relay& r, const char* buf, size_t len)
+{
+    size_t done = 0;
+    while(done < len){
+        ssize_t n = r.writer ? r.writer(r.io_ctx, buf + done, len - done) : send(fd, buf + done, len - done, MSG_NOSIGNAL);
+        if(n < 0){
+            if(errno == EINTR || (errno == EAGAIN && wait_writable(fd))){
+                continue;
+            }
+            if(errno == EAGAIN){
+                break;
+            }
+            return -1;
+        }
+        done += n;
+    }
+    return done;
+}
+
+//向客户端写数据，写不完的部分追加到pending，此后的数据只能排在它后面；后台刷新时没有客户端
+//返回false表示客户端出错
+static bool deliver(proxy_relay& r, int fd, const char* buf, size_t len)
+{
+    if(fd < 0 || len == 0){
+        return true;
+    }
+    if(!r.pending.empty()){
+        r.pending.append(buf, len);
+        return true;
+    }
+    ssize_t n = send_client(fd, r, buf, len);
+    if(n < 0){
+        return false;
+    }
+    r.pending.append(buf + n, len - n);
+    return true;
+}
+
+//把暂停的转发保存到堆上，由连接持有
+static proxy_relay* park(const proxy_relay& r)
+{
+    proxy_relay* saved = new proxy_relay(r);
+    saved->charged = sizeof(proxy_relay) + saved->pending.capacity();
+    memory_budget::charge(MEM_CONNECTION, saved->charged);
+    return saved;
+}
+
+static void unpark(proxy_relay* relay)
+{
+    memory_budget::charge(MEM_CONNECTION, -relay->charged);
+    delete relay;
+}
+
+//发送请求体：先发送读缓冲中的部分，其余部分从客户端读出后转发；streamed记录是否已经从客户端读过数据
+//返回1表示成功，0表示上游出错，-1表示客户端出错
+static int send_body(int fd, int client_fd, const proxy_request& req, bool& streamed)
+{
+    char buf[HEAD_BUFFER_SIZE];
+    if(!req.body_chunked){
+        if(req.body_len > 0 && !send_upstream(fd, req.body, req.body_len)){
+            return 0;
+        }
+        long long left = req.body_left;
+        while(left > 0){
+            ssize_t n = recv_client(client_fd, req, buf, left < (long long)sizeof(buf) ? left : sizeof(buf));
+            if(n <= 0){
+                return -1;
+            }
+            streamed = true;
+            left -= n;
+            if(!send_upstream(fd, buf, n)){
+                return 0;
+            }
+        }
+        return 1;
+    }
+    //chunked编码原样转发，由chunk_tracker判断请求体在何处结束，之后的数据不属于这个请求
+    chunk_tracker tracker;
+    size_t used = tracker.feed(req.body, req.body_len);
+    if(!send_upstream(fd, req.body, used)){
+        return 0;
+    }
+    while(tracker.state != chunk_tracker::DONE && tracker.state != chunk_tracker::ERROR){
+        ssize_t n = recv_client(client_fd, req, buf, sizeof(buf));
+        if(n <= 0){
+            return -1;
+        }
+        streamed = true;
+        used = tracker.feed(buf, n);
+        if(!send_upstream(fd, buf, used)){
+            return 0;
+        }
+    }
+    return tracker.state == chunk_tracker::DONE ? 1 : -1;
+}
+
+//上游响应头中我们关心的字段
+struct response_head
+{
+    int status;
+    long long content_length;   //-1表示没有
+    bool chunked;
+    bool close;                 //上游要求关闭连接
+    bool set_cookie;
+    std::string cache_control;  //小写
+    std::string vary;           //小写，去掉空白
+    std::string forwarded;      //去掉逐跳头部之后，转发给客户端的状态行与头部，不含结尾空行
+};
+
+static bool is_hop_header(const char* line, size_t len)
+{
+    static const char* hops[] = {"Connection:", "Keep-Alive:", "Proxy-Connection:", "TE:",
+                                 "Trailer:", "Upgrade:", "Transfer-Encoding:"};
+    for(size_t i = 0; i < sizeof(hops) / sizeof(hops[0]); i++){
+        size_t n = strlen(hops[i]);
+        if(len >= n && strncasecmp(line, hops[i], n) == 0){
+            return true;
+        }
+    }
+    return false;
+}
+
+//解析上游的响应头，head为以"\r\n\r\n"结尾的数据
+static bool parse_response_head(const char* head, size_t len, response_head& out)
+{
+    out.status = 0;
+    out.content_length = -1;
+    out.chunked = false;
+    out.close = false;
+    out.set_cookie = false;
+    out.cache_control.clear();
+    out.vary.clear();
+    out.forwarded.clear();
+    if(len < 12 || strncmp(head, "HTTP/1.", 7) != 0){
+        return false;
+    }
+    out.status = atoi(head + 9);
+    //HTTP/1.0的上游默认不保持连接
+    out.close = head[7] == '0';
+    const char* end = head + len;
+    const char* line = head;
+    bool first = true;
+    while(line < end){
+        const char* eol = (const char*)memmem(line, end - line, "\r\n", 2);
+        if(!eol || eol == line){
+            break;
+        }
+        size_t n = eol - line;
+        if(first){
+            first = false;
+        }
+        else if(n > 15 && strncasecmp(line, "Content-Length:", 15) == 0){
+            out.content_length = atoll(line + 15);
+        }
+        else if(n > 18 && strncasecmp(line, "Transfer-Encoding:", 18) == 0){
+            out.chunked = memmem(line, n, "chunked", 7) != NULL;
+        }
+        else if(n > 11 && strncasecmp(line, "Connection:", 11) == 0){
+            if(memmem(line, n, "close", 5)){
+                out.close = true;
+            }
+            else if(memmem(line, n, "keep-alive", 10)){
+                out.close = false;
+            }
+        }
+        else if(n > 14 && strncasecmp(line, "Cache-Control:", 14) == 0){
+            for(const char* c = line + 14; c < eol; c++){
+                out.cache_control += tolower((unsigned char)*c);
+            }
+        }
+        else if(n > 5 && strncasecmp(line, "Vary:", 5) == 0){
+            for(const char* c = line + 5; c < eol; c++){
+                if(!isspace((unsigned char)*c)){
+                    out.vary += tolower((unsigned char)*c);
+                }
+            }
+        }
+        else if(n > 11 && strncasecmp(line, "Set-Cookie:", 11) == 0){
+            out.set_cookie = true;
+        }
+        //chunked编码原样转发，因此保留Transfer-Encoding
+        if(!is_hop_header(line, n) || (n > 18 && strncasecmp(line, "Transfer-Encoding:", 18) == 0)){
+            out.forwarded.append(line, n);
+            out.forwarded.append("\r\n");
+        }
+        line = eol + 2;
+    }
+    return out.status >= 100;
+}
+
+std::string proxy::build_request(const proxy_request& req)
+{
+    std::string head;
+    head.reserve(512);
+    head.append(req.method).append(" ").append(req.url).append(" HTTP/1.1\r\n");
+    //读缓冲中每个头部以'\0'结尾，跳过行之间多余的'\0'
+    const char* p = req.headers;
+    while(p < req.headers_end){
+        size_t n = strlen(p);
+        //chunked请求体同时带有Content-Length时只转发Transfer-Encoding，上游不会对请求体的边界产生分歧
+        bool length = req.body_chunked && n > 15 && strncasecmp(p, "Content-Length:", 15) == 0;
+        if(n > 0 && !is_hop_header(p, n) && !length){
+            head.append(p, n).append("\r\n");
+        }
+        p += n + 1;
+    }
+    if(req.body_chunked){
+        head.append("Transfer-Encoding: chunked\r\n");
+    }
+    char addr[INET_ADDRSTRLEN];
+    struct in_addr in;
+    in.s_addr = req.client_addr;
+    inet_ntop(AF_INET, &in, addr, sizeof(addr));
+    head.append("X-Forwarded-For: ").append(addr).append("\r\n");
+    head.append("Connection: keep-alive\r\n\r\n");
+    return head;
+}
+
+proxy::RESULT proxy::forward(proxy_route* route, int client_fd, const proxy_request& req, proxy_relay** parked,
+                             micro_cache* cache, cached_response** fill)
+{
+    return exchange(route, client_fd, &req, build_request(req), parked, cache, fill);
+}
+
+cached_response* proxy::fetch(proxy_route* route, const std::string& request, micro_cache* cache)
+{
+    cached_response* resp = NULL;
+    exchange(route, -1, NULL, request, NULL, cache, &resp);
+    return resp;
+}
+
+proxy::RESULT proxy::exchange(proxy_route* route, int client_fd, const proxy_request* req, const std::string& request,
+                              proxy_relay** parked, micro_cache* cache, cached_response** fill)
+{
+    //只缓存GET，后台刷新的请求也一定是GET
+    bool no_body_method = req && strcmp(req->method, "HEAD") == 0;
+    bool may_cache = fill && cache && (!req || strcmp(req->method, "GET") == 0);
+    //已经从客户端读过请求体之后不能再换一个连接重发
+    bool streamed = false;
+
+    //复用的连接可能恰好被上游关闭，此时换一个连接重试一次
+    for(int attempt = 0; attempt < 2; attempt++){
+        upstream* up = pick(route);
+        bool reused = false;
+        int fd = checkout(up, reused);
+        if(fd < 0){
+            mark(up, false);
+            continue;
+        }
+        up->outstanding++;
+
+        //发送请求并读取完整的响应头
+        char buf[HEAD_BUFFER_SIZE];
+        size_t got = 0;
+        size_t head_len = 0;
+        bool sent = send_upstream(fd, request.data(), request.size());
+        if(sent && req){
+            int ret = send_body(fd, client_fd, *req, streamed);
+            if(ret < 0){
+                //客户端没有发完请求体，不是上游的问题
+                close(fd);
+                up->outstanding--;
+                return CLOSE;
+            }
+            sent = ret > 0;
+        }
+        response_head head;
+        bool parsed = false;
+        bool interim = false;
+        while(sent){
+            //丢弃中间响应之后缓冲中可能已经有完整的响应头
+            const char* end = (const char*)memmem(buf, got, "\r\n\r\n", 4);
+            while(!end && got < sizeof(buf)){
+                ssize_t n = recv(fd, buf + got, sizeof(buf) - got, 0);
+                if(n <= 0){
+                    if(n < 0 && errno == EINTR){
+                        continue;
+                    }
+                    break;
+                }
+                got += n;
+                end = (const char*)memmem(buf, got, "\r\n\r\n", 4);
+            }
+            if(end){
+                head_len = end + 4 - buf;
+            }
+            if(head_len == 0 || !parse_response_head(buf, head_len, head)){
+                break;
+            }
+            if(head.status >= 200){
+                parsed = true;
+                break;
+            }
+            //发给上游的请求去掉了Upgrade，上游不应该切换协议
+            if(head.status == 101){
+                printf("proxy: backend %s switched protocols unexpectedly\n", up->name.c_str());
+                break;
+            }
+            //100 Continue、103 Early Hints等中间响应不转发，丢弃后继续读取最终的响应头
+            interim = true;
+            got -= head_len;
+            memmove(buf, buf + head_len, got);
+            head_len = 0;
+        }
+        if(!parsed){
+            close(fd);
+            up->outstanding--;
+            //复用连接上一个字节都没有读到，多半是上游已关闭了空闲连接，不算作后端故障，换一个连接重试
+            //否则上游可能已经处理了请求，不能重发
+            if(reused && got == 0 && !interim && !streamed){
+                continue;
+            }
+            mark(up, false);
+            return BAD_GATEWAY;
+        }
+
+        bool no_body = no_body_method || head.status == 204 || head.status == 304;
+        bool delimited = no_body || head.content_length >= 0 || head.chunked;
+        proxy_relay r;
+        r.up = up;
+        r.fd = fd;
+        r.mode = no_body ? BODY_NONE : (head.content_length >= 0 ? BODY_LENGTH : (head.chunked ? BODY_CHUNKED : BODY_UNTIL_CLOSE));
+        r.left = 0;
+        //没有长度的响应以上游关闭连接为结束
+        r.upstream_close = head.close || r.mode == BODY_UNTIL_CLOSE;
+        r.client_close = !req || !req->keep_alive || !delimited;
+        r.writer = req ? req->writer : NULL;
+        r.io_ctx = req ? req->io_ctx : NULL;
+        r.charged = 0;
+        const char* rest = buf + head_len;
+        size_t rest_len = got - head_len;
+        int ttl_ms = 0;
+        bool capture = may_cache &&
+                       cache->cacheable(head.status, head.content_length, head.cache_control, head.vary, head.set_cookie, ttl_ms);
+
+        if(!capture && client_fd < 0){
+            //后台刷新得到不可缓存的响应，直接放弃这个上游连接
+            close(fd);
+            up->outstanding--;
+            mark(up, true);
+            return CLOSE;
+        }
+        RESULT ret;
+        if(capture){
+            //可以缓存的响应体不大，先完整读入内存，再与响应头一起生成缓存条目
+            std::string body(rest, rest_len < (size_t)head.content_length ? rest_len : head.content_length);
+            while(body.size() < (size_t)head.content_length){
+                size_t want = head.content_length - body.size();
+                ssize_t n = recv(fd, buf, want < sizeof(buf) ? want : sizeof(buf), 0);
+                if(n <= 0){
+                    if(n < 0 && errno == EINTR){
+                        continue;
+                    }
+                    //还没有向客户端发送任何数据
+                    close(fd);
+                    up->outstanding--;
+                    mark(up, false);
+                    return BAD_GATEWAY;
+                }
+                body.append(buf, n);
+            }
+            *fill = cache->create(head.forwarded, body, head.vary, ttl_ms);
+            r.mode = BODY_NONE;
+            head.forwarded.append(r.client_close ? "Connection: close\r\n\r\n" : "Connection: keep-alive\r\n\r\n");
+            bool client_ok = deliver(r, client_fd, head.forwarded.data(), head.forwarded.size()) &&
+                             deliver(r, client_fd, body.data(), body.size());
+            ret = finish(r, true, client_ok);
+        }
+        else{
+            //从这里开始已经向客户端发送数据，任何失败都只能关闭客户端连接
+            head.forwarded.append(r.client_close ? "Connection: close\r\n\r\n" : "Connection: keep-alive\r\n\r\n");
+            bool client_ok = deliver(r, client_fd, head.forwarded.data(), head.forwarded.size());
+            bool upstream_ok = true;
+            //响应头之后已经读到的部分
+            if(r.mode == BODY_LENGTH){
+                size_t first = rest_len < (size_t)head.content_length ? rest_len : head.content_length;
+                r.left = head.content_length - first;
+                client_ok = client_ok && deliver(r, client_fd, rest, first);
+            }
+            else if(r.mode == BODY_CHUNKED){
+                size_t used = r.tracker.feed(rest, rest_len);
+                upstream_ok = r.tracker.state != chunk_tracker::ERROR;
+                client_ok = client_ok && deliver(r, client_fd, rest, used);
+            }
+            else if(r.mode == BODY_UNTIL_CLOSE){
+                client_ok = client_ok && deliver(r, client_fd, rest, rest_len);
+            }
+            ret = client_ok && upstream_ok ? relay(r, client_fd) : finish(r, upstream_ok, client_ok);
+        }
+        if(ret == PENDING){
+            *parked = park(r);
+        }
+        return ret;
+    }
+    return BAD_GATEWAY;
+}
+
+proxy::RESULT proxy::relay(proxy_relay& r, int client_fd)
+{
+    char buf[HEAD_BUFFER_SIZE];
+    bool upstream_ok = true;
+    bool client_ok = true;
+    while(upstream_ok && client_ok && r.pending.empty() && !body_complete(r)){
+        //数据不需要经过用户态时直接在内核中搬运
+        if(r.mode == BODY_LENGTH && !r.writer){
+            int ret = splice_body(r.fd, client_fd, r.left, r.pending);
+            upstream_ok = ret != 0;
+            client_ok = ret != -1;
+            continue;
+        }
+        size_t want = r.mode == BODY_LENGTH && r.left < (long long)sizeof(buf) ? r.left : sizeof(buf);
+        ssize_t n = recv(r.fd, buf, want, 0);
+        if(n < 0 && errno == EINTR){
+            continue;
+        }
+        if(n <= 0){
+            if(r.mode == BODY_UNTIL_CLOSE){
+                r.mode = BODY_NONE;
+            }
+            else{
+                upstream_ok = false;
+            }
+            break;
+        }
+        size_t used = n;
+        if(r.mode == BODY_LENGTH){
+            r.left -= n;
+        }
+        else if(r.mode == BODY_CHUNKED){
+            used = r.tracker.feed(buf, n);
+            upstream_ok = r.tracker.state != chunk_tracker::ERROR;
+        }
+        client_ok = deliver(r, client_fd, buf, used);
+    }
+    return finish(r, upstream_ok, client_ok);
+}
+
+proxy::RESULT proxy::finish(proxy_relay& r, bool upstream_ok, bool client_ok)
+{
+    //响应体已经全部从上游读出时立即归还上游连接，不等客户端写完
+    if(r.fd >= 0 && (!upstream_ok || !client_ok || body_complete(r))){
+        r.up->outstanding--;
+        mark(r.up, upstream_ok);
+        if(upstream_ok && client_ok && !r.upstream_close){
+            checkin(r.up, r.fd);
+        }
+        else{
+            close(r.fd);
+        }
+        r.fd = -1;
+    }
+    if(!upstream_ok || !client_ok){
+        return CLOSE;
+    }
+    if(!r.pending.empty()){
+        return PENDING;
+    }
+    return r.client_close ? CLOSE : OK;
+}
+
+proxy::RESULT proxy::resume(proxy_relay* relay, int client_fd)
+{
+    RESULT ret;
+    ssize_t n = send_client(client_fd, *relay, relay->pending.data(), relay->pending.size());
+    if(n < 0){
+        ret = finish(*relay, true, false);
+    }
+    else{
+        relay->pending.erase(0, n);
+        ret = relay->pending.empty() ? proxy::relay(*relay, client_fd) : PENDING;
+    }
+    if(ret != PENDING){
+        unpark(relay);
+        return ret;
+    }
+    long long charged = sizeof(proxy_relay) + relay->pending.capacity();
+    memory_budget::charge(MEM_CONNECTION, charged - relay->charged);
+    relay->charged = charged;
+    return ret;
+}
+
+void proxy::discard(proxy_relay* relay)
+{
+    //上游还在发送的响应没有读完，连接不能复用
+    if(relay->fd >= 0){
+        relay->up->outstanding--;
+        close(relay->fd);
+    }
+    unpark(relay);
+}
@@ -0,0 +1,108 @@
+#ifndef PROXY_H_INCLUDED
+#define PROXY_H_INCLUDED
+
+#include <netinet/in.h>
+#include <time.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include "locker.h"
+
+class micro_cache;
+struct cached_response;
+struct proxy_relay;
+
+//反向代理：把匹配前缀的请求转发给上游后端
+//每个后端维护一个空闲的长连接池，工作线程取出连接转发请求，响应完整读完后归还，避免每个请求都建立连接
+//响应体有Content-Length时用splice经过管道直接从上游socket搬到客户端socket，不经过用户态缓冲
+//客户端写满时工作线程只短暂等待，剩余的响应保存在proxy_relay中，客户端可写后再由工作线程继续转发
+//放不进读缓冲的请求体与chunked请求体由工作线程边从客户端读取边发给上游
+
+//一个上游后端
+struct upstream
+{
+    sockaddr_in addr;
+    std::string name;                   //ip:port，用于日志
+    std::vector<int> idle;              //空闲的长连接
+    locker idle_locker;                 //保护idle
+    std::atomic<int> outstanding;       //正在转发的请求数
+    std::atomic<int> fails;             //连续失败次数
+    std::atomic<long> down_until;       //在此时间之前认为后端不可用
+};
+
+//一条代理路由：url前缀与它的后端
+struct proxy_route
+{
+    std::string prefix;
+    std::vector<upstream*> backends;
+    std::atomic<unsigned> next;         //轮询的位置
+};
+
+//转发的请求，字段均指向http_conn的读缓冲
+struct proxy_request
+{
+    const char* method;
+    const char* url;
+    const char* headers;        //头部区域，每一行以'\0'结尾，行之间可能有多个'\0'
+    const char* headers_end;
+    const char* body;           //请求体已经读入读缓冲的部分
+    int body_len;
+    long long body_left;        //有Content-Length的请求体还留在客户端socket中的字节数
+    bool body_chunked;          //chunked编码的请求体，body之后的部分从客户端socket读取，直到请求体结束
+    bool keep_alive;            //客户端是否要求保持连接
+    in_addr_t client_addr;      //用于X-Forwarded-For
+    //不为NULL时通过它从客户端读数据(例如用户态TLS)，语义与recv相同
+    ssize_t (*reader)(void* ctx, char* buf, size_t len);
+    //不为NULL时通过它向客户端写数据(例如用户态TLS)，此时不能使用splice；语义与send相同
+    //返回-1且errno为EAGAIN之后，必须用以同样数据开头的缓冲重试
+    ssize_t (*writer)(void* ctx, const char* buf, size_t len);
+    void* io_ctx;               //reader与writer的参数
+};
+
+class proxy
+{
+public:
+    //转发的结果：OK表示响应已经完整发送，CLOSE表示响应已发送但连接必须关闭，
+    //BAD_GATEWAY表示还没有向客户端发送任何数据，调用者可以返回502，
+    //PENDING表示客户端写满，调用者保存得到的proxy_relay并注册EPOLLOUT，可写后调用resume
+    enum RESULT { OK, CLOSE, BAD_GATEWAY, PENDING };
+
+    //添加路由，spec形如"/api=127.0.0.1:8080,127.0.0.1:8081"
+    static bool add_route(const char* spec);
+    //true为选择正在转发请求最少的后端，false为轮询
+    static void set_least_outstanding(bool on) { m_least_outstanding = on; }
+    //查找匹配url的路由，最长前缀优先，没有时返回NULL
+    static proxy_route* match(const char* url);
+    //转发请求并把响应写回客户端，由工作线程调用，期间会阻塞等待上游
+    //返回PENDING时*parked为暂停的转发，由调用者持有
+    //cache与fill不为NULL且响应可以缓存时，响应体读入内存后再发送，*fill为创建的缓存条目
+    static RESULT forward(proxy_route* route, int client_fd, const proxy_request& req, proxy_relay** parked,
+                          micro_cache* cache = NULL, cached_response** fill = NULL);
+    //客户端可写后由工作线程调用，继续暂停的转发；返回PENDING以外的结果时relay已经释放
+    static RESULT resume(proxy_relay* relay, int client_fd);
+    //连接关闭时释放暂停的转发
+    static void discard(proxy_relay* relay);
+    //只向上游请求并生成缓存条目，不向客户端发送，用于在后台刷新过期的条目；失败或不可缓存时返回NULL
+    static cached_response* fetch(proxy_route* route, const std::string& request, micro_cache* cache);
+    //生成发给上游的请求头
+    static std::string build_request(const proxy_request& req);
+
+private:
+    static upstream* pick(proxy_route* route);
+    static int checkout(upstream* up, bool& reused);
+    static void checkin(upstream* up, int fd);
+    static void mark(upstream* up, bool ok);
+    //client_fd小于0时不向客户端发送
+    static RESULT exchange(proxy_route* route, int client_fd, const proxy_request* req, const std::string& request,
+                           proxy_relay** parked, micro_cache* cache, cached_response** fill);
+    //从上游继续读取响应体并写给客户端，直到结束、出错或客户端写满
+    static RESULT relay(proxy_relay& r, int client_fd);
+    //根据转发的状态归还或关闭上游连接，得到转发的结果
+    static RESULT finish(proxy_relay& r, bool upstream_ok, bool client_ok);
+
+private:
+    static std::vector<proxy_route*> m_routes;
+    static bool m_least_outstanding;
+};
+
+#endif // PROXY_H_INCLUDED
@@ -0,0 +1,118 @@
+#include "rate_limiter.h"
+
+#include <time.h>
+
+//槽被占用时key的高32位
+static const uint64_t KEY_USED = 1ULL << 32;
+
+rate_limiter::rate_limiter(double rate, double burst, int slots)
+{
+    //补充速度按百万分之一令牌计算，小数与小于1的速度都能表示
+    m_rate_micro = rate * 1000 >= 1 ? (uint32_t)(rate * 1000 + 0.5) : 1;
+    m_burst_milli = burst >= 1 ? (uint32_t)(burst * 1000) : 1000;
+    //时间按32位毫秒回绕比较，很慢的桶的回满时间截断到其一半以内
+    uint64_t idle = (uint64_t)m_burst_milli * 1000 / m_rate_micro + 1;
+    m_idle_ms = idle < 0x7fffffff ? (uint32_t)idle : 0x7fffffff;
+    m_shard_slots = (slots + SHARDS - 1) / SHARDS;
+    if(m_shard_slots < MAX_PROBE){
+        m_shard_slots = MAX_PROBE;
+    }
+    int total = m_shard_slots * SHARDS;
+    m_slots = new slot[total];
+    for(int i = 0; i < total; i++){
+        m_slots[i].key.store(0, std::memory_order_relaxed);
+        m_slots[i].state.store(0, std::memory_order_relaxed);
+    }
+}
+
+rate_limiter::~rate_limiter()
+{
+    delete [] m_slots;
+}
+
+uint32_t rate_limiter::now_ms()
+{
+    //粗粒度时钟由vdso提供，开销只有几纳秒
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+uint32_t rate_limiter::hash(uint32_t key)
+{
+    key ^= key >> 16;
+    key *= 0x7feb352d;
+    key ^= key >> 15;
+    key *= 0x846ca68b;
+    key ^= key >> 16;
+    return key;
+}
+
+//计算补充之后的令牌数(千分之一令牌为单位)
+//不足千分之一令牌的部分在扣减成功时丢弃，每次最多少补千分之一令牌；扣减失败时不写回，慢速的补充不会被频繁的请求截断
+uint32_t rate_limiter::refill(uint64_t state, uint32_t now) const
+{
+    uint32_t tokens = (uint32_t)(state >> 32);
+    uint32_t elapsed = now - (uint32_t)state;
+    uint64_t filled = tokens + (uint64_t)elapsed * m_rate_micro / 1000;
+    return filled > m_burst_milli ? m_burst_milli : (uint32_t)filled;
+}
+
+bool rate_limiter::take(slot& s, uint32_t now)
+{
+    uint64_t old = s.state.load(std::memory_order_relaxed);
+    while(true){
+        uint32_t tokens = refill(old, now);
+        if(tokens < 1000){
+            return false;
+        }
+        uint64_t next = ((uint64_t)(tokens - 1000) << 32) | now;
+        if(s.state.compare_exchange_weak(old, next, std::memory_order_relaxed)){
+            return true;
+        }
+    }
+}
+
+bool rate_limiter::allow(uint32_t key)
+{
+    uint32_t h = hash(key);
+    slot* shard = m_slots + (size_t)(h >> 28) * m_shard_slots;
+    uint32_t now = now_ms();
+    uint64_t tagged = KEY_USED | key;
+    uint32_t idx = h % m_shard_slots;
+
+    slot* idle = 0;
+    for(int i = 0; i < MAX_PROBE; i++){
+        slot& s = shard[(idx + i) % m_shard_slots];
+        uint64_t k = s.key.load(std::memory_order_acquire);
+        if(k == tagged){
+            return take(s, now);
+        }
+        if(k == 0){
+            //空槽，抢占它；新桶是满的
+            s.state.store(((uint64_t)m_burst_milli << 32) | now, std::memory_order_relaxed);
+            if(s.key.compare_exchange_strong(k, tagged, std::memory_order_acq_rel)){
+                return take(s, now);
+            }
+            //被其他线程抢先，可能正是同一个key
+            if(k == tagged){
+                return take(s, now);
+            }
+            continue;
+        }
+        if(!idle && now - (uint32_t)s.state.load(std::memory_order_relaxed) > m_idle_ms){
+            idle = &s;
+        }
+    }
+
+    //探测范围内没有空槽，回收一个令牌早已回满的桶；回收与原key的并发扣减之间的竞争只会造成一个令牌的误差
+    if(idle){
+        uint64_t k = idle->key.load(std::memory_order_acquire);
+        if(k != tagged && idle->key.compare_exchange_strong(k, tagged, std::memory_order_acq_rel)){
+            idle->state.store(((uint64_t)m_burst_milli << 32) | now, std::memory_order_relaxed);
+        }
+        return take(*idle, now);
+    }
+    //表已经被活跃的客户端占满，放行
+    return true;
+}
@@ -0,0 +1,44 @@
+#ifndef RATE_LIMITER_H_INCLUDED
+#define RATE_LIMITER_H_INCLUDED
+
+#include <stdint.h>
+#include <atomic>
+
+//按客户端地址限速的令牌桶表
+//表被分为若干分片，每个分片是一个开放定址的槽数组，查找与扣减令牌都只使用原子操作，不加锁
+//表满时会回收已经空闲到令牌回满的槽，仍找不到槽时放行，保证限速器本身不会拒绝正常流量
+class rate_limiter
+{
+public:
+    //rate为每秒补充的令牌数，可以是小数或小于1，burst为桶的容量，slots为表的总槽数(向上取整为分片数的倍数)
+    rate_limiter(double rate, double burst, int slots = 65536);
+    ~rate_limiter();
+
+    //为key扣减一个令牌，令牌不足时返回false
+    bool allow(uint32_t key);
+
+private:
+    //单个槽：key的高32位为占用标志，state打包了剩余令牌(千分之一令牌为单位)与上次补充的时间(毫秒)
+    struct slot
+    {
+        std::atomic<uint64_t> key;
+        std::atomic<uint64_t> state;
+    };
+
+    static const int SHARDS = 16;
+    static const int MAX_PROBE = 16;    //线性探测的最大长度
+
+    static uint32_t now_ms();
+    static uint32_t hash(uint32_t key);
+    uint32_t refill(uint64_t state, uint32_t now) const;
+    bool take(slot& s, uint32_t now);
+
+private:
+    uint32_t m_rate_micro;      //每毫秒补充的百万分之一令牌数 = 每秒补充的千分之一令牌数
+    uint32_t m_burst_milli;     //桶容量，千分之一令牌为单位
+    uint32_t m_idle_ms;         //空闲这么久的桶已经回满，可以被其他key回收
+    int m_shard_slots;          //每个分片的槽数
+    slot* m_slots;
+};
+
+#endif // RATE_LIMITER_H_INCLUDED
@@ -2,61 +2,164 @@
 #define THREAD_POOL_H_INCLUDED
 
 #include <list>
+#include <vector>
+#include <cmath>
 #include <cstdio>
+#include <ctime>
 #include <exception>
+#include <climits>
+#include <atomic>
 #include <pthread.h>
+#include <sched.h>
 #include "locker.h"//线程同步包装类
+#include "topology.h"//CPU亲和性
+
+//任务的调度类别：交互式的小请求，大文件与代理等耗时的请求，可以延后的后台请求
+enum TASK_CLASS
+{
+    CLASS_LATENCY, CLASS_BULK, CLASS_BACKGROUND, CLASS_COUNT
+};
 
 //线程池类，定义为模板类为了代码复用，模板参数T是任务类
+//T需要提供process()处理请求，以及shed()在过载时快速拒绝请求
+//每个类别一个队列，按权重加权轮询出队；每个类别可以预留若干线程，其他类别的任务不能占满这些线程
 template<typename T>
 class threadpool
 {
 public:
     //构造函数，thread_number为线程池中线程的数量，max_requests为请求队列中最多允许的等待处理的请求的数量
-    threadpool(int thread_number = 8, int max_requests = 10000);
+    //cpus非空时，第i个线程被绑定到cpus[i % cpus.size()]上
+    threadpool(int thread_number = 8, int max_requests = 10000, const std::vector<int>& cpus = std::vector<int>());
     ~threadpool();
-    //向请求队列中添加任务
-    bool append(T* request);
+    //向cls类别的请求队列中添加任务，所有队列的任务总数达到上限时返回false，由调用者拒绝该请求
+    bool append(T* request, int cls = CLASS_LATENCY);
+    //一次加锁添加count个任务，classes[i]为requests[i]的类别，只唤醒处理它们所需的线程
+    //返回放入的任务数n，队列满时requests[n]及之后的任务没有放入，由调用者拒绝
+    int append_batch(T* const* requests, const int* classes, int count);
+    //设置类别的出队权重，默认8:2:1
+    void set_weight(int cls, int weight);
+    //设置为类别预留的线程数，默认为交互式请求预留四分之一的线程
+    void set_reserved(int cls, int reserved);
+    //设置CoDel的目标排队时延与观察窗口(毫秒)，target_ms为0时关闭基于时延的丢弃
+    void set_queue_delay(int target_ms, int interval_ms = 100);
+    //排队时延持续超过目标，新连接应当在读取请求之前被拒绝；由reactor调用，不加锁
+    bool overloaded();
 
 private:
     //线程工作函数，从请求队列中取出任务并执行
     static void* worker(void* arg);
     void run();
+    //根据任务的排队时间决定是否丢弃该任务，调用时持有m_queue_locker
+    bool should_shed(long long sojourn_us, long long now_us);
+    static long long now_us();
+    //空闲线程等待任务：先有限地自旋，再让出一次CPU，最后在futex上睡眠
+    void wait_for_task();
+    //为n个新任务唤醒睡眠的线程，正在自旋的线程自己会发现任务，不计入
+    void wake(int n);
+    //以下调用时持有m_queue_locker
+    //按平滑加权轮询从未达到并发上限的类别中取出一个任务
+    bool dequeue_locked(int& cls, T*& request, long long& enqueue_us);
+    //重新计算当前可以被取出的任务数，供空闲线程不加锁检查；同时发布队列长度与队首的入队时间，供overloaded使用
+    void update_pending_locked();
+    //通知前started个线程退出并等待它们结束
+    void stop_and_join(int started);
 
 private:
+    //请求队列中的任务，记录入队时间以计算排队时延
+    struct task
+    {
+        T* request;
+        long long enqueue_us;
+    };
+    //工作线程一次取出的任务
+    struct claimed
+    {
+        T* request;
+        int cls;
+        bool shed;
+    };
+    //积压超过线程数时一个线程一次最多取出的任务数
+    static const int MAX_BATCH = 8;
+
     int m_thread_number;    //线程池中的线程数量
     int m_max_requests;     //请求队列中允许的最大请求数量
     pthread_t * m_threads;  //描述线程池的数组，大小为m_thread_number
-    std::list<T*> m_request_queue;  //请求队列
-    locker m_queue_locker;      //保护请求队列的互斥锁
-    sem m_queue_stat;       //是否有任务需要处理
-    bool m_stop;        //是否结束线程
+    std::list<task> m_queues[CLASS_COUNT];  //每个类别的请求队列
+    int m_queued;           //所有队列中的任务总数
+    int m_weight[CLASS_COUNT];      //出队权重
+    int m_credit[CLASS_COUNT];      //平滑加权轮询的当前值
+    int m_reserved[CLASS_COUNT];    //为该类别预留的线程数
+    int m_limit[CLASS_COUNT];       //该类别最多同时占用的线程数，即总数减去其他类别的预留
+    int m_running[CLASS_COUNT];     //正在处理该类别任务的线程数
+    locker m_queue_locker;      //保护请求队列与以上调度状态的互斥锁
+    std::atomic<bool> m_stop;       //是否结束线程，空闲线程自旋时不加锁检查
+
+    //自旋时长的上限(微秒)，任务的平均到达间隔超过它时自旋多半等不到任务，直接睡眠
+    static const long long MAX_SPIN_US = 50;
+    std::atomic<int> m_pending;         //可以被取出的任务数，自旋时不加锁检查
+    std::atomic<int> m_spinning;        //正在自旋的线程数
+    std::atomic<int> m_parked;          //在futex上睡眠的线程数
+    std::atomic<long long> m_spin_us;   //当前的自旋时长，由最近的到达间隔决定
+    int m_max_spinners;                 //同时自旋的线程上限，其余空闲线程直接睡眠
+    futex_event m_wakeup;
+    long long m_last_arrival_us;        //上一个任务的到达时间，由m_queue_locker保护
+    long long m_gap_ewma_us;            //到达间隔的指数移动平均，由m_queue_locker保护
+    //以下在m_queue_locker内更新，reactor判断过载时不加锁读取
+    std::atomic<int> m_backlog;         //所有队列中的任务总数
+    std::atomic<long long> m_oldest_us; //最早入队的任务的入队时间，队列为空时为0
+    std::atomic<long long> m_stall_us;  //最早的任务等待超过这么久时视为过载，为排队时延的目标加上观察窗口，0表示不按时延判断
+
+    //CoDel状态，均由m_queue_locker保护
+    long long m_target_us;          //目标排队时延
+    long long m_interval_us;        //排队时延需要持续超过目标这么久才开始丢弃
+    long long m_first_above_us;     //排队时延首次超过目标后，允许开始丢弃的时间点
+    long long m_drop_next_us;       //丢弃状态下下一次丢弃的时间点
+    int m_drop_count;               //本轮丢弃状态中已丢弃的任务数量
+    std::atomic<bool> m_dropping;   //是否处于丢弃状态，只在出队时更新
 };
 
 template<typename T>
-threadpool<T>::threadpool(int thread_number, int max_requests):
+threadpool<T>::threadpool(int thread_number, int max_requests, const std::vector<int>& cpus):
     m_thread_number(thread_number), m_max_requests(max_requests),
-    m_threads(NULL), m_stop(false)
+    m_threads(NULL), m_queued(0), m_stop(false),
+    m_pending(0), m_spinning(0), m_parked(0), m_spin_us(0),
+    m_max_spinners((thread_number + 3) / 4), m_last_arrival_us(0), m_gap_ewma_us(MAX_SPIN_US * 4),
+    m_backlog(0), m_oldest_us(0), m_stall_us(0),
+    m_target_us(5000), m_interval_us(100000), m_first_above_us(0),
+    m_drop_next_us(0), m_drop_count(0), m_dropping(false)
 {
     if(thread_number <= 0 || max_requests <= 0){
         throw std::exception();
     }
+    static const int default_weight[CLASS_COUNT] = {8, 2, 1};
+    for(int i = 0; i < CLASS_COUNT; i++){
+        m_weight[i] = default_weight[i];
+        m_credit[i] = 0;
+        m_reserved[i] = 0;
+        m_limit[i] = thread_number;
+        m_running[i] = 0;
+    }
+    set_reserved(CLASS_LATENCY, thread_number / 4);
+    m_stall_us.store(m_target_us + m_interval_us, std::memory_order_relaxed);
     //创建线程池
     m_threads = new pthread_t[m_thread_number];
     if(!m_threads){
         throw std::exception();
     }
-    //创建thread_number个线程，均设置为脱离线程
+    //创建thread_number个线程，析构时等待它们退出，排空连接后可以干净地结束进程
     for(int i = 0; i < m_thread_number; i++){
         printf("create %dth thread...\n", i + 1);
         //第三个参数是静态成员函数，第四个参数传递类的对象
         if(pthread_create(m_threads + i, NULL, worker, this) != 0){
-            delete [] m_threads;
+            stop_and_join(i);
             throw std::exception();
         }
-        if(pthread_detach(m_threads[i]) != 0){
-            delete [] m_threads;
-            throw std::exception();
+        //绑定失败不影响服务，仅打印提示
+        if(!cpus.empty()){
+            int cpu = cpus[i % cpus.size()];
+            if(!pin_thread(m_threads[i], cpu)){
+                printf("pin %dth thread to cpu %d failed\n", i + 1, cpu);
+            }
         }
     }
 }
@@ -64,25 +167,291 @@ threadpool<T>::threadpool(int thread_number, int max_requests):
 template<typename T>
 threadpool<T>::~threadpool()
 {
-    delete [] m_threads;
+    stop_and_join(m_thread_number);
+}
+
+template<typename T>
+void threadpool<T>::stop_and_join(int started)
+{
+    //正在处理的任务先完成，队列中剩下的任务不再处理，由调用者保证此时已经没有连接在等待
     m_stop = true;
+    m_wakeup.notify(INT_MAX);
+    for(int i = 0; i < started; i++){
+        pthread_join(m_threads[i], NULL);
+    }
+    delete [] m_threads;
+    m_threads = NULL;
 }
 
 template<typename T>
-bool threadpool<T>::append(T* request)
+bool threadpool<T>::append(T* request, int cls)
 {
-    //请求队列加锁，因为它被所有线程共享
+    return append_batch(&request, &cls, 1) == 1;
+}
+
+template<typename T>
+int threadpool<T>::append_batch(T* const* requests, const int* classes, int count)
+{
+    if(count <= 0){
+        return 0;
+    }
+    //请求队列加锁，因为它被所有线程共享；一批任务只加一次锁
     m_queue_locker.lock();
-    if(m_request_queue.size() > m_max_requests){
+    long long now = now_us();
+    int n = 0;
+    for(; n < count && m_queued < m_max_requests; n++){
+        int cls = classes[n];
+        if(cls < 0 || cls >= CLASS_COUNT){
+            cls = CLASS_LATENCY;
+        }
+        task t;
+        t.request = requests[n];
+        t.enqueue_us = now;
+        m_queues[cls].push_back(t);
+        m_queued++;
+    }
+    if(n == 0){
         m_queue_locker.unlock();
-        return false;
+        return 0;
+    }
+    update_pending_locked();
+    //到达越密集，空闲线程自旋等待下一个任务越划算；自旋两倍的平均间隔，覆盖大部分到达
+    //同一批的任务同时到达，按平均间隔计入一次
+    if(m_last_arrival_us != 0){
+        m_gap_ewma_us += ((now - m_last_arrival_us) / n - m_gap_ewma_us) / 8;
+    }
+    m_last_arrival_us = now;
+    m_spin_us.store(m_gap_ewma_us <= MAX_SPIN_US ? 2 * m_gap_ewma_us : 0, std::memory_order_relaxed);
+    int runnable = m_pending.load();
+    m_queue_locker.unlock();
+    //被类别并发上限挡住的任务暂时不能取出，不为它们唤醒线程
+    wake(n < runnable ? n : runnable);
+    return n;
+}
+
+template<typename T>
+void threadpool<T>::set_weight(int cls, int weight)
+{
+    if(cls < 0 || cls >= CLASS_COUNT){
+        return;
     }
-    m_request_queue.push_back(request);
+    m_queue_locker.lock();
+    m_weight[cls] = weight > 0 ? weight : 1;
     m_queue_locker.unlock();
-    m_queue_stat.post();
+}
+
+template<typename T>
+void threadpool<T>::set_reserved(int cls, int reserved)
+{
+    if(cls < 0 || cls >= CLASS_COUNT){
+        return;
+    }
+    m_queue_locker.lock();
+    m_reserved[cls] = reserved > 0 ? reserved : 0;
+    int total = 0;
+    for(int i = 0; i < CLASS_COUNT; i++){
+        total += m_reserved[i];
+    }
+    //预留之和超过线程数时，每个类别仍至少可以使用一个线程
+    for(int i = 0; i < CLASS_COUNT; i++){
+        int limit = m_thread_number - (total - m_reserved[i]);
+        m_limit[i] = limit > 0 ? limit : 1;
+    }
+    update_pending_locked();
+    m_queue_locker.unlock();
+}
+
+template<typename T>
+void threadpool<T>::set_queue_delay(int target_ms, int interval_ms)
+{
+    m_queue_locker.lock();
+    m_target_us = target_ms * 1000LL;
+    m_interval_us = interval_ms * 1000LL;
+    m_first_above_us = 0;
+    m_dropping = false;
+    m_stall_us.store(m_target_us > 0 ? m_target_us + m_interval_us : 0, std::memory_order_relaxed);
+    m_queue_locker.unlock();
+}
+
+template<typename T>
+bool threadpool<T>::overloaded()
+{
+    int backlog = m_backlog.load(std::memory_order_relaxed);
+    if(backlog >= m_max_requests){
+        return true;
+    }
+    //队列已经排空，丢弃状态要等下一次出队才会退出，不再作数
+    if(backlog == 0){
+        return false;
+    }
+    if(m_dropping.load(std::memory_order_relaxed)){
+        return true;
+    }
+    //所有线程都忙时没有出队，丢弃状态不会更新，直接看最早的任务已经等待了多久
+    long long stall = m_stall_us.load(std::memory_order_relaxed);
+    long long oldest = m_oldest_us.load(std::memory_order_relaxed);
+    return stall > 0 && oldest != 0 && now_us() - oldest >= stall;
+}
+
+template<typename T>
+long long threadpool<T>::now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+//CoDel：排队时延在一个观察窗口内始终高于目标时进入丢弃状态，
+//之后按interval/sqrt(count)的间隔逐渐加快丢弃，直到排队时延回落到目标以下
+template<typename T>
+bool threadpool<T>::should_shed(long long sojourn_us, long long now)
+{
+    if(m_target_us <= 0){
+        return false;
+    }
+    bool ok_to_drop = false;
+    if(sojourn_us < m_target_us || m_queued == 0){
+        m_first_above_us = 0;
+    }
+    else if(m_first_above_us == 0){
+        m_first_above_us = now + m_interval_us;
+    }
+    else if(now >= m_first_above_us){
+        ok_to_drop = true;
+    }
+
+    if(m_dropping){
+        if(!ok_to_drop){
+            m_dropping = false;
+            return false;
+        }
+        if(now >= m_drop_next_us){
+            m_drop_count++;
+            m_drop_next_us += (long long)(m_interval_us / sqrt((double)m_drop_count));
+            return true;
+        }
+        return false;
+    }
+    if(ok_to_drop){
+        m_dropping = true;
+        //距离上一次丢弃状态不久，从较大的丢弃频率开始
+        if(m_drop_count > 2 && now - m_drop_next_us < 8 * m_interval_us){
+            m_drop_count -= 2;
+        }
+        else{
+            m_drop_count = 1;
+        }
+        m_drop_next_us = now + (long long)(m_interval_us / sqrt((double)m_drop_count));
+        return true;
+    }
+    return false;
+}
+
+template<typename T>
+void threadpool<T>::wake(int n)
+{
+    //自旋的线程自己会发现任务，省去futex系统调用；一次系统调用唤醒所有需要的线程
+    n -= m_spinning.load();
+    int parked = m_parked.load();
+    if(n > parked){
+        n = parked;
+    }
+    if(n > 0){
+        m_wakeup.notify(n);
+    }
+}
+
+template<typename T>
+void threadpool<T>::update_pending_locked()
+{
+    int runnable = 0;
+    long long oldest = 0;
+    for(int i = 0; i < CLASS_COUNT; i++){
+        int room = m_limit[i] - m_running[i];
+        int n = (int)m_queues[i].size();
+        runnable += room <= 0 ? 0 : (n < room ? n : room);
+        if(n > 0 && (oldest == 0 || m_queues[i].front().enqueue_us < oldest)){
+            oldest = m_queues[i].front().enqueue_us;
+        }
+    }
+    m_pending.store(runnable);
+    m_backlog.store(m_queued, std::memory_order_relaxed);
+    m_oldest_us.store(oldest, std::memory_order_relaxed);
+}
+
+//nginx的平滑加权轮询：每次所有候选的当前值加上权重，取最大者，再减去候选权重之和
+//权重为8:2:1时，一轮11个任务中交互式任务占8个，且不会连续出现很长的同类序列
+template<typename T>
+bool threadpool<T>::dequeue_locked(int& cls, T*& request, long long& enqueue_us)
+{
+    int best = -1;
+    int total = 0;
+    for(int i = 0; i < CLASS_COUNT; i++){
+        if(m_queues[i].empty() || m_running[i] >= m_limit[i]){
+            continue;
+        }
+        m_credit[i] += m_weight[i];
+        total += m_weight[i];
+        if(best < 0 || m_credit[i] > m_credit[best]){
+            best = i;
+        }
+    }
+    if(best < 0){
+        return false;
+    }
+    m_credit[best] -= total;
+    cls = best;
+    request = m_queues[best].front().request;
+    enqueue_us = m_queues[best].front().enqueue_us;
+    m_queues[best].pop_front();
+    m_queued--;
+    m_running[best]++;
+    update_pending_locked();
     return true;
 }
 
+template<typename T>
+void threadpool<T>::wait_for_task()
+{
+    if(m_pending.load() > 0){
+        return;
+    }
+    long long spin_us = m_spin_us.load(std::memory_order_relaxed);
+    bool got = false;
+    if(m_spinning.fetch_add(1) < m_max_spinners && spin_us > 0){
+        long long deadline = now_us() + spin_us;
+        for(int i = 1; !got; i++){
+            cpu_relax();
+            got = m_pending.load() > 0 || m_stop;
+            //读时钟比pause贵得多，隔一段检查一次
+            if((i & 63) == 0 && !got && now_us() >= deadline){
+                sched_yield();
+                got = m_pending.load() > 0;
+                break;
+            }
+        }
+    }
+    //先减少自旋计数再检查任务，与wake的检查顺序相反，保证任务不会没人处理
+    m_spinning.fetch_sub(1);
+    if(got){
+        return;
+    }
+    while(!m_stop){
+        uint32_t seq = m_wakeup.prepare();
+        m_parked++;
+        //析构函数先设置m_stop再唤醒，在prepare之后再检查一次，不会错过退出的通知
+        if(m_pending.load() > 0 || m_stop){
+            m_parked--;
+            return;
+        }
+        m_wakeup.wait(seq);
+        m_parked--;
+        if(m_pending.load() > 0){
+            return;
+        }
+    }
+}
+
 template<typename T>
 void* threadpool<T>::worker(void* arg)
 {
@@ -92,22 +461,53 @@ void* threadpool<T>::worker(void* arg)
     return pool;
 }
 
+//处理完的任务与下一批任务的取出在同一次加锁中完成，每批任务只加一次锁
+//取出但尚未处理的任务同样计入m_running，它们已经占用了这个线程接下来的时间
 template<typename T>
 void threadpool<T>::run()
 {
+    claimed batch[MAX_BATCH];
+    int n = 0;
     while(!m_stop){
-        m_queue_stat.wait();
         m_queue_locker.lock();
-        if(m_request_queue.empty()){
-            m_queue_locker.unlock();
-            continue;
+        //归还上一批任务占用的并发额度，被上限挡住的任务可能重新可以取出
+        for(int i = 0; i < n; i++){
+            m_running[batch[i].cls]--;
+        }
+        if(n > 0){
+            update_pending_locked();
+        }
+        //积压超过线程数时多取几个，其他线程也都在忙，不会因此推迟任务的开始
+        int want = m_pending.load() / m_thread_number;
+        want = want < 1 ? 1 : (want > MAX_BATCH ? MAX_BATCH : want);
+        long long now = now_us();
+        n = 0;
+        long long enqueue_us;
+        while(n < want && dequeue_locked(batch[n].cls, batch[n].request, enqueue_us)){
+            batch[n].shed = should_shed(now - enqueue_us, now);
+            n++;
         }
-        T* request = m_request_queue.front();
-        m_request_queue.pop_front();
+        bool more = m_pending.load() > 0;
         m_queue_locker.unlock();
-        if(!request)
+        if(n == 0){
+            wait_for_task();
             continue;
-        request->process();
+        }
+        //生产者只唤醒需要的线程，之后变得可以取出的任务由取到任务的线程接力唤醒下一个
+        if(more){
+            wake(1);
+        }
+        for(int i = 0; i < n; i++){
+            if(!batch[i].request){
+                continue;
+            }
+            if(batch[i].shed){
+                batch[i].request->shed();
+            }
+            else{
+                batch[i].request->process();
+            }
+        }
     }
 }
 #endif // THREAD_POOL_H_INCLUDED
@@ -0,0 +1,79 @@
+#include "throttle.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+//网站根目录，定义在http_conn.cpp中
+extern const char* doc_root;
+
+long long throttled_download::m_rate = 0;
+
+//每次发送约100ms的数据量
+static const int SLICES_PER_SECOND = 10;
+static const size_t MIN_SLICE = 4096;
+
+static long long now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+//连接在发送途中关闭时handler的帧被销毁，由析构函数关闭文件
+struct file_guard
+{
+    int fd;
+    explicit file_guard(int f): fd(f) {}
+    ~file_guard()
+    {
+        if(fd >= 0){
+            close(fd);
+        }
+    }
+};
+
+void throttled_download::configure(int rate_kbps)
+{
+    m_rate = (long long)rate_kbps * 1024;
+}
+
+conn_task<bool> throttled_download::handle(conn_io& io)
+{
+    const coro_request& req = io.request();
+    const char* connection = req.keep_alive ? "keep-alive" : "close";
+    char path[256];
+    snprintf(path, sizeof(path), "%s%s", doc_root, req.url);
+    file_guard file(strcmp(req.method, "GET") == 0 ? open(path, O_RDONLY) : -1);
+    struct stat st;
+    char head[256];
+    if(file.fd < 0 || fstat(file.fd, &st) < 0 || !S_ISREG(st.st_mode) || !(st.st_mode & S_IROTH)){
+        int len = snprintf(head, sizeof(head), "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: %s\r\n\r\n",
+                           connection);
+        co_return co_await io.write_all(head, len) && req.keep_alive;
+    }
+    int len = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Length: %lld\r\nConnection: %s\r\n\r\n",
+                       (long long)st.st_size, connection);
+    if(!co_await io.write_all(head, len)){
+        co_return false;
+    }
+    size_t slice = m_rate / SLICES_PER_SECOND > (long long)MIN_SLICE ? m_rate / SLICES_PER_SECOND : MIN_SLICE;
+    long long start = now_ms();
+    off_t sent = 0;
+    while(sent < st.st_size){
+        size_t n = st.st_size - sent < (off_t)slice ? st.st_size - sent : slice;
+        if(!co_await io.sendfile(file.fd, sent, n)){
+            co_return false;
+        }
+        sent += n;
+        //按开始以来的平均速率计算下一块的发送时间，发送本身的耗时不会累积成误差
+        long long wait = start + sent * 1000 / m_rate - now_ms();
+        if(wait > 0 && !co_await io.sleep_for(wait)){
+            co_return false;
+        }
+    }
+    co_return req.keep_alive;
+}
@@ -0,0 +1,18 @@
+#ifndef THROTTLE_H_INCLUDED
+#define THROTTLE_H_INCLUDED
+
+#include "coro.h"
+
+//限速下载：路由到这里的文件按每个连接固定的速率发送
+//用协程按顺序写成：发送头部，然后反复发送一块、等待到按速率应当发送下一块的时间
+class throttled_download
+{
+public:
+    static void configure(int rate_kbps);
+    static conn_task<bool> handle(conn_io& io);
+
+private:
+    static long long m_rate;    //字节每秒
+};
+
+#endif // THROTTLE_H_INCLUDED
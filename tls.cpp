@@ -0,0 +1,48 @@
+#include "tls.h"
+
+#ifdef ENABLE_TLS
+
+#include <stdio.h>
+#include <openssl/err.h>
+
+SSL_CTX* tls::m_ctx = NULL;
+
+bool tls::init(const char* cert_file, const char* key_file)
+{
+    SSL_CTX* ctx = SSL_CTX_new(TLS_server_method());
+    if(!ctx){
+        return false;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    //握手完成后由OpenSSL设置TCP_ULP "tls"并装入密钥；内核或OpenSSL不支持时该选项被忽略
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    //EAGAIN之后用同一个iovec重试，但缓冲区地址可能随部分写入而变化
+    SSL_CTX_set_mode(ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    if(SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1 ||
+       SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1 ||
+       SSL_CTX_check_private_key(ctx) != 1){
+        ERR_print_errors_fp(stdout);
+        SSL_CTX_free(ctx);
+        return false;
+    }
+    m_ctx = ctx;
+    return true;
+}
+
+SSL* tls::accept(int fd)
+{
+    SSL* ssl = SSL_new(m_ctx);
+    if(!ssl){
+        return NULL;
+    }
+    SSL_set_fd(ssl, fd);
+    SSL_set_accept_state(ssl);
+    return ssl;
+}
+
+bool tls::ktls_send(SSL* ssl)
+{
+    return BIO_get_ktls_send(SSL_get_wbio(ssl)) > 0;
+}
+
+#endif // ENABLE_TLS
@@ -0,0 +1,30 @@
+#ifndef TLS_H_INCLUDED
+#define TLS_H_INCLUDED
+
+//TLS支持，编译时定义ENABLE_TLS并链接-lssl -lcrypto才会启用
+//握手在用户态由OpenSSL完成，之后OpenSSL把会话密钥装入内核TLS(TCP_ULP "tls")，
+//此时直接对socket执行writev/splice，由内核加密，发送路径仍然是零拷贝的
+//内核不支持kTLS时退回到SSL_write在用户态加密
+
+#ifdef ENABLE_TLS
+
+#include <openssl/ssl.h>
+
+class tls
+{
+public:
+    //加载证书与私钥，成功后新连接都使用TLS
+    static bool init(const char* cert_file, const char* key_file);
+    static bool enabled() { return m_ctx != NULL; }
+    //为新接受的连接创建服务端会话
+    static SSL* accept(int fd);
+    //握手完成后，判断发送方向是否已经由内核TLS接管
+    static bool ktls_send(SSL* ssl);
+
+private:
+    static SSL_CTX* m_ctx;
+};
+
+#endif // ENABLE_TLS
+
+#endif // TLS_H_INCLUDED
@@ -0,0 +1,81 @@
+#include "topology.h"
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+//与<numaif.h>中的定义一致，避免依赖libnuma
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+bool parse_cpu_list(const char* text, std::vector<int>& cpus)
+{
+    cpus.clear();
+    const char* p = text;
+    while(*p){
+        char* end = 0;
+        long first = strtol(p, &end, 10);
+        if(end == p || first < 0){
+            return false;
+        }
+        long last = first;
+        p = end;
+        if(*p == '-'){
+            p++;
+            last = strtol(p, &end, 10);
+            if(end == p || last < first){
+                return false;
+            }
+            p = end;
+        }
+        for(long cpu = first; cpu <= last; cpu++){
+            cpus.push_back((int)cpu);
+        }
+        //跳过分隔符以及文件末尾的换行
+        while(*p == ',' || *p == '\n' || *p == ' '){
+            p++;
+        }
+    }
+    return !cpus.empty();
+}
+
+bool node_cpu_list(int node, std::vector<int>& cpus)
+{
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    FILE* fp = fopen(path, "r");
+    if(!fp){
+        return false;
+    }
+    char buf[1024];
+    memset(buf, '\0', sizeof(buf));
+    bool ok = fgets(buf, sizeof(buf), fp) != NULL;
+    fclose(fp);
+    return ok && parse_cpu_list(buf, cpus);
+}
+
+bool pin_thread(pthread_t thread, int cpu)
+{
+    if(cpu < 0 || cpu >= CPU_SETSIZE){
+        return false;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+}
+
+bool prefer_numa_node(int node)
+{
+    //内核会忽略掩码的最高位，因此最多支持63个节点
+    if(node < 0 || node >= (int)(sizeof(unsigned long) * 8) - 1){
+        return false;
+    }
+    //优先在该节点上分配内存，节点内存不足时仍可以回退到其他节点
+    unsigned long mask = 1UL << node;
+    return syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, sizeof(mask) * 8) == 0;
+}
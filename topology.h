@@ -0,0 +1,18 @@
+#ifndef TOPOLOGY_H_INCLUDED
+#define TOPOLOGY_H_INCLUDED
+
+#include <vector>
+#include <pthread.h>
+
+//CPU亲和性与NUMA放置相关的辅助函数
+
+//解析形如"0-3,8,10-11"的CPU列表，成功返回true
+bool parse_cpu_list(const char* text, std::vector<int>& cpus);
+//读取某个NUMA节点上的CPU列表(/sys/devices/system/node/nodeN/cpulist)
+bool node_cpu_list(int node, std::vector<int>& cpus);
+//将线程绑定到指定的CPU上
+bool pin_thread(pthread_t thread, int cpu);
+//将当前进程之后的内存分配优先放在指定NUMA节点上
+bool prefer_numa_node(int node);
+
+#endif // TOPOLOGY_H_INCLUDED
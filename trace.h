@@ -0,0 +1,36 @@
+#ifndef TRACE_H_INCLUDED
+#define TRACE_H_INCLUDED
+
+//静态跟踪点(USDT)：每个探针编译为一条nop，位置与参数记录在ELF的.note.stapsdt中，
+//bpftrace或perf附加时才把nop换成断点，没有附加时只有一条nop的开销，生产环境不需要重新编译
+//参数都是已经算好的整数；所有探针的前两个参数为请求ID与fd，请求ID在进程内唯一，keep-alive的每个请求各不相同：
+//  accept(id, fd)                 新连接，id为它的第一个请求
+//  read_done(id, fd)              reactor读完一次EPOLLIN
+//  enqueue(id, fd, class)         交给线程池，class为TASK_CLASS
+//  dequeue(id, fd)                工作线程开始处理
+//  parse_done(id, fd, method)     请求解析完成
+//  file_resolved(id, fd, code)    stat/mmap或缓存查找结束，code为HTTP_CODE
+//  first_byte(id, fd)             响应的第一次成功写入
+//  last_byte(id, fd, bytes)       响应发送完成
+//  close(id, fd)                  连接关闭，id为正在进行或尚未开始的请求
+//例如统计线程池的排队时间：
+//  bpftrace -e 'usdt:./http_server:http_server:enqueue { @t[arg0] = nsecs; }
+//               usdt:./http_server:http_server:dequeue /@t[arg0]/ { @q = hist(nsecs - @t[arg0]); delete(@t[arg0]); }'
+//需要sys/sdt.h(systemtap-sdt-dev)，没有时探针为空；编译时定义HTTP_SERVER_NO_USDT也可以去掉探针
+
+#if !defined(HTTP_SERVER_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HTTP_SERVER_USDT 1
+#endif
+#endif
+
+#ifdef HTTP_SERVER_USDT
+#define TRACE2(name, id, fd) DTRACE_PROBE2(http_server, name, id, fd)
+#define TRACE3(name, id, fd, arg) DTRACE_PROBE3(http_server, name, id, fd, arg)
+#else
+#define TRACE2(name, id, fd) do{}while(0)
+#define TRACE3(name, id, fd, arg) do{}while(0)
+#endif
+
+#endif // TRACE_H_INCLUDED
@@ -0,0 +1,170 @@
+#include "transmit.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <linux/errqueue.h>
+
+//较旧的glibc头文件中没有这些定义
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+
+size_t transmitter::m_threshold = 0;
+int transmitter::m_notsent_lowat = 0;
+
+void transmitter::configure(size_t threshold, int notsent_lowat)
+{
+    m_threshold = threshold;
+    m_notsent_lowat = notsent_lowat;
+}
+
+bool transmitter::setup_socket(int fd)
+{
+    int on = 1;
+    //头部与响应体由TCP_CORK合并，其余情况下不需要Nagle算法再等待ACK
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if(m_notsent_lowat > 0){
+        setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &m_notsent_lowat, sizeof(m_notsent_lowat));
+    }
+    //没有SO_ZEROCOPY时内核忽略MSG_ZEROCOPY，也不会有完成通知，此时不能使用零拷贝
+    return setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0;
+}
+
+transmitter::transmitter():
+    m_next(0), m_completed(0), m_disabled(true), m_corked(false)
+{
+}
+
+transmitter::~transmitter()
+{
+    release_all();
+}
+
+void transmitter::reset(bool zerocopy)
+{
+    release_all();
+    m_next = 0;
+    m_completed = 0;
+    m_disabled = !zerocopy;
+    m_corked = false;
+}
+
+ssize_t transmitter::send(int fd, struct iovec* iv, int count)
+{
+    int first = 0;
+    while(first < count && iv[first].iov_len == 0){
+        first++;
+    }
+    if(first == count){
+        return 0;
+    }
+    //头部复制发送，在TCP_CORK下等待响应体一起发出
+    if(first < count - 1){
+        return writev(fd, iv + first, count - 1 - first);
+    }
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iv + first;
+    msg.msg_iovlen = 1;
+    ssize_t n = sendmsg(fd, &msg, MSG_ZEROCOPY);
+    if(n > 0){
+        m_next++;
+        return n;
+    }
+    //每次零拷贝发送都要占用optmem，超过上限时这一次退回复制发送
+    if(n < 0 && errno == ENOBUFS){
+        return writev(fd, iv + first, 1);
+    }
+    return n;
+}
+
+void transmitter::cork(int fd, bool on)
+{
+    if(m_corked == on){
+        return;
+    }
+    int val = on ? 1 : 0;
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &val, sizeof(val));
+    m_corked = on;
+}
+
+void transmitter::hold(release_fn release, void* handle, const char* data, size_t len)
+{
+    if(!outstanding()){
+        release(handle, data, len);
+        return;
+    }
+    held h;
+    h.seq = m_next;
+    h.release = release;
+    h.handle = handle;
+    h.data = data;
+    h.len = len;
+    m_holds.push_back(h);
+}
+
+void transmitter::release_completed()
+{
+    while(!m_holds.empty() && (int32_t)(m_completed - m_holds.front().seq) >= 0){
+        held h = m_holds.front();
+        m_holds.pop_front();
+        h.release(h.handle, h.data, h.len);
+    }
+}
+
+bool transmitter::reap(int fd)
+{
+    while(true){
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if(recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0){
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                break;
+            }
+            return false;
+        }
+        for(struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)){
+            if(!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+               !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)){
+                continue;
+            }
+            struct sock_extended_err* ee = (struct sock_extended_err*)CMSG_DATA(cm);
+            if(ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY || ee->ee_errno != 0){
+                return false;
+            }
+            //一个通知覆盖[ee_info, ee_data]范围内的发送
+            m_completed += ee->ee_data - ee->ee_info + 1;
+            if(ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED){
+                m_disabled = true;
+            }
+        }
+    }
+    release_completed();
+    //错误队列已经读空，EPOLLERR若仍然存在则来自socket本身的错误
+    int err = 0;
+    socklen_t len = sizeof(err);
+    getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    return err == 0;
+}
+
+void transmitter::release_all()
+{
+    m_completed = m_next;
+    release_completed();
+}
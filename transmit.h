@@ -0,0 +1,69 @@
+#ifndef TRANSMIT_H_INCLUDED
+#define TRANSMIT_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <deque>
+#include <sys/uio.h>
+
+//大响应体的发送：响应体超过阈值时用MSG_ZEROCOPY发送，内核直接引用页面而不复制；
+//头部仍然复制发送，TCP_CORK把头部与响应体合并成满长度的报文段
+//零拷贝发送的页面在内核发送完成前不能被修改，响应结束时引用的资源挂在连接上，
+//从socket错误队列读到完成通知后才释放
+//TCP_NOTSENT_LOWAT限制socket中尚未发送的数据量，避免大响应在发送缓冲中堆积
+class transmitter
+{
+public:
+    //与http2_body的release相同
+    typedef void (*release_fn)(void* handle, const char* data, size_t len);
+
+    //threshold为使用零拷贝的最小响应体，notsent_lowat为0时不设置
+    static void configure(size_t threshold, int notsent_lowat);
+    static bool enabled() { return m_threshold > 0; }
+    static size_t threshold() { return m_threshold; }
+    //accept之后设置socket选项，返回socket是否可以使用零拷贝
+    static bool setup_socket(int fd);
+
+    transmitter();
+    ~transmitter();
+    //新连接开始时调用，zerocopy为socket是否可以使用零拷贝
+    void reset(bool zerocopy);
+    //内核报告零拷贝的数据被复制(例如回环或不支持的网卡)时不再使用零拷贝
+    bool usable() const { return !m_disabled; }
+    //发送iv，最后一块为响应体，用MSG_ZEROCOPY发送，之前的块复制发送；返回值与writev相同
+    ssize_t send(int fd, struct iovec* iv, int count);
+    //开启或关闭TCP_CORK，关闭时内核立即发出剩余的数据
+    void cork(int fd, bool on);
+    //是否有零拷贝发送尚未收到完成通知
+    bool outstanding() const { return m_completed != m_next; }
+    bool pending() const { return outstanding() || !m_holds.empty(); }
+    //资源在目前为止的零拷贝发送全部完成后释放，没有未完成的发送时立即释放
+    void hold(release_fn release, void* handle, const char* data, size_t len);
+    //读取错误队列中的完成通知并释放已经完成的资源，socket本身出错时返回false
+    bool reap(int fd);
+    //连接关闭时释放全部资源：零拷贝只用于文件与内容包的映射，页面由内核计数引用，解除映射不影响正在发送的数据
+    void release_all();
+
+private:
+    struct held
+    {
+        uint32_t seq;           //在这个序号之前的发送全部完成后才能释放
+        release_fn release;
+        void* handle;
+        const char* data;
+        size_t len;
+    };
+    void release_completed();
+
+private:
+    static size_t m_threshold;
+    static int m_notsent_lowat;
+
+    std::deque<held> m_holds;
+    uint32_t m_next;            //下一次零拷贝发送的序号，内核对每个socket从0开始计数
+    uint32_t m_completed;       //已经完成的零拷贝发送数
+    bool m_disabled;
+    bool m_corked;
+};
+
+#endif // TRANSMIT_H_INCLUDED
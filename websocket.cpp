@@ -0,0 +1,554 @@
+#include "websocket.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "http_conn.h"
+#include "arena.h"
+#include "memory_budget.h"
+
+extern void modfd(int epollfd, int fd, int ev);
+
+locker ws_hub::m_lock;
+std::map<std::string, std::vector<ws_conn*> > ws_hub::m_channels;
+std::vector<ws_conn*> ws_hub::m_dirty;
+std::string ws_hub::m_prefix;
+WS_POLICY ws_hub::m_policy = WS_DROP_OLDEST;
+size_t ws_hub::m_max_queue = 256 * 1024;
+int ws_hub::m_event_fd = -1;
+
+//客户端帧负载的上限，服务器不使用客户端发来的数据，只需要处理控制帧
+static const size_t MAX_CLIENT_PAYLOAD = 64 * 1024;
+//一次writev最多发送的消息数
+static const int MAX_IOV = 64;
+
+//广播时每条消息都要分配一次，从当前线程的arena中分配，不与其他线程竞争malloc的锁
+static ws_message* alloc_message(size_t len)
+{
+    ws_message* msg = (ws_message*)arena_alloc(offsetof(ws_message, data) + len);
+    if(!msg){
+        return NULL;
+    }
+    memory_budget::charge(MEM_WEBSOCKET, offsetof(ws_message, data) + len);
+    new(&msg->refcnt) std::atomic<int>(1);
+    msg->pinned = false;
+    msg->len = len;
+    return msg;
+}
+
+ws_message* ws_message::create(WS_OPCODE opcode, const char* payload, size_t len)
+{
+    //服务端的帧不加掩码，同一条消息对所有订阅者都是相同的字节
+    size_t header = len < 126 ? 2 : (len <= 0xffff ? 4 : 10);
+    ws_message* msg = alloc_message(header + len);
+    if(!msg){
+        return NULL;
+    }
+    unsigned char* p = (unsigned char*)msg->data;
+    p[0] = 0x80 | opcode;
+    if(len < 126){
+        p[1] = len;
+    }
+    else if(len <= 0xffff){
+        p[1] = 126;
+        p[2] = len >> 8;
+        p[3] = len;
+    }
+    else{
+        p[1] = 127;
+        for(int i = 0; i < 8; i++){
+            p[2 + i] = (uint64_t)len >> (56 - 8 * i);
+        }
+    }
+    memcpy(p + header, payload, len);
+    return msg;
+}
+
+void ws_message::release()
+{
+    if(refcnt.fetch_sub(1, std::memory_order_acq_rel) == 1){
+        memory_budget::charge(MEM_WEBSOCKET, -(long long)(offsetof(ws_message, data) + len));
+        arena_free(this, offsetof(ws_message, data) + len);
+    }
+}
+
+//SHA-1，只用于计算握手的Sec-WebSocket-Accept
+static void sha1(const unsigned char* data, size_t len, unsigned char out[20])
+{
+    uint32_t h[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+    //补位后的消息：原始数据、0x80、若干0、64位的比特长度
+    size_t total = (len + 9 + 63) / 64 * 64;
+    std::vector<unsigned char> msg(total, 0);
+    memcpy(&msg[0], data, len);
+    msg[len] = 0x80;
+    uint64_t bits = (uint64_t)len * 8;
+    for(int i = 0; i < 8; i++){
+        msg[total - 1 - i] = bits >> (8 * i);
+    }
+    for(size_t off = 0; off < total; off += 64){
+        uint32_t w[80];
+        for(int i = 0; i < 16; i++){
+            const unsigned char* p = &msg[off + 4 * i];
+            w[i] = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+        }
+        for(int i = 16; i < 80; i++){
+            uint32_t x = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+            w[i] = (x << 1) | (x >> 31);
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for(int i = 0; i < 80; i++){
+            uint32_t f, k;
+            if(i < 20){
+                f = (b & c) | (~b & d);
+                k = 0x5a827999;
+            }
+            else if(i < 40){
+                f = b ^ c ^ d;
+                k = 0x6ed9eba1;
+            }
+            else if(i < 60){
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8f1bbcdc;
+            }
+            else{
+                f = b ^ c ^ d;
+                k = 0xca62c1d6;
+            }
+            uint32_t t = ((a << 5) | (a >> 27)) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = (b << 30) | (b >> 2);
+            b = a;
+            a = t;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+    for(int i = 0; i < 5; i++){
+        out[4 * i] = h[i] >> 24;
+        out[4 * i + 1] = h[i] >> 16;
+        out[4 * i + 2] = h[i] >> 8;
+        out[4 * i + 3] = h[i];
+    }
+}
+
+void ws_accept_key(const char* key, char* out)
+{
+    static const char* guid = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    static const char* table = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string input(key);
+    input += guid;
+    unsigned char digest[20];
+    sha1((const unsigned char*)input.data(), input.size(), digest);
+    //20字节的摘要编码为28个base64字符，最后一组只有2字节
+    int n = 0;
+    for(int i = 0; i < 20; i += 3){
+        uint32_t v = digest[i] << 16 | digest[i + 1] << 8 | (i + 2 < 20 ? digest[i + 2] : 0);
+        out[n++] = table[(v >> 18) & 0x3f];
+        out[n++] = table[(v >> 12) & 0x3f];
+        out[n++] = table[(v >> 6) & 0x3f];
+        out[n++] = i + 2 < 20 ? table[v & 0x3f] : '=';
+    }
+    out[n] = '\0';
+}
+
+void ws_unmask(char* data, size_t len, const uint8_t mask[4])
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    //掩码以4字节为周期，16字节的块从4的倍数开始，可以把掩码重复4次后直接异或
+    if(len >= 16){
+        uint32_t m;
+        memcpy(&m, mask, 4);
+        __m128i vm = _mm_set1_epi32(m);
+        for(; i + 16 <= len; i += 16){
+            __m128i v = _mm_loadu_si128((const __m128i*)(data + i));
+            _mm_storeu_si128((__m128i*)(data + i), _mm_xor_si128(v, vm));
+        }
+    }
+#else
+    if(len >= 8){
+        uint32_t m;
+        memcpy(&m, mask, 4);
+        uint64_t m64 = ((uint64_t)m << 32) | m;
+        for(; i + 8 <= len; i += 8){
+            uint64_t v;
+            memcpy(&v, data + i, 8);
+            v ^= m64;
+            memcpy(data + i, &v, 8);
+        }
+    }
+#endif
+    for(; i < len; i++){
+        data[i] ^= mask[i & 3];
+    }
+}
+
+ws_conn::ws_conn(int fd, const char* channel):
+    m_fd(fd), m_channel(channel), m_head_sent(0), m_queued_bytes(0), m_overflow(false),
+    m_closing(false), m_dropped(0), m_subscribed(false), m_dirty(false), m_index(0)
+{
+}
+
+ws_conn::~ws_conn()
+{
+    for(size_t i = 0; i < m_queue.size(); i++){
+        m_queue[i]->release();
+    }
+    if(m_dropped){
+        printf("websocket %d dropped %llu messages\n", m_fd, (unsigned long long)m_dropped);
+    }
+}
+
+void ws_conn::send_raw(const char* data, size_t len)
+{
+    ws_message* msg = alloc_message(len);
+    if(!msg){
+        return;
+    }
+    memcpy(msg->data, data, len);
+    msg->pinned = true;
+    m_lock.lock();
+    m_queue.push_front(msg);
+    m_queued_bytes += len;
+    m_lock.unlock();
+}
+
+bool ws_conn::enqueue(ws_message* msg)
+{
+    m_lock.lock();
+    if(m_closing || m_overflow){
+        m_lock.unlock();
+        return false;
+    }
+    size_t limit = ws_hub::max_queue();
+    if(m_queued_bytes + msg->len > limit){
+        WS_POLICY policy = ws_hub::policy();
+        if(policy == WS_DISCONNECT){
+            //不能在广播线程中关闭连接，交给reactor
+            m_overflow = true;
+            m_lock.unlock();
+            return true;
+        }
+        if(policy == WS_DROP_OLDEST){
+            //已经发送了一部分的队首消息必须发送完，握手响应与控制帧也不能丢弃
+            size_t i = m_head_sent > 0 ? 1 : 0;
+            while(i < m_queue.size() && m_queued_bytes + msg->len > limit){
+                ws_message* old = m_queue[i];
+                if(old->pinned){
+                    i++;
+                    continue;
+                }
+                m_queued_bytes -= old->len;
+                old->release();
+                m_queue.erase(m_queue.begin() + i);
+                m_dropped++;
+            }
+        }
+        if(m_queued_bytes + msg->len > limit){
+            m_dropped++;
+            m_lock.unlock();
+            return false;
+        }
+    }
+    bool was_empty = m_queue.empty();
+    msg->acquire();
+    m_queue.push_back(msg);
+    m_queued_bytes += msg->len;
+    m_lock.unlock();
+    //队列原本不为空时，要么已经注册了EPOLLOUT，要么已经在待发送列表中
+    return was_empty;
+}
+
+void ws_conn::enqueue_control(WS_OPCODE opcode, const char* payload, size_t len)
+{
+    ws_message* msg = ws_message::create(opcode, payload, len);
+    if(!msg){
+        return;
+    }
+    msg->pinned = true;
+    m_lock.lock();
+    size_t pos = m_head_sent > 0 ? 1 : 0;
+    if(opcode == WS_CLOSE){
+        //关闭帧之后不能再发送数据帧，丢弃还没有开始发送的消息
+        while(m_queue.size() > pos){
+            m_queued_bytes -= m_queue.back()->len;
+            m_queue.back()->release();
+            m_queue.pop_back();
+        }
+        m_closing = true;
+    }
+    m_queue.insert(m_queue.begin() + pos, msg);
+    m_queued_bytes += msg->len;
+    m_lock.unlock();
+}
+
+bool ws_conn::on_readable()
+{
+    char buf[4096];
+    while(true){
+        ssize_t n = recv(m_fd, buf, sizeof(buf), 0);
+        if(n < 0){
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                break;
+            }
+            return false;
+        }
+        if(n == 0){
+            return false;
+        }
+        m_in.append(buf, n);
+        if(m_in.size() > MAX_CLIENT_PAYLOAD * 2){
+            return false;
+        }
+    }
+
+    size_t off = 0;
+    while(!m_closing){
+        size_t avail = m_in.size() - off;
+        const unsigned char* p = (const unsigned char*)m_in.data() + off;
+        if(avail < 2){
+            break;
+        }
+        int opcode = p[0] & 0x0f;
+        bool fin = p[0] & 0x80;
+        uint64_t len = p[1] & 0x7f;
+        size_t header = 2;
+        if(len == 126){
+            header = 4;
+        }
+        else if(len == 127){
+            header = 10;
+        }
+        //客户端的帧必须加掩码，且没有协商扩展，RSV位必须为0
+        if((p[0] & 0x70) || !(p[1] & 0x80)){
+            enqueue_control(WS_CLOSE, "\x03\xea", 2);
+            break;
+        }
+        if(avail < header + 4){
+            break;
+        }
+        if(len == 126){
+            len = (p[2] << 8) | p[3];
+        }
+        else if(len == 127){
+            len = 0;
+            for(int i = 0; i < 8; i++){
+                len = (len << 8) | p[2 + i];
+            }
+        }
+        //控制帧的负载不超过125字节且不能分片
+        if((opcode & 0x8) && (len > 125 || !fin)){
+            enqueue_control(WS_CLOSE, "\x03\xea", 2);
+            break;
+        }
+        if(len > MAX_CLIENT_PAYLOAD){
+            enqueue_control(WS_CLOSE, "\x03\xf1", 2);
+            break;
+        }
+        if(avail < header + 4 + len){
+            break;
+        }
+        uint8_t mask[4];
+        memcpy(mask, p + header, 4);
+        char* payload = &m_in[off + header + 4];
+        ws_unmask(payload, len, mask);
+        off += header + 4 + len;
+        if(!handle_frame(opcode, payload, len)){
+            break;
+        }
+    }
+    m_in.erase(0, off);
+    return flush();
+}
+
+bool ws_conn::handle_frame(int opcode, char* payload, size_t len)
+{
+    switch(opcode)
+    {
+    case WS_PING:
+        enqueue_control(WS_PONG, payload, len);
+        return true;
+    case WS_PONG:
+        return true;
+    case WS_CLOSE:
+        //回显客户端的状态码后关闭连接
+        enqueue_control(WS_CLOSE, payload, len >= 2 ? 2 : 0);
+        return false;
+    case WS_CONTINUATION:
+    case WS_TEXT:
+    case WS_BINARY:
+        //客户端发来的数据不做处理，发布通过本机的POST或ws_hub::broadcast完成
+        return true;
+    default:
+        enqueue_control(WS_CLOSE, "\x03\xea", 2);
+        return false;
+    }
+}
+
+bool ws_conn::flush()
+{
+    m_lock.lock();
+    if(m_overflow){
+        m_lock.unlock();
+        return false;
+    }
+    while(!m_queue.empty()){
+        //直接引用共享的消息，不复制
+        struct iovec iov[MAX_IOV];
+        int count = 0;
+        for(size_t i = 0; i < m_queue.size() && count < MAX_IOV; i++){
+            size_t skip = i == 0 ? m_head_sent : 0;
+            iov[count].iov_base = m_queue[i]->data + skip;
+            iov[count].iov_len = m_queue[i]->len - skip;
+            count++;
+        }
+        ssize_t n = writev(m_fd, iov, count);
+        if(n < 0){
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                break;
+            }
+            m_lock.unlock();
+            return false;
+        }
+        m_queued_bytes -= n;
+        while(n > 0){
+            ws_message* head = m_queue.front();
+            size_t left = head->len - m_head_sent;
+            if((size_t)n < left){
+                m_head_sent += n;
+                break;
+            }
+            n -= left;
+            m_head_sent = 0;
+            head->release();
+            m_queue.pop_front();
+        }
+    }
+    bool done = m_closing && m_queue.empty();
+    if(!done){
+        //队列中还有数据时等待可写，始终等待客户端的控制帧
+        modfd(http_conn::m_epollfd, m_fd, m_queue.empty() ? (int)EPOLLIN : (int)(EPOLLIN | EPOLLOUT));
+    }
+    m_lock.unlock();
+    return !done;
+}
+
+bool ws_hub::init(const char* prefix, WS_POLICY policy, size_t max_queue)
+{
+    m_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(m_event_fd < 0){
+        return false;
+    }
+    m_prefix = prefix;
+    m_policy = policy;
+    m_max_queue = max_queue;
+    return true;
+}
+
+bool ws_hub::match(const char* url)
+{
+    return enabled() && strncmp(url, m_prefix.c_str(), m_prefix.size()) == 0;
+}
+
+void ws_hub::subscribe(ws_conn* conn)
+{
+    m_lock.lock();
+    std::vector<ws_conn*>& subs = m_channels[conn->channel()];
+    conn->m_index = subs.size();
+    subs.push_back(conn);
+    conn->m_subscribed = true;
+    m_lock.unlock();
+}
+
+void ws_hub::unsubscribe(ws_conn* conn)
+{
+    m_lock.lock();
+    if(conn->m_subscribed){
+        std::map<std::string, std::vector<ws_conn*> >::iterator it = m_channels.find(conn->channel());
+        std::vector<ws_conn*>& subs = it->second;
+        //用最后一个订阅者填补空位
+        subs[conn->m_index] = subs.back();
+        subs[conn->m_index]->m_index = conn->m_index;
+        subs.pop_back();
+        if(subs.empty()){
+            m_channels.erase(it);
+        }
+        conn->m_subscribed = false;
+    }
+    if(conn->m_dirty){
+        std::vector<ws_conn*>::iterator it = std::find(m_dirty.begin(), m_dirty.end(), conn);
+        if(it != m_dirty.end()){
+            *it = m_dirty.back();
+            m_dirty.pop_back();
+        }
+        conn->m_dirty = false;
+    }
+    m_lock.unlock();
+}
+
+int ws_hub::broadcast(const char* channel, WS_OPCODE opcode, const char* data, size_t len)
+{
+    //在持有锁之前完成编码，所有订阅者共享这一份
+    ws_message* msg = ws_message::create(opcode, data, len);
+    if(!msg){
+        return 0;
+    }
+    int count = 0;
+    bool wake = false;
+    m_lock.lock();
+    std::map<std::string, std::vector<ws_conn*> >::iterator it = m_channels.find(channel);
+    if(it != m_channels.end()){
+        std::vector<ws_conn*>& subs = it->second;
+        count = subs.size();
+        for(size_t i = 0; i < subs.size(); i++){
+            ws_conn* conn = subs[i];
+            if(conn->enqueue(msg) && !conn->m_dirty){
+                conn->m_dirty = true;
+                wake = wake || m_dirty.empty();
+                m_dirty.push_back(conn);
+            }
+        }
+    }
+    m_lock.unlock();
+    msg->release();
+    if(wake){
+        uint64_t one = 1;
+        ssize_t ret = ::write(m_event_fd, &one, sizeof(one));
+        (void)ret;
+    }
+    return count;
+}
+
+void ws_hub::flush_dirty(std::vector<int>& failed)
+{
+    uint64_t value;
+    while(read(m_event_fd, &value, sizeof(value)) > 0){
+    }
+    std::vector<ws_conn*> dirty;
+    m_lock.lock();
+    dirty.swap(m_dirty);
+    for(size_t i = 0; i < dirty.size(); i++){
+        dirty[i]->m_dirty = false;
+    }
+    m_lock.unlock();
+    //连接只由reactor线程关闭，这里取出的指针在循环结束前一直有效
+    for(size_t i = 0; i < dirty.size(); i++){
+        if(!dirty[i]->flush()){
+            failed.push_back(dirty[i]->fd());
+        }
+    }
+}
@@ -0,0 +1,125 @@
+#ifndef WEBSOCKET_H_INCLUDED
+#define WEBSOCKET_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include "locker.h"
+
+//WebSocket(RFC 6455)：升级之后的连接按url订阅同名频道，广播的消息只编码一次，
+//帧头与负载放在同一块引用计数的内存中，所有订阅者的发送队列引用同一块内存，用writev直接发送
+//升级完成后连接的读写全部在reactor线程中进行，广播线程只把消息放入发送队列并通过eventfd唤醒reactor
+
+//帧的操作码
+enum WS_OPCODE
+{
+    WS_CONTINUATION = 0x0, WS_TEXT = 0x1, WS_BINARY = 0x2,
+    WS_CLOSE = 0x8, WS_PING = 0x9, WS_PONG = 0xa
+};
+
+//发送队列超过上限时的处理方式：丢弃最旧的未发送消息，丢弃新消息，或断开慢客户端
+enum WS_POLICY
+{
+    WS_DROP_OLDEST, WS_DROP_NEWEST, WS_DISCONNECT
+};
+
+//编码好的服务端帧，引用计数归零时释放
+struct ws_message
+{
+    std::atomic<int> refcnt;
+    bool pinned;        //连接私有的握手响应与控制帧，队列满时不丢弃
+    size_t len;
+    char data[1];
+
+    static ws_message* create(WS_OPCODE opcode, const char* payload, size_t len);
+    void acquire() { refcnt.fetch_add(1, std::memory_order_relaxed); }
+    void release();
+};
+
+//计算Sec-WebSocket-Accept，out至少29字节
+void ws_accept_key(const char* key, char* out);
+//就地去掉客户端帧的掩码
+void ws_unmask(char* data, size_t len, const uint8_t mask[4]);
+
+class ws_conn
+{
+public:
+    ws_conn(int fd, const char* channel);
+    ~ws_conn();
+
+    //下面的函数只由reactor线程调用
+    //读取并处理客户端的帧，返回false表示连接应当关闭
+    bool on_readable();
+    //发送队列中的数据并重新注册事件，返回false表示连接应当关闭
+    bool flush();
+    //升级时保存跟在请求之后已经读到的数据，以及在队首放入101响应
+    void feed(const char* data, size_t len) { m_in.append(data, len); }
+    void send_raw(const char* data, size_t len);
+
+    //由广播线程调用，按丢弃策略放入发送队列；返回true表示需要唤醒reactor
+    bool enqueue(ws_message* msg);
+
+    const std::string& channel() const { return m_channel; }
+    int fd() const { return m_fd; }
+    //连接私有的输入缓冲，排队的消息由所有订阅者共享，单独记账
+    size_t memory() const { return m_in.capacity(); }
+
+private:
+    bool handle_frame(int opcode, char* payload, size_t len);
+    //控制帧插在正在发送的消息之后，不能打断一个已经发送了一部分的帧
+    void enqueue_control(WS_OPCODE opcode, const char* payload, size_t len);
+
+private:
+    int m_fd;
+    std::string m_channel;
+    std::string m_in;
+
+    //保护发送队列，广播线程与reactor都会访问
+    locker m_lock;
+    std::deque<ws_message*> m_queue;
+    size_t m_head_sent;         //队首消息已经发送的字节数
+    size_t m_queued_bytes;
+    bool m_overflow;            //WS_DISCONNECT策略下队列溢出，由reactor关闭连接
+    bool m_closing;             //已经发出关闭帧，发送完后关闭连接
+    uint64_t m_dropped;
+
+public:
+    //以下由ws_hub维护
+    bool m_subscribed;
+    bool m_dirty;
+    size_t m_index;             //在频道订阅者数组中的位置
+};
+
+class ws_hub
+{
+public:
+    //在prefix之下的url接受WebSocket升级，max_queue为每个连接的发送队列上限(字节)
+    static bool init(const char* prefix, WS_POLICY policy, size_t max_queue);
+    static bool enabled() { return m_event_fd >= 0; }
+    static bool match(const char* url);
+    static int event_fd() { return m_event_fd; }
+    static WS_POLICY policy() { return m_policy; }
+    static size_t max_queue() { return m_max_queue; }
+
+    static void subscribe(ws_conn* conn);
+    static void unsubscribe(ws_conn* conn);
+    //向频道的所有订阅者发送一条消息，可以由任意线程调用，返回订阅者数量
+    static int broadcast(const char* channel, WS_OPCODE opcode, const char* data, size_t len);
+    //reactor收到eventfd事件后调用，发送失败需要关闭的连接放入failed
+    static void flush_dirty(std::vector<int>& failed);
+
+private:
+    static locker m_lock;
+    static std::map<std::string, std::vector<ws_conn*> > m_channels;
+    static std::vector<ws_conn*> m_dirty;
+    static std::string m_prefix;
+    static WS_POLICY m_policy;
+    static size_t m_max_queue;
+    static int m_event_fd;
+};
+
+#endif // WEBSOCKET_H_INCLUDED